@@ -4,8 +4,11 @@
  * This has very few tunable parameters, and is designed for just the
  * most commonplace usages:
  *    - it assumes that keys are always C strings
- *    - it cannot serialize out to a file; ie. it assumes that the
- *      program does not need to save the data when exiting.
+ *    - it cannot serialize out to a file in a form that can be
+ *      modified later.  The most it can do is write a read-only
+ *      snapshot with hashtable_freeze(), which hashtable_open_frozen()
+ *      can mmap back in, for programs which would otherwise rebuild
+ *      the same large table at every startup.
  *    - likewise, it was not designed to work well with IPC.
  *    - it does not have any thread-safe locks
  *    - if HTBL_COPY_DATA is used, it assumes that any data being
@@ -21,6 +24,15 @@
 #include "hashtable.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /**
  * struct hashtable_t - Top-level structure of hash table
@@ -30,8 +42,17 @@
  * @flags:      User parameters
  * @bucket:     Array of entries
  * @algo:       User-selected algorithm to calculate hash
+ * @cmp:        User-selected function to compare keys, or NULL
+ *              to use strcmp()
  * @grow_size:  Value of @count at which the table should grow
  * @shrink_size: Value of @count at which the table should shrink
+ * @min_size:   Value of @size below which the table should not shrink.
+ *              This is HTBL_INITIAL_SIZE unless the user presized the
+ *              table with hashtable_create_sized().
+ * @resizes:    Number of times the table was resized
+ * @resize_ns:  Cumulative time spent resizing, in nanoseconds
+ * @entry_bytes: Memory allocated for entries, not counting the bucket
+ *              array or anything the user is managing
  */
 struct hashtable_t {
         size_t size;
@@ -39,8 +60,13 @@ struct hashtable_t {
         unsigned int flags;
         struct bucket_t **bucket;
         unsigned long (*algo)(const char *);
+        int (*cmp)(const char *, const char *);
         size_t grow_size;
         size_t shrink_size;
+        size_t min_size;
+        unsigned long resizes;
+        unsigned long long resize_ns;
+        size_t entry_bytes;
 };
 
 enum {
@@ -52,8 +78,7 @@ enum {
  *              does not select their own.
  * See Wikipedia article on this.
  * It could be made into 64-bit version with different consts.
- * Users may want to make a case-less version of this, for
- * things like case-insensitive databases.
+ * For a case-less version of this, see hashtable_nocase_hash().
  */
 static unsigned long
 fnv_hash(const char *s)
@@ -65,12 +90,63 @@ fnv_hash(const char *s)
         return hash;
 }
 
+/* ASCII-only tolower(), without the locale lookup */
+static inline unsigned int
+fold(unsigned int c)
+{
+        return c - 'A' < 26U ? c + ('a' - 'A') : c;
+}
+
+/**
+ * hashtable_nocase_hash - Case-insensitive version of the default
+ *                         hash algorithm
+ *
+ * Keys which differ only in ASCII case get the same hash.  The case is
+ * folded inside the hash loop, so there's no need to make a lowercase
+ * copy of a key before looking it up.  Use with hashtable_nocase_cmp().
+ */
+unsigned long
+hashtable_nocase_hash(const char *s)
+{
+        unsigned int c;
+        unsigned long hash = 0x811c9dc5;
+        while ((c = (unsigned char)(*s++)) != '\0')
+                hash = (hash * 0x01000193) ^ fold(c);
+        return hash;
+}
+
+/**
+ * hashtable_nocase_cmp - Compare keys, ignoring ASCII case
+ *
+ * Return: Zero if @a and @b are equal except for case, nonzero
+ *      otherwise, with the same sign rules as strcmp().
+ *
+ * Unlike strcasecmp(), this does not depend on the locale, which
+ * would not be safe to change while the table is in use anyway.
+ */
+int
+hashtable_nocase_cmp(const char *a, const char *b)
+{
+        unsigned int ca, cb;
+        do {
+                ca = fold((unsigned char)*a++);
+                cb = fold((unsigned char)*b++);
+        } while (ca == cb && ca != '\0');
+        return (int)ca - (int)cb;
+}
+
 static inline unsigned long
 calc_hash(struct hashtable_t *tbl, const char *s)
 {
         return tbl->algo ? tbl->algo(s) : fnv_hash(s);
 }
 
+static inline int
+keycmp(struct hashtable_t *tbl, const char *a, const char *b)
+{
+        return tbl->cmp ? tbl->cmp(a, b) : strcmp(a, b);
+}
+
 static inline int bucketi(struct hashtable_t *tbl, unsigned long hashno)
         { return hashno & (tbl->size - 1); }
 
@@ -85,20 +161,36 @@ refresh_grow_markers(struct hashtable_t *tbl)
          * The shrink size cannot just be the old grow size.
          * Instead it's new grow size divided by 3.
          */
-        tbl->shrink_size = tbl->size <= HTBL_INITIAL_SIZE
+        tbl->shrink_size = tbl->size <= tbl->min_size
                            ? 0 : tbl->grow_size / 3;
 }
 
+/* Smallest table size that can hold @count entries without growing */
+static size_t
+size_for_count(size_t count)
+{
+        size_t size = HTBL_INITIAL_SIZE;
+        while (size * 2 + 1 <= count)
+                size *= 2;
+        return size;
+}
+
 static int
 hashtable_init(struct hashtable_t *tbl, unsigned int flags,
-               unsigned long (*algo)(const char *))
+               unsigned long (*algo)(const char *), size_t size)
 {
         size_t nalloc;
 
         memset(tbl, 0, sizeof(*tbl));
         tbl->flags = flags;
         tbl->algo = algo;
-        tbl->size = HTBL_INITIAL_SIZE;
+        if (!!(flags & HTBL_NOCASE)) {
+                if (!algo)
+                        tbl->algo = hashtable_nocase_hash;
+                tbl->cmp = hashtable_nocase_cmp;
+        }
+        tbl->size = size;
+        tbl->min_size = size;
         nalloc = tbl->size * sizeof(*tbl->bucket);
         tbl->bucket = malloc(nalloc);
         if (!tbl->bucket)
@@ -108,6 +200,18 @@ hashtable_init(struct hashtable_t *tbl, unsigned int flags,
         return 0;
 }
 
+/* Size of the memory block that alloc_bucket() gets for an entry */
+static size_t
+bucket_nalloc(struct hashtable_t *tbl, const char *key, size_t datalen)
+{
+        size_t nalloc = sizeof(struct bucket_t);
+        if (!!(tbl->flags & HTBL_COPY_DATA))
+                nalloc += datalen;
+        if (!!(tbl->flags & HTBL_COPY_KEY))
+                nalloc += strlen(key) + 1;
+        return nalloc;
+}
+
 static void
 free_bucket(struct bucket_t **bucket, unsigned int size)
 {
@@ -150,26 +254,20 @@ insert_replacement(struct hashtable_t *tbl, int idx,
                 return -1;
         }
 done:
+        tbl->entry_bytes -= bucket_nalloc(tbl, old->key, old->datalen);
         free(old);
         return 0;
 }
 
-/* Grow/shrink the hash table if it's getting too full/empty */
+/* Rehash every entry into a new array of length @newsize */
 static int
-maybe_resize_table(struct hashtable_t *tbl)
+resize_table(struct hashtable_t *tbl, size_t newsize)
 {
-        size_t i, nalloc, old_size, newsize;
+        size_t i, nalloc, old_size;
         struct bucket_t **old_bucket, **new_bucket;
+        struct timespec tick, tock;
 
-        if (tbl->count >= tbl->grow_size)
-                newsize = tbl->size * 2;
-        else if (tbl->count <= tbl->shrink_size)
-                newsize = tbl->size / 2;
-        else
-                return 0;
-
-        if (newsize < HTBL_INITIAL_SIZE)
-                newsize = HTBL_INITIAL_SIZE;
+        clock_gettime(CLOCK_MONOTONIC, &tick);
 
         nalloc = newsize * sizeof(void *);
         new_bucket = malloc(nalloc);
@@ -193,9 +291,33 @@ maybe_resize_table(struct hashtable_t *tbl)
                 }
         }
         free(old_bucket);
+
+        clock_gettime(CLOCK_MONOTONIC, &tock);
+        tbl->resizes++;
+        tbl->resize_ns += (tock.tv_sec - tick.tv_sec) * 1000000000LL
+                          + (tock.tv_nsec - tick.tv_nsec);
         return 0;
 }
 
+/* Grow/shrink the hash table if it's getting too full/empty */
+static int
+maybe_resize_table(struct hashtable_t *tbl)
+{
+        size_t newsize;
+
+        if (tbl->count >= tbl->grow_size)
+                newsize = tbl->size * 2;
+        else if (tbl->count <= tbl->shrink_size)
+                newsize = tbl->size / 2;
+        else
+                return 0;
+
+        if (newsize < tbl->min_size)
+                newsize = tbl->min_size;
+
+        return resize_table(tbl, newsize);
+}
+
 /* Helper to find_entry - hashno already calc'd */
 static struct bucket_t *
 find_entry_helper(struct hashtable_t *tbl, const char *key,
@@ -205,7 +327,7 @@ find_entry_helper(struct hashtable_t *tbl, const char *key,
         struct bucket_t *b = tbl->bucket[idx];
         *i = idx;
         while (b != NULL) {
-                if (b->hash == hashno && !strcmp(b->key, key))
+                if (b->hash == hashno && !keycmp(tbl, b->key, key))
                         break;
                 b = b->next;
         }
@@ -218,68 +340,13 @@ find_entry(struct hashtable_t *tbl, const char *key, unsigned int *i)
         return find_entry_helper(tbl, key, i, calc_hash(tbl, key));
 }
 
-/**
- * hashtable_put - Put a new entry into the hash table
- * @tbl: Hash table
- * @key: Key of the key/value pair.  If the table was created with
- *      HTBL_COPY_KEY set, then a copy of @key will be stored with
- *      the hash table.  If not, then you are expected to maintain
- *      (without changing) this exact pointer.
- * @data: Data associated with @key.  If the table was created with
- *      HTBL_COPY_DATA (not recommeneded), then copy this data into
- *      the hash table.
- * @datalen: Length of data. Necessary if HTBL_COPY_DATA is set or
- *      if you'll need this info from hashtable_get() later.
- *      Don't-care otherwise.
- * @flags: If HTBL_CLOBBER, then if some data for @key is already
- *      being stored, replace it with @data.  Otherwise, fail if
- *      new data for @key already exists.  (Keep unset if
- *      HTBL_COPY_DATA was not set during hashtable_create; see note
- *      below.)
- *
- * Return: -1 if error, 0 if success.  If ENOMEM is not set, then the
- *      error is due one of the following:
- *      - HTBL_UBUCKET is set.  Call hashtable_put_bucket instead.
- *      - @key is already stored and HTBL_CLOBBER is not set.
- *
- * Note: Using HTBL_CLOBBER for a table where HTBL_COPY_DATA was not
- *      set has the potential to zombify data and therefore leak memory.
- *      Instead, wrap your call to hashtable_put() with the following
- *      subroutine:
- *
- *      (1) Call hashtable_put() without HTBL_CLOBBER.
- *          If it succeeds, you're done.
- *          If it fails and ENOMEM is not set, continue...
- *      (2) Call hashtable_get() and save return value.
- *      (3) Call hashtable_remove().
- *      (4) Properly free or clean up the return value from (2).
- *      (5) Try hashtable_put() again.
- */
-int
-hashtable_put(struct hashtable_t *tbl, const char *key,
-                void *data, size_t datalen, unsigned int flags)
+/* Allocate and fill in a new entry for @key */
+static struct bucket_t *
+alloc_bucket(struct hashtable_t *tbl, const char *key,
+             void *data, size_t datalen, unsigned long hashno)
 {
-        unsigned int i;
-        unsigned long hashno;
         size_t nalloc;
-        struct bucket_t *b, *bsave;
-
-        if (!!(tbl->flags & HTBL_UBUCKET))
-                return -1;
-
-        hashno = calc_hash(tbl, key);
-        b = find_entry_helper(tbl, key, &i, hashno);
-        if (b) {
-                if (!(flags & HTBL_CLOBBER))
-                        return -1;
-
-                if (!(tbl->flags & HTBL_COPY_DATA)) {
-                        /* clobber fast path: just update pointer */
-                        b->data = data;
-                        return 0;
-                }
-        }
-        bsave = b;
+        struct bucket_t *b;
 
         /*
          * Allocate just one block of memory, regardless of
@@ -293,15 +360,11 @@ hashtable_put(struct hashtable_t *tbl, const char *key,
          * but we cannot do that here because of the
          * HTBL_COPY_... flags, making their size be variable.
          */
-        nalloc = sizeof(*b);
-        if (!!(tbl->flags & HTBL_COPY_DATA))
-                nalloc += datalen;
-        if (!!(tbl->flags & HTBL_COPY_KEY))
-                nalloc += strlen(key) + 1;
-
+        nalloc = bucket_nalloc(tbl, key, datalen);
         b = malloc(nalloc);
         if (!b)
-                return -1;
+                return NULL;
+        tbl->entry_bytes += nalloc;
 
         b->datalen = datalen;
         b->hash = hashno;
@@ -328,6 +391,36 @@ hashtable_put(struct hashtable_t *tbl, const char *key,
                 strcpy(b->key, key);
                 break;
         }
+        return b;
+}
+
+/*
+ * Helper to hashtable_put - hashno already calc'd.
+ * Caller is responsible for resizing the table afterward.
+ */
+static int
+put_helper(struct hashtable_t *tbl, const char *key, void *data,
+           size_t datalen, unsigned int flags, unsigned long hashno)
+{
+        unsigned int i;
+        struct bucket_t *b, *bsave;
+
+        b = find_entry_helper(tbl, key, &i, hashno);
+        if (b) {
+                if (!(flags & HTBL_CLOBBER))
+                        return -1;
+
+                if (!(tbl->flags & HTBL_COPY_DATA)) {
+                        /* clobber fast path: just update pointer */
+                        b->data = data;
+                        return 0;
+                }
+        }
+        bsave = b;
+
+        b = alloc_bucket(tbl, key, data, datalen, hashno);
+        if (!b)
+                return -1;
 
         if (bsave) {
                 /* Clobber old entry */
@@ -337,11 +430,62 @@ hashtable_put(struct hashtable_t *tbl, const char *key,
                 b->next = tbl->bucket[i];
                 tbl->bucket[i] = b;
                 tbl->count++;
-                maybe_resize_table(tbl);
         }
         return 0;
 }
 
+/**
+ * hashtable_put - Put a new entry into the hash table
+ * @tbl: Hash table
+ * @key: Key of the key/value pair.  If the table was created with
+ *      HTBL_COPY_KEY set, then a copy of @key will be stored with
+ *      the hash table.  If not, then you are expected to maintain
+ *      (without changing) this exact pointer.
+ * @data: Data associated with @key.  If the table was created with
+ *      HTBL_COPY_DATA (not recommeneded), then copy this data into
+ *      the hash table.
+ * @datalen: Length of data. Necessary if HTBL_COPY_DATA is set or
+ *      if you'll need this info from hashtable_get() later.
+ *      Don't-care otherwise.
+ * @flags: If HTBL_CLOBBER, then if some data for @key is already
+ *      being stored, replace it with @data.  Otherwise, fail if
+ *      new data for @key already exists.  (Keep unset if
+ *      HTBL_COPY_DATA was not set during hashtable_create; see note
+ *      below.)
+ *
+ * Return: -1 if error, 0 if success.  If ENOMEM is not set, then the
+ *      error is due one of the following:
+ *      - HTBL_UBUCKET is set.  Call hashtable_put_bucket instead.
+ *      - @key is already stored and HTBL_CLOBBER is not set.
+ *
+ * Note: Using HTBL_CLOBBER for a table where HTBL_COPY_DATA was not
+ *      set has the potential to zombify data and therefore leak memory.
+ *      Instead, wrap your call to hashtable_put() with the following
+ *      subroutine:
+ *
+ *      (1) Call hashtable_put() without HTBL_CLOBBER.
+ *          If it succeeds, you're done.
+ *          If it fails and ENOMEM is not set, continue...
+ *      (2) Call hashtable_get() and save return value.
+ *      (3) Call hashtable_remove().
+ *      (4) Properly free or clean up the return value from (2).
+ *      (5) Try hashtable_put() again.
+ */
+int
+hashtable_put(struct hashtable_t *tbl, const char *key,
+                void *data, size_t datalen, unsigned int flags)
+{
+        if (!!(tbl->flags & HTBL_UBUCKET))
+                return -1;
+
+        if (put_helper(tbl, key, data, datalen, flags,
+                       calc_hash(tbl, key)) < 0) {
+                return -1;
+        }
+        maybe_resize_table(tbl);
+        return 0;
+}
+
 /**
  * hashtable_put_bucket - HTBL_UBUCKET version of hashtable_put
  * @tbl: Hash table.
@@ -469,6 +613,10 @@ hashtable_remove(struct hashtable_t *tbl, const char *key)
                                 p = p->next;
                         }
                 }
+                if (!(tbl->flags & HTBL_UBUCKET)) {
+                        tbl->entry_bytes -= bucket_nalloc(tbl, b->key,
+                                                          b->datalen);
+                }
                 free(b);
                 tbl->count--;
                 maybe_resize_table(tbl);
@@ -538,13 +686,179 @@ hashtable_free(struct hashtable_t *tbl,
  * If HTBL_UBUCKET is set in @flags, then disregard the other flags
  * altogether and assume that user is declaring and managing its own
  * bucket_t structs.
+ *
+ * If HTBL_NOCASE is set in @flags, then keys which differ only in
+ * ASCII case are treated as the same key.  If @algo is not NULL, it
+ * must also give the same hash for such keys.  This flag may be used
+ * along with the others.
  */
 struct hashtable_t *
 hashtable_create(unsigned int flags, unsigned long (*algo)(const char *))
+{
+        return hashtable_create_sized(flags, algo, 0);
+}
+
+/**
+ * hashtable_create_sized - Like hashtable_create, but presize the table
+ * @flags: Same as with hashtable_create()
+ * @algo: Same as with hashtable_create()
+ * @expected_count: Number of entries the table is expected to hold.
+ *
+ * Return: Newly created hash table, or NULL if out of memory.
+ *
+ * The table starts out large enough to hold @expected_count entries
+ * without having to grow, saving the full rehash that every doubling
+ * costs.  It will still grow past that if it needs to, but it will not
+ * shrink below its starting size.
+ */
+struct hashtable_t *
+hashtable_create_sized(unsigned int flags,
+                       unsigned long (*algo)(const char *),
+                       size_t expected_count)
 {
         struct hashtable_t *ret = malloc(sizeof(*ret));
-        if (ret)
-                hashtable_init(ret, flags, algo);
+        if (!ret)
+                return NULL;
+        if (hashtable_init(ret, flags, algo,
+                           size_for_count(expected_count)) < 0) {
+                free(ret);
+                return NULL;
+        }
+        return ret;
+}
+
+/**
+ * hashtable_set_cmp - Change how keys are compared for equality
+ * @tbl: Hash table, which must be empty
+ * @cmp: Function which returns zero if its two keys are equal and
+ *      nonzero otherwise, or NULL to use strcmp().  Keys which @cmp
+ *      says are equal must also have the same hash, so you usually
+ *      want to choose the @algo argument to hashtable_create() along
+ *      with this.
+ *
+ * Return: 0 if success, -1 if @tbl is not empty.
+ *
+ * This overrides the comparison chosen by HTBL_NOCASE, if it was set.
+ */
+int
+hashtable_set_cmp(struct hashtable_t *tbl,
+                  int (*cmp)(const char *, const char *))
+{
+        if (tbl->count != 0)
+                return -1;
+        tbl->cmp = cmp;
+        return 0;
+}
+
+/* Where hashtable_put_bulk() puts entry @i of its array */
+struct bulk_order_t {
+        size_t bucket;
+        size_t i;
+};
+
+/* By bucket, then array order, so later duplicates still come later */
+static int
+bulk_order_cmp(const void *a, const void *b)
+{
+        const struct bulk_order_t *oa = a, *ob = b;
+
+        if (oa->bucket != ob->bucket)
+                return oa->bucket < ob->bucket ? -1 : 1;
+        if (oa->i != ob->i)
+                return oa->i < ob->i ? -1 : 1;
+        return 0;
+}
+
+/**
+ * hashtable_put_bulk - Put many new entries into the hash table
+ * @tbl: Hash table
+ * @ent: Array of entries to put.  The .key, .data, and .datalen fields
+ *      have the same meaning as the arguments to hashtable_put().
+ * @n: Array length of @ent
+ * @flags: HTBL_CLOBBER has the same meaning as with hashtable_put().
+ *      If HTBL_UNIQUE is set, then the caller guarantees that no two
+ *      keys in @ent are the same, and that none of them are already
+ *      stored in @tbl, so the check for an existing key is skipped.
+ *      If that guarantee is broken, @tbl will have duplicates that
+ *      hashtable_get() cannot tell apart.
+ *
+ * Return: 0 if every entry was put, -1 if not.  An entry whose key is
+ *      already stored (without HTBL_CLOBBER) is skipped, and the rest
+ *      are still put.  If ENOMEM is set, some entries may not have
+ *      been tried.
+ *
+ * This is faster than calling hashtable_put() @n times, because the
+ * table is resized at most once, beforehand, and because the entries
+ * are put in bucket order rather than @ent order, so that consecutive
+ * puts touch neighboring memory.
+ */
+int
+hashtable_put_bulk(struct hashtable_t *tbl,
+                   const struct hashtable_entry_t *ent, size_t n,
+                   unsigned int flags)
+{
+        struct bulk_order_t *order;
+        unsigned long *hash;
+        size_t i;
+        int ret = 0;
+
+        if (!!(tbl->flags & HTBL_UBUCKET))
+                return -1;
+        if (n == 0)
+                return 0;
+
+        if (tbl->count + n >= tbl->grow_size) {
+                if (resize_table(tbl, size_for_count(tbl->count + n)) < 0)
+                        return -1;
+        }
+
+        hash = malloc(n * sizeof(*hash));
+        order = malloc(n * sizeof(*order));
+        if (!hash || !order) {
+                ret = -1;
+                goto out;
+        }
+
+        /*
+         * Sort @ent indices by bucket.  Only the @n entries are
+         * sorted, so a small batch into a big table stays cheap.
+         */
+        for (i = 0; i < n; i++) {
+                hash[i] = calc_hash(tbl, ent[i].key);
+                order[i].bucket = bucketi(tbl, hash[i]);
+                order[i].i = i;
+        }
+        qsort(order, n, sizeof(*order), bulk_order_cmp);
+
+        for (i = 0; i < n; i++) {
+                const struct hashtable_entry_t *e = &ent[order[i].i];
+                unsigned long hashno = hash[order[i].i];
+
+                if (!(flags & HTBL_UNIQUE)) {
+                        if (put_helper(tbl, e->key, e->data, e->datalen,
+                                       flags, hashno) < 0) {
+                                ret = -1;
+                        }
+                } else {
+                        int bi = bucketi(tbl, hashno);
+                        struct bucket_t *b;
+
+                        b = alloc_bucket(tbl, e->key, e->data,
+                                         e->datalen, hashno);
+                        if (!b) {
+                                ret = -1;
+                                break;
+                        }
+                        b->next = tbl->bucket[bi];
+                        tbl->bucket[bi] = b;
+                        tbl->count++;
+                }
+        }
+        maybe_resize_table(tbl);
+
+out:
+        free(order);
+        free(hash);
         return ret;
 }
 
@@ -606,33 +920,532 @@ hashtable_for_each_bucket(struct hashtable_t *tbl,
         return 0;
 }
 
+/**
+ * hashtable_stats - Get statistics about a hash table
+ * @tbl: Hash table
+ * @st: Pointer to statistics to fill in
+ *
+ * The resize fields of @st are kept as running totals as the table
+ * grows and shrinks.  Lookups keep no statistics, so that they stay
+ * read-only and concurrent readers don't contend; the chain and probe
+ * fields are worked out here by walking the whole bucket array, so
+ * don't call this any more often than you need to.
+ */
+void
+hashtable_stats(struct hashtable_t *tbl, struct hashtable_stats_t *st)
+{
+        unsigned long long probes = 0;
+        size_t i;
+
+        memset(st, 0, sizeof(*st));
+        for (i = 0; i < tbl->size; i++) {
+                struct bucket_t *b;
+                size_t len = 0;
+
+                for (b = tbl->bucket[i]; b != NULL; b = b->next)
+                        ++len;
+                /* Finding each of them costs 1, 2, ... len compares */
+                probes += (unsigned long long)len * (len + 1) / 2;
+                if (st->max_chain < len)
+                        st->max_chain = len;
+                if (len >= HTBL_STATS_HIST)
+                        len = HTBL_STATS_HIST - 1;
+                st->chain_hist[len]++;
+        }
+        st->count = tbl->count;
+        st->size = tbl->size;
+        st->load_factor = (double)tbl->count / (double)tbl->size;
+        st->avg_probes = tbl->count
+                         ? (double)probes / (double)tbl->count : 0.0;
+        st->max_probes = st->max_chain;
+        st->resizes = tbl->resizes;
+        st->resize_time = (double)tbl->resize_ns / 1e9;
+        st->mem_bytes = sizeof(*tbl) + tbl->size * sizeof(*tbl->bucket)
+                        + tbl->entry_bytes;
+}
+
+/*
+ * Reverse the bits of @v.  hashtable_scan() increments its cursor from
+ * the high bit down, so that a cursor stays valid across resizes; see
+ * comment there.
+ */
+static unsigned long
+rev_bits(unsigned long v)
+{
+        unsigned long s = CHAR_BIT * sizeof(v);
+        unsigned long mask = ~0UL;
+        while ((s >>= 1) > 0) {
+                mask ^= (mask << s);
+                v = ((v >> s) & mask) | ((v << s) & ~mask);
+        }
+        return v;
+}
+
+static unsigned long
+next_cursor(struct hashtable_t *tbl, unsigned long cursor)
+{
+        cursor |= ~(unsigned long)(tbl->size - 1);
+        cursor = rev_bits(cursor);
+        cursor++;
+        return rev_bits(cursor);
+}
+
+/**
+ * hashtable_scan - Act on some of the items in a hash table, starting
+ *                  where the last call left off.
+ * @tbl: Hash table
+ * @cursor: Zero to start a new scan, or the return value of the
+ *      previous call to continue one.
+ * @count: Keep visiting buckets until @action has been called at least
+ *      this many times.  At least one bucket is always visited.
+ * @action: Callback to perform the action.  If it returns any value
+ *      other than zero, hashtable_scan() will return after the current
+ *      bucket.  @action must not modify @tbl.
+ * @result: If not NULL, set to the first nonzero value @action returned
+ *      during this call, or to zero if it always returned zero.  This
+ *      tells a scan that @action stopped apart from one that only
+ *      reached @count.
+ *
+ * Return: Cursor to pass to the next call, or zero if the scan is done.
+ *
+ * Unlike hashtable_for_each(), @tbl may be modified between calls,
+ * even if that resizes it.  Items which are in @tbl for the whole scan
+ * will be visited at least once.  Items put or removed in the middle of
+ * the scan may or may not be visited.  If @tbl shrank in the middle of
+ * the scan, some items may be visited twice.
+ *
+ * This works because bucket indices are the low bits of the hash,
+ * and the cursor increments the high bits of the index first.  When
+ * the table doubles, bucket i splits into i and i + size, which
+ * come right next to each other in cursor order; when it halves, the
+ * two merge into one bucket that the cursor has either visited
+ * entirely, or not at all, except for the one it is pointing at.
+ *
+ * Typical usage:
+ *
+ *      unsigned long cursor = 0;
+ *      do {
+ *              cursor = hashtable_scan(tbl, cursor, 100, action, &res);
+ *              if (res)
+ *                      ...abandon the scan...
+ *              ...do other things, maybe change tbl...
+ *      } while (cursor != 0);
+ */
+unsigned long
+hashtable_scan(struct hashtable_t *tbl, unsigned long cursor, size_t count,
+               int (*action)(const char *, void *, size_t), int *result)
+{
+        size_t seen = 0;
+        int res = 0;
+
+        do {
+                struct bucket_t *b;
+                b = tbl->bucket[cursor & (tbl->size - 1)];
+                for (; b != NULL; b = b->next) {
+                        int r = action(b->key, b->data, b->datalen);
+                        if (!res)
+                                res = r;
+                        ++seen;
+                }
+                cursor = next_cursor(tbl, cursor);
+        } while (cursor != 0 && seen < count && res == 0);
+        if (result)
+                *result = res;
+        return cursor;
+}
+
+/**
+ * hashtable_scan_bucket - Like hashtable_scan, but meant for
+ *              hashtables created with HTBL_UBUCKET.
+ */
+unsigned long
+hashtable_scan_bucket(struct hashtable_t *tbl, unsigned long cursor,
+                      size_t count, int (*action)(struct bucket_t *),
+                      int *result)
+{
+        size_t seen = 0;
+        int res = 0;
+
+        do {
+                struct bucket_t *b;
+                b = tbl->bucket[cursor & (tbl->size - 1)];
+                for (; b != NULL; b = b->next) {
+                        int r = action(b);
+                        if (!res)
+                                res = r;
+                        ++seen;
+                }
+                cursor = next_cursor(tbl, cursor);
+        } while (cursor != 0 && seen < count && res == 0);
+        if (result)
+                *result = res;
+        return cursor;
+}
+
+/*
+ * Frozen tables
+ *
+ * File layout, all offsets relative to the start of the file, so
+ * that the file can be mmap'd anywhere:
+ *
+ *      struct frozen_hdr_t
+ *      struct frozen_slot_t[nslots]    open-addressed, linear probe
+ *      records...
+ *
+ * Each record is a struct frozen_rec_t, followed by the key and its
+ * nulchar, padded out to 8 bytes, followed by the data, also padded
+ * out to 8 bytes.  So the data has the same alignment guarantee as
+ * with HTBL_COPY_DATA.  An empty slot has an offset of zero, which
+ * can never be a record's offset, since the header is there.
+ */
+enum {
+        FROZEN_BYTEORDER = 0x01020304,
+
+        /* frozen_hdr_t.flags */
+        FROZEN_NOCASE   = 0x0001,
+};
+
+static const char FROZEN_MAGIC[8] = "HTBLFRZ";
+
+struct frozen_hdr_t {
+        char magic[8];
+        uint32_t byteorder;
+        uint32_t flags;
+        uint64_t count;
+        uint64_t nslots;
+        uint64_t size;
+};
+
+struct frozen_slot_t {
+        uint64_t hash;
+        uint64_t offset;
+};
+
+struct frozen_rec_t {
+        uint32_t keylen;
+        uint32_t datalen;
+};
+
+/**
+ * struct hashtable_frozen_t - Handle to a table opened with
+ *                             hashtable_open_frozen()
+ * @base:       Start of the mapped file
+ * @size:       Length of the mapped file
+ * @hdr:        Same as @base, for convenience
+ * @slot:       Slot array, just past @hdr
+ * @algo:       Same hash algorithm that the frozen table was built with
+ * @cmp:        Function to compare keys
+ */
+struct hashtable_frozen_t {
+        const unsigned char *base;
+        size_t size;
+        const struct frozen_hdr_t *hdr;
+        const struct frozen_slot_t *slot;
+        unsigned long (*algo)(const char *);
+        int (*cmp)(const char *, const char *);
+};
+
+static inline uint64_t frozen_align(uint64_t v)
+        { return (v + 7) & ~(uint64_t)7; }
+
+/* Offset from start of record to its data */
+static inline uint64_t frozen_data_offs(uint64_t keylen)
+        { return frozen_align(sizeof(struct frozen_rec_t) + keylen + 1); }
+
+static int
+frozen_write_rec(FILE *fp, const struct bucket_t *b, size_t keylen)
+{
+        static const char pad[8] = { 0 };
+        struct frozen_rec_t rec;
+        size_t n;
+
+        rec.keylen = keylen;
+        rec.datalen = b->datalen;
+        if (fwrite(&rec, sizeof(rec), 1, fp) != 1
+            || fwrite(b->key, keylen + 1, 1, fp) != 1) {
+                return -1;
+        }
+        n = frozen_data_offs(keylen) - sizeof(rec) - keylen - 1;
+        if (n && fwrite(pad, n, 1, fp) != 1)
+                return -1;
+        if (b->datalen && fwrite(b->data, b->datalen, 1, fp) != 1)
+                return -1;
+        n = frozen_align(b->datalen) - b->datalen;
+        if (n && fwrite(pad, n, 1, fp) != 1)
+                return -1;
+        return 0;
+}
+
+/**
+ * hashtable_freeze - Write a read-only snapshot of a hash table to a file
+ * @tbl: Hash table to write
+ * @path: File to write to.  It will be created or truncated.
+ *
+ * Return: 0 if success, -1 if error (with errno set), in which case
+ *      @path may contain garbage.
+ *
+ * For every entry in @tbl, the key and @datalen bytes of the data
+ * are written out; so @datalen must be correct, and there's no point
+ * to this if the data contains pointers.  The file can be opened with
+ * hashtable_open_frozen(), which needs the same hash algorithm that
+ * @tbl was created with.  Whether @tbl was created with HTBL_NOCASE is
+ * saved in the file, but a comparison set with hashtable_set_cmp() is
+ * not; the frozen table will compare keys with strcmp().
+ *
+ * This holds the file's whole slot array in memory while writing,
+ * which is 24 bytes per entry.  For a table with tens of millions of
+ * entries, that's still less than the table itself.
+ */
+int
+hashtable_freeze(struct hashtable_t *tbl, const char *path)
+{
+        struct frozen_hdr_t hdr;
+        struct frozen_slot_t *slot;
+        uint64_t nslots, offs;
+        size_t i;
+        FILE *fp;
+
+        /* Keep load factor at 2/3 or below */
+        nslots = tbl->count + tbl->count / 2 + 1;
+        slot = calloc(nslots, sizeof(*slot));
+        if (!slot)
+                return -1;
+
+        fp = fopen(path, "wb");
+        if (!fp)
+                goto eslot;
+
+        offs = sizeof(hdr) + nslots * sizeof(*slot);
+        if (fseeko(fp, offs, SEEK_SET) != 0)
+                goto efp;
+
+        for (i = 0; i < tbl->size; i++) {
+                struct bucket_t *b;
+                for (b = tbl->bucket[i]; b != NULL; b = b->next) {
+                        size_t keylen = strlen(b->key);
+                        uint64_t si = (uint64_t)b->hash % nslots;
+
+                        if (frozen_write_rec(fp, b, keylen) < 0)
+                                goto efp;
+
+                        while (slot[si].offset != 0) {
+                                if (++si == nslots)
+                                        si = 0;
+                        }
+                        slot[si].hash = b->hash;
+                        slot[si].offset = offs;
+                        offs += frozen_data_offs(keylen)
+                                + frozen_align(b->datalen);
+                }
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, FROZEN_MAGIC, sizeof(hdr.magic));
+        hdr.byteorder = FROZEN_BYTEORDER;
+        if (!!(tbl->flags & HTBL_NOCASE))
+                hdr.flags |= FROZEN_NOCASE;
+        hdr.count = tbl->count;
+        hdr.nslots = nslots;
+        hdr.size = offs;
+        if (fseeko(fp, 0, SEEK_SET) != 0
+            || fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+            || fwrite(slot, sizeof(*slot), nslots, fp) != nslots) {
+                goto efp;
+        }
+
+        free(slot);
+        return fclose(fp) == 0 ? 0 : -1;
+
+efp:
+        fclose(fp);
+eslot:
+        free(slot);
+        return -1;
+}
+
+/**
+ * hashtable_open_frozen - Map a file written by hashtable_freeze()
+ * @path: File to open
+ * @algo: Same hash algorithm as the one the frozen table was created
+ *      with, or NULL if it used the default.
+ *
+ * Return: Handle to the frozen table, or NULL if @path could not be
+ *      mapped (errno set) or is not a frozen table (errno = EINVAL).
+ *
+ * Nothing is parsed here, beyond a sanity check of the file header.
+ * Lookups with hashtable_frozen_get() read straight from the mapped
+ * file, so the cost of opening a table does not depend on its size.
+ */
+struct hashtable_frozen_t *
+hashtable_open_frozen(const char *path, unsigned long (*algo)(const char *))
+{
+        struct hashtable_frozen_t *fz;
+        const struct frozen_hdr_t *hdr;
+        struct stat st;
+        void *base;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+        if (fstat(fd, &st) < 0)
+                goto efd;
+        if (st.st_size < sizeof(*hdr)) {
+                errno = EINVAL;
+                goto efd;
+        }
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+                goto efd;
+        close(fd);
+
+        hdr = base;
+        if (memcmp(hdr->magic, FROZEN_MAGIC, sizeof(hdr->magic))
+            || hdr->byteorder != FROZEN_BYTEORDER
+            || hdr->size != st.st_size
+            || hdr->nslots == 0
+            || hdr->nslots > (st.st_size - sizeof(*hdr))
+                             / sizeof(struct frozen_slot_t)
+            /* hashtable_freeze() always leaves an empty slot */
+            || hdr->count >= hdr->nslots) {
+                errno = EINVAL;
+                goto emap;
+        }
+
+        fz = malloc(sizeof(*fz));
+        if (!fz)
+                goto emap;
+        fz->base = base;
+        fz->size = st.st_size;
+        fz->hdr = hdr;
+        fz->slot = (const struct frozen_slot_t *)&hdr[1];
+        fz->algo = algo;
+        fz->cmp = strcmp;
+        if (!!(hdr->flags & FROZEN_NOCASE)) {
+                if (!algo)
+                        fz->algo = hashtable_nocase_hash;
+                fz->cmp = hashtable_nocase_cmp;
+        }
+        return fz;
+
+emap:
+        munmap(base, st.st_size);
+        return NULL;
+efd:
+        close(fd);
+        return NULL;
+}
+
+/* The record at @offset, or NULL if it isn't all inside the file */
+static const struct frozen_rec_t *
+frozen_rec(struct hashtable_frozen_t *fz, uint64_t offset)
+{
+        const struct frozen_rec_t *rec;
+
+        if ((offset & 7) != 0 || offset >= fz->size
+            || fz->size - offset < sizeof(*rec)) {
+                return NULL;
+        }
+        rec = (const void *)(fz->base + offset);
+        /* keylen and datalen are 32 bits, so this can't wrap */
+        if (offset + frozen_data_offs(rec->keylen) + rec->datalen > fz->size)
+                return NULL;
+        /* The key has to end where it says, for fz->cmp() */
+        if (((const char *)&rec[1])[rec->keylen] != '\0')
+                return NULL;
+        return rec;
+}
+
+/**
+ * hashtable_frozen_get - hashtable_get() for a frozen table
+ * @fz: Table returned by hashtable_open_frozen()
+ * @key: Key to look up
+ * @len: If not NULL, the length of found data will be written here
+ *
+ * Return: Pointer to the data inside the mapped file, or NULL if
+ *      no match was found.  The pointer is valid until
+ *      hashtable_frozen_close() is called.
+ */
+const void *
+hashtable_frozen_get(struct hashtable_frozen_t *fz,
+                     const char *key, size_t *len)
+{
+        uint64_t hashno, si, n, nslots = fz->hdr->nslots;
+        const struct frozen_slot_t *s;
+
+        hashno = fz->algo ? fz->algo(key) : fnv_hash(key);
+        si = hashno % nslots;
+        /*
+         * Don't trust the file: a damaged one might have no empty
+         * slot, or records that run off the end of it.
+         */
+        for (n = 0; n < nslots; n++) {
+                s = &fz->slot[si];
+                if (s->offset == 0)
+                        break;
+                if (s->hash == hashno) {
+                        const struct frozen_rec_t *rec;
+
+                        rec = frozen_rec(fz, s->offset);
+                        if (rec && !fz->cmp((const char *)&rec[1], key)) {
+                                if (len)
+                                        *len = rec->datalen;
+                                return fz->base + s->offset
+                                       + frozen_data_offs(rec->keylen);
+                        }
+                }
+                if (++si == nslots)
+                        si = 0;
+        }
+        return NULL;
+}
+
+/**
+ * hashtable_frozen_count - Get the number of entries in a frozen table
+ */
+size_t
+hashtable_frozen_count(struct hashtable_frozen_t *fz)
+{
+        return fz->hdr->count;
+}
+
+/**
+ * hashtable_frozen_close - Unmap a frozen table and free its handle
+ * @fz: Table returned by hashtable_open_frozen().  Do not use this
+ *      pointer, or any data returned by hashtable_frozen_get(), after
+ *      this call.
+ */
+void
+hashtable_frozen_close(struct hashtable_frozen_t *fz)
+{
+        munmap((void *)fz->base, fz->size);
+        free(fz);
+}
+
 #ifdef TEST_HASHTABLE__
-# include <time.h>
 void
 hashtable_diag(const struct test_data_t *test,
                struct hashtable_t *tbl, FILE *fp)
 {
+        struct hashtable_stats_t st;
         int i;
-        int collisions = 0;
-        int max_collisions = 0;
-        for (i = 0; i < tbl->size; i++) {
-                int these_collisions = 0;
-                struct bucket_t *b = tbl->bucket[i];
-                if (!b)
-                        continue;
-                while (b->next != NULL) {
-                        ++these_collisions;
-                        ++collisions;
-                        b = b->next;
-                }
-                if (these_collisions > max_collisions)
-                        max_collisions = these_collisions;
-        }
+
+        hashtable_stats(tbl, &st);
         fprintf(fp, "   %d collisions out of %d entries\n",
-                collisions, (int)tbl->count);
+                (int)(st.count - (st.size - st.chain_hist[0])),
+                (int)st.count);
         fprintf(fp, "   Longest collision list has %d collisions\n",
-                max_collisions);
-        fprintf(fp, "   Table size is %d\n", (int)tbl->size);
+                st.max_chain ? (int)st.max_chain - 1 : 0);
+        fprintf(fp, "   Table size is %d\n", (int)st.size);
+        fprintf(fp, "   Chain lengths:");
+        for (i = 0; i < HTBL_STATS_HIST; i++)
+                fprintf(fp, " %d", (int)st.chain_hist[i]);
+        fprintf(fp, "\n   Probes per lookup: %G ave, %d max\n",
+                st.avg_probes, (int)st.max_probes);
+        fprintf(fp, "   %lu resizes took %G microsec\n",
+                st.resizes, st.resize_time * 1e6);
+        fprintf(fp, "   Memory footprint: %lu bytes\n",
+                (unsigned long)st.mem_bytes);
         if (test->num_lookups > 0) {
                 double max = test->max_lookup_time * 1e6;
                 double sum = test->sum_lookup_time * 1e6;
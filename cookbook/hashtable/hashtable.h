@@ -14,9 +14,14 @@ enum {
         HTBL_COPY_DATA  = 0x0001,
         HTBL_COPY_KEY   = 0x0002,
         HTBL_UBUCKET    = 0x0004,
+        HTBL_NOCASE     = 0x0010,
 
-        /* parameter for hashtable_put */
+        /* parameters for hashtable_put and hashtable_put_bulk */
         HTBL_CLOBBER    = 0x0004,
+        HTBL_UNIQUE     = 0x0008,
+
+        /* Array length of hashtable_stats_t.chain_hist */
+        HTBL_STATS_HIST = 8,
 };
 
 /**
@@ -43,13 +48,67 @@ struct bucket_t {
         };
 };
 
+/**
+ * struct hashtable_entry_t - One entry for hashtable_put_bulk
+ * @key: Same as @key argument to hashtable_put
+ * @data: Same as @data argument to hashtable_put
+ * @datalen: Same as @datalen argument to hashtable_put
+ */
+struct hashtable_entry_t {
+        const char *key;
+        void *data;
+        size_t datalen;
+};
+
+/**
+ * struct hashtable_stats_t - Statistics from hashtable_stats
+ * @count: Number of entries in the table
+ * @size: Number of buckets in the table
+ * @load_factor: @count divided by @size
+ * @chain_hist: Histogram of collision-chain lengths.  Element i is
+ *      the number of buckets with i entries, except for the last
+ *      element, which is the number of buckets with that many or more.
+ * @max_chain: Number of entries in the longest chain
+ * @avg_probes: Average number of entries a lookup compares to find
+ *      a key that's in the table, over all the keys in it
+ * @max_probes: Most entries a lookup can compare, which is @max_chain
+ * @resizes: Number of times the table grew or shrank
+ * @resize_time: Total time spent resizing, in seconds
+ * @mem_bytes: Memory allocated by the table, including any copied keys
+ *      and data, but not including what the user is managing
+ */
+struct hashtable_stats_t {
+        size_t count;
+        size_t size;
+        double load_factor;
+        size_t chain_hist[HTBL_STATS_HIST];
+        size_t max_chain;
+        double avg_probes;
+        size_t max_probes;
+        unsigned long resizes;
+        double resize_time;
+        size_t mem_bytes;
+};
+
 struct hashtable_t;
+struct hashtable_frozen_t;
 
 /* Functions documented with their implementation in hashtable.c */
 
 extern struct hashtable_t *hashtable_create(unsigned int flags,
                                 unsigned long (*algo)(const char *));
 
+extern struct hashtable_t *hashtable_create_sized(unsigned int flags,
+                                unsigned long (*algo)(const char *),
+                                size_t expected_count);
+
+extern int hashtable_set_cmp(struct hashtable_t *tbl,
+                             int (*cmp)(const char *, const char *));
+
+extern unsigned long hashtable_nocase_hash(const char *s);
+
+extern int hashtable_nocase_cmp(const char *a, const char *b);
+
 extern void hashtable_free(struct hashtable_t *tbl,
                            void (*cleanup)(char *, void *));
 
@@ -59,6 +118,10 @@ extern int hashtable_put(struct hashtable_t *tbl, const char *key,
 extern int hashtable_put_bucket(struct hashtable_t *tbl,
                                 struct bucket_t *bucket);
 
+extern int hashtable_put_bulk(struct hashtable_t *tbl,
+                const struct hashtable_entry_t *ent, size_t n,
+                unsigned int flags);
+
 extern void *hashtable_get(struct hashtable_t *tbl,
                         const char *key, size_t *len);
 
@@ -73,6 +136,29 @@ extern int hashtable_for_each(struct hashtable_t *tbl,
 extern int hashtable_for_each_bucket(struct hashtable_t *tbl,
                                 int (*action)(struct bucket_t *));
 
+extern void hashtable_stats(struct hashtable_t *tbl,
+                            struct hashtable_stats_t *st);
+
+extern unsigned long hashtable_scan(struct hashtable_t *tbl,
+                unsigned long cursor, size_t count,
+                int (*action)(const char *, void *, size_t), int *result);
+
+extern unsigned long hashtable_scan_bucket(struct hashtable_t *tbl,
+                unsigned long cursor, size_t count,
+                int (*action)(struct bucket_t *), int *result);
+
+extern int hashtable_freeze(struct hashtable_t *tbl, const char *path);
+
+extern struct hashtable_frozen_t *hashtable_open_frozen(const char *path,
+                                unsigned long (*algo)(const char *));
+
+extern const void *hashtable_frozen_get(struct hashtable_frozen_t *fz,
+                                        const char *key, size_t *len);
+
+extern size_t hashtable_frozen_count(struct hashtable_frozen_t *fz);
+
+extern void hashtable_frozen_close(struct hashtable_frozen_t *fz);
+
 # ifdef TEST_HASHTABLE__
 #  include <stdio.h>
 struct test_data_t {
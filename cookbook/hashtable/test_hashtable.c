@@ -8,8 +8,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 static int
 init_schedule(void)
@@ -86,6 +88,302 @@ simple_sanity_test(void)
         hashtable_free(tbl, mycleanup);
 }
 
+/*
+ * Layout of a frozen file, from hashtable.c: header of magic[8],
+ * byteorder, flags, count, nslots, size, then {hash, offset} slots,
+ * then records starting with keylen and datalen.
+ */
+enum {
+        FZ_COUNT = 16,
+        FZ_NSLOTS = 24,
+        FZ_SLOTS = 40,
+};
+
+static uint64_t
+get64(const unsigned char *p)
+{
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+        memcpy(p, &v, sizeof(v));
+}
+
+/* Copy @len bytes at @buf to @path, for hashtable_open_frozen() */
+static void
+write_file(const char *path, const void *buf, size_t len)
+{
+        FILE *fp = fopen(path, "wb");
+        assert(fp);
+        assert(fwrite(buf, 1, len, fp) == len);
+        assert(fclose(fp) == 0);
+}
+
+/* Make sure damaged copies of frozen table @path don't hurt lookups */
+static void
+frozen_damaged_test(const char *path)
+{
+        struct hashtable_frozen_t *fz;
+        unsigned char *buf, *orig, *slot;
+        uint64_t i, nslots, off;
+        size_t len;
+        FILE *fp;
+        uint32_t big = 0x7fffffff;
+
+        fp = fopen(path, "rb");
+        assert(fp);
+        fseek(fp, 0, SEEK_END);
+        len = ftell(fp);
+        rewind(fp);
+        orig = malloc(len);
+        buf = malloc(len);
+        assert(orig && buf);
+        assert(fread(orig, 1, len, fp) == len);
+        fclose(fp);
+        nslots = get64(orig + FZ_NSLOTS);
+
+        /* No room for an empty slot */
+        memcpy(buf, orig, len);
+        put64(buf + FZ_COUNT, nslots);
+        write_file(path, buf, len);
+        errno = 0;
+        assert(hashtable_open_frozen(path, NULL) == NULL && errno == EINVAL);
+
+        /* No empty slot anyway: a missing key mustn't probe forever */
+        memcpy(buf, orig, len);
+        for (i = 0; i < nslots; i++) {
+                slot = buf + FZ_SLOTS + i * 16;
+                if (get64(slot + 8) == 0)
+                        put64(slot + 8, 8);
+        }
+        write_file(path, buf, len);
+        fz = hashtable_open_frozen(path, NULL);
+        assert(fz);
+        assert(hashtable_frozen_get(fz, "key1000", NULL) == NULL);
+        assert(*(const long *)hashtable_frozen_get(fz, "key7", NULL) == 7);
+        hashtable_frozen_close(fz);
+
+        /* Every record's key, then data, runs off the end */
+        for (i = 0; i < 2; i++) {
+                uint64_t j;
+
+                memcpy(buf, orig, len);
+                for (j = 0; j < nslots; j++) {
+                        off = get64(buf + FZ_SLOTS + j * 16 + 8);
+                        if (off)
+                                memcpy(buf + off + i * 4, &big, 4);
+                }
+                write_file(path, buf, len);
+                fz = hashtable_open_frozen(path, NULL);
+                assert(fz);
+                assert(hashtable_frozen_get(fz, "key7", NULL) == NULL);
+                assert(hashtable_frozen_get(fz, "odd", NULL) == NULL);
+                hashtable_frozen_close(fz);
+        }
+
+        write_file(path, orig, len);
+        free(orig);
+        free(buf);
+}
+
+/* Round-trip a table through hashtable_freeze/hashtable_open_frozen */
+static void
+frozen_test(void)
+{
+        struct hashtable_t *tbl;
+        struct hashtable_frozen_t *fz;
+        char path[] = "/tmp/test_hashtableXXXXXX";
+        char key[32];
+        const long *data;
+        size_t len;
+        long i;
+        int fd, res;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        tbl = hashtable_create(HTBL_COPY_KEY | HTBL_COPY_DATA, NULL);
+        assert(tbl);
+        for (i = 0; i < 1000; i++) {
+                sprintf(key, "key%ld", i);
+                res = hashtable_put(tbl, key, &i, sizeof(i), 0);
+                assert(res == 0);
+        }
+        /* Odd-length data, to check padding */
+        res = hashtable_put(tbl, "odd", "abc", 3, 0);
+        assert(res == 0);
+        res = hashtable_freeze(tbl, path);
+        assert(res == 0);
+        hashtable_free(tbl, NULL);
+
+        fz = hashtable_open_frozen(path, NULL);
+        assert(fz);
+        assert(hashtable_frozen_count(fz) == 1001);
+        for (i = 0; i < 1000; i++) {
+                sprintf(key, "key%ld", i);
+                data = hashtable_frozen_get(fz, key, &len);
+                assert(data != NULL);
+                assert(len == sizeof(long));
+                assert(*data == i);
+        }
+        assert(!strcmp(hashtable_frozen_get(fz, "odd", &len), "abc"));
+        assert(len == 3);
+        assert(hashtable_frozen_get(fz, "key1000", NULL) == NULL);
+        hashtable_frozen_close(fz);
+        frozen_damaged_test(path);
+        unlink(path);
+}
+
+/* Check hashtable_create_sized and hashtable_put_bulk */
+static void
+bulk_test(void)
+{
+        enum { N = 5000 };
+        static struct hashtable_entry_t ent[N];
+        static char keys[N][16];
+        static long vals[N];
+        struct hashtable_t *tbl;
+        struct hashtable_stats_t st;
+        long *data;
+        int i, res;
+
+        for (i = 0; i < N; i++) {
+                sprintf(keys[i], "bulk%d", i);
+                vals[i] = i;
+                ent[i].key = keys[i];
+                ent[i].data = &vals[i];
+                ent[i].datalen = sizeof(vals[i]);
+        }
+
+        tbl = hashtable_create_sized(0, NULL, N);
+        assert(tbl);
+        /* Nothing to put is not an error */
+        assert(hashtable_put_bulk(tbl, ent, 0, 0) == 0);
+        /* First half with guaranteed-unique keys */
+        res = hashtable_put_bulk(tbl, ent, N / 2, HTBL_UNIQUE);
+        assert(res == 0);
+        /* All of them, so first half collides and is skipped */
+        res = hashtable_put_bulk(tbl, ent, N, 0);
+        assert(res == -1);
+        for (i = 0; i < N; i++) {
+                data = hashtable_get(tbl, keys[i], NULL);
+                assert(data == &vals[i]);
+        }
+        /* Presized, so it never should have needed to grow */
+        hashtable_stats(tbl, &st);
+        assert(st.count == N);
+        assert(st.resizes == 0);
+        assert(st.avg_probes >= 1.0 && st.max_probes == st.max_chain);
+        for (i = 0; i < N; i++)
+                assert(hashtable_remove(tbl, keys[i]));
+        assert(hashtable_get(tbl, keys[0], NULL) == NULL);
+        hashtable_free(tbl, NULL);
+}
+
+/* Check HTBL_NOCASE, including through a frozen table */
+static void
+nocase_test(void)
+{
+        struct hashtable_t *tbl;
+        struct hashtable_frozen_t *fz;
+        char path[] = "/tmp/test_hashtableXXXXXX";
+        int one = 1, two = 2, res, fd;
+
+        tbl = hashtable_create(HTBL_COPY_KEY | HTBL_NOCASE, NULL);
+        assert(tbl);
+        res = hashtable_put(tbl, "Hello", &one, sizeof(one), 0);
+        assert(res == 0);
+        res = hashtable_put(tbl, "hELLO", &two, sizeof(two), 0);
+        assert(res == -1);
+        res = hashtable_put(tbl, "Hello!", &two, sizeof(two), 0);
+        assert(res == 0);
+        assert(hashtable_get(tbl, "HELLO", NULL) == &one);
+        assert(hashtable_get(tbl, "hello!", NULL) == &two);
+        assert(hashtable_get(tbl, "hell", NULL) == NULL);
+        assert(hashtable_set_cmp(tbl, NULL) == -1);
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        res = hashtable_freeze(tbl, path);
+        assert(res == 0);
+        hashtable_free(tbl, NULL);
+
+        fz = hashtable_open_frozen(path, NULL);
+        assert(fz);
+        assert(*(int *)hashtable_frozen_get(fz, "hello", NULL) == 1);
+        assert(*(int *)hashtable_frozen_get(fz, "HELLO!", NULL) == 2);
+        hashtable_frozen_close(fz);
+        unlink(path);
+
+        assert(hashtable_nocase_cmp("abc[", "ABC{") < 0);
+        assert(hashtable_nocase_hash("MiXeD")
+               == hashtable_nocase_hash("mixed"));
+}
+
+static int scan_seen[1000];
+
+static int
+scan_action(const char *key, void *data, size_t len)
+{
+        long i = *(long *)data;
+        if (i < 1000)
+                ++scan_seen[i];
+        return 0;
+}
+
+static int
+scan_stop(const char *key, void *data, size_t len)
+{
+        return *(long *)data == 500 ? 7 : 0;
+}
+
+/* Check that hashtable_scan sees everything, through resizes */
+static void
+scan_test(void)
+{
+        struct hashtable_t *tbl;
+        unsigned long cursor = 0;
+        char key[32];
+        long i, next = 0;
+        int res;
+
+        tbl = hashtable_create(HTBL_COPY_KEY | HTBL_COPY_DATA, NULL);
+        assert(tbl);
+        for (; next < 1000; next++) {
+                sprintf(key, "scan%ld", next);
+                res = hashtable_put(tbl, key, &next, sizeof(next), 0);
+                assert(res == 0);
+        }
+        do {
+                cursor = hashtable_scan(tbl, cursor, 10, scan_action,
+                                        &res);
+                assert(res == 0);
+                /* Grow the table out from under the cursor */
+                for (i = 0; i < 20; i++, next++) {
+                        sprintf(key, "scan%ld", next);
+                        res = hashtable_put(tbl, key, &next,
+                                            sizeof(next), 0);
+                        assert(res == 0);
+                }
+        } while (cursor != 0);
+        for (i = 0; i < 1000; i++)
+                assert(scan_seen[i] == 1);
+
+        /* A stop from @action is told apart from a paused scan */
+        cursor = 0;
+        do {
+                cursor = hashtable_scan(tbl, cursor, 10, scan_stop, &res);
+        } while (cursor != 0 && res == 0);
+        assert(res == 7);
+        hashtable_free(tbl, NULL);
+}
+
 static void
 inperr(struct hashtable_t *tbl, int line, char *msg, ...)
 {
@@ -211,6 +509,10 @@ main(int argc, char **argv)
         }
 
         simple_sanity_test();
+        frozen_test();
+        bulk_test();
+        scan_test();
+        nocase_test();
         if (!skip_input)
                 input_test(fpin ? fpin : stdin);
 
@@ -0,0 +1,234 @@
+/*
+ * bench_json.c - Compare json_parse(), json_parse_buf(),
+ *                json_parse_buf_arena(), and json_read() speeds,
+ *                and time json_write() and json_bin_decode()
+ *
+ * Usage: json_bench FILE [FILE...]
+ *
+ * Each FILE is read into memory first, and json_parse() reads it from
+ * there through fmemopen(), so that neither parser is timing the disk.
+ * Good test files are the usual JSON benchmark corpora, e.g.
+ * twitter.json, canada.json, and citm_catalog.json.
+ */
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+        /* Repeat each parse for about this long */
+        BENCH_NSEC = 500 * 1000 * 1000,
+};
+
+static long long
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static char *
+slurp(const char *path, size_t *len)
+{
+        FILE *fp = fopen(path, "rb");
+        char *buf = NULL;
+        long n;
+
+        if (!fp)
+                return NULL;
+        if (fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) >= 0) {
+                rewind(fp);
+                buf = malloc(n ? n : 1);
+                if (buf && fread(buf, 1, n, fp) != (size_t)n) {
+                        free(buf);
+                        buf = NULL;
+                }
+                *len = n;
+        }
+        fclose(fp);
+        return buf;
+}
+
+static struct json_t *
+parse_file(char *buf, size_t len)
+{
+        struct json_t *j;
+        FILE *fp = fmemopen(buf, len, "r");
+        if (!fp)
+                return NULL;
+        j = json_parse(fp);
+        fclose(fp);
+        return j;
+}
+
+static struct json_t *
+parse_buf(char *buf, size_t len)
+{
+        return json_parse_buf(buf, len);
+}
+
+static struct json_arena_t *arena;
+
+static struct json_t *
+parse_arena(char *buf, size_t len)
+{
+        json_arena_reset(arena);
+        return json_parse_buf_arena(buf, len, arena);
+}
+
+/* Stand-in for a tree, for bench()'s sake */
+static struct json_t pull_dummy = { .flags = JSON_ARENA };
+
+/* Read every event, without doing anything with them */
+static struct json_t *
+parse_pull(char *buf, size_t len)
+{
+        struct json_reader_t r;
+        enum json_event_t ev;
+
+        json_reader_init(&r, buf, len);
+        while ((ev = json_read(&r)) > JSON_EV_EOF)
+                ;
+        return ev == JSON_EV_EOF ? &pull_dummy : NULL;
+}
+
+static struct json_bin_t bin;
+
+/* Decode the binary encoding of the same file, set up by main() */
+static struct json_t *
+parse_bin(char *buf, size_t len)
+{
+        /* Decodes the global bin, not @buf */
+        (void)buf;
+        (void)len;
+        json_arena_reset(arena);
+        return json_bin_decode(&bin, json_bin_root(&bin), arena);
+}
+
+/*
+ * Encode @buf's tree for parse_bin() into @out, return -1 if it
+ * doesn't parse
+ */
+static int
+setup_bin(struct json_buf_t *out, char *buf, size_t len)
+{
+        struct json_t *j;
+
+        json_arena_reset(arena);
+        j = json_parse_buf_arena(buf, len, arena);
+        out->len = 0;
+        if (!j || json_bin_encode(out, j) < 0)
+                return -1;
+        return json_bin_init(&bin, out->p, out->len);
+}
+
+/* Return throughput in MB/s, or a negative number if parse failed */
+static double
+bench(struct json_t *(*parse)(char *, size_t), char *buf, size_t len)
+{
+        long long start = now_ns(), elapsed;
+        long iter = 0;
+
+        do {
+                struct json_t *j = parse(buf, len);
+                if (!j)
+                        return -1.0;
+                if (!(j->flags & JSON_ARENA))
+                        json_free(j);
+                ++iter;
+                elapsed = now_ns() - start;
+        } while (elapsed < BENCH_NSEC);
+
+        return (double)len * iter / 1e6 / ((double)elapsed / 1e9);
+}
+
+/*
+ * Return json_write()'s throughput in MB/s of output, or a negative
+ * number if it failed
+ */
+static double
+bench_write(char *buf, size_t len, int flags)
+{
+        struct json_buf_t out = { NULL, 0, 0 };
+        long long start, elapsed;
+        long iter = 0;
+        struct json_t *j;
+
+        json_arena_reset(arena);
+        j = json_parse_buf_arena(buf, len, arena);
+        if (!j)
+                return -1.0;
+
+        start = now_ns();
+        do {
+                /* Reuse the buffer, like a real writer would */
+                out.len = 0;
+                if (json_write(&out, j, flags) < 0) {
+                        json_buf_free(&out);
+                        return -1.0;
+                }
+                ++iter;
+                elapsed = now_ns() - start;
+        } while (elapsed < BENCH_NSEC);
+
+        len = out.len;
+        json_buf_free(&out);
+        return (double)len * iter / 1e6 / ((double)elapsed / 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct json_buf_t binbuf = { NULL, 0, 0 };
+        int i;
+
+        if (argc < 2) {
+                fprintf(stderr, "Expected: json_bench FILE [FILE...]\n");
+                return 1;
+        }
+
+        arena = json_arena_create(0);
+        if (!arena) {
+                perror("json_arena_create");
+                return 1;
+        }
+
+        printf("%-24s %12s %12s %12s %12s %12s %12s %12s\n",
+               "file", "FILE* MB/s", "buf MB/s", "arena MB/s", "pull MB/s",
+               "write MB/s", "pretty MB/s", "unbin MB/s");
+        for (i = 1; i < argc; i++) {
+                size_t len;
+                double tfile, tbuf, tarena, tpull, twrite, tpretty, tbin;
+                char *buf = slurp(argv[i], &len);
+                if (!buf) {
+                        perror(argv[i]);
+                        return 1;
+                }
+                tfile = bench(parse_file, buf, len);
+                tbuf = bench(parse_buf, buf, len);
+                tarena = bench(parse_arena, buf, len);
+                tpull = bench(parse_pull, buf, len);
+                twrite = bench_write(buf, len, 0);
+                tpretty = bench_write(buf, len, JSON_WRITE_PRETTY);
+                /* Per MB of JSON text, to compare with parsing it */
+                tbin = setup_bin(&binbuf, buf, len) < 0 ? -1.0
+                                : bench(parse_bin, buf, len);
+                if (tfile < 0.0 || tbuf < 0.0 || tarena < 0.0
+                    || tpull < 0.0 || twrite < 0.0 || tpretty < 0.0
+                    || tbin < 0.0) {
+                        fprintf(stderr, "%s: parse failed\n", argv[i]);
+                        free(buf);
+                        continue;
+                }
+                printf("%-24s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f"
+                       " %12.1f\n",
+                       argv[i], tfile, tbuf, tarena, tpull,
+                       twrite, tpretty, tbin);
+                free(buf);
+        }
+        json_buf_free(&binbuf);
+        json_arena_free(arena);
+        return 0;
+}
@@ -4,17 +4,466 @@
 #include <stdlib.h>
 #include <setjmp.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
+struct json_scan_t;
+
+/*
+ * struct jstate_t - Parser state
+ * @fp:         File being parsed by json_parse(), or NULL if parsing
+ *              a buffer with json_parse_buf()
+ * @start:      For json_parse_buf(), start of buffer
+ * @p:          For json_parse_buf(), current position in buffer
+ * @end:        For json_parse_buf(), end of buffer
+ * @lineno:     For json_parse(), current line number.  For
+ *              json_parse_buf(), this is calculated only for error
+ *              messages, since it's not needed otherwise.
+ * @saved_tok:  Token pushed back by unget_tok(), or zero
+ * @arena:      Arena to allocate nodes and strings from, or NULL to
+ *              use malloc()
+ * @sbuf:       For json_parse(), getdelim() buffer that's reused for
+ *              every string, which is then decoded into the tree
+ * @sbufsize:   Allocated size of @sbuf
+ * @env:        Where to jump to on syntax error
+ * @cur_token:  Value of the last string, number or bool token
+ * @scan:       For json_parse_buf(), index of where tokens are, or
+ *              NULL to find them a byte at a time.  See find_tokens().
+ */
 struct jstate_t {
         FILE *fp;
+        const char *start;
+        const char *p;
+        const char *end;
         int lineno;
+        int saved_tok;
+        struct json_arena_t *arena;
+        char *sbuf;
+        size_t sbufsize;
         jmp_buf env;
         union json_value_t cur_token;
+        struct json_scan_t *scan;
+};
+
+/*
+ * Arena allocation
+ *
+ * An arena has two pools, one for nodes and one for strings, so that
+ * nodes are packed together in the order they were parsed, rather
+ * than being interleaved with the strings they point to.  Each pool
+ * is a list of blocks which are bump-allocated from.  Nothing in an
+ * arena is freed individually; json_arena_reset() rewinds all the
+ * blocks for reuse, and json_arena_free() frees them all at once.
+ */
+enum {
+        JSON_ARENA_DEFAULT_BLOCK = 64 * 1024,
+};
+
+struct json_block_t {
+        struct json_block_t *next;
+        size_t size;
+        size_t used;
+        /* Force alignment of data[] to that of any json_t field */
+        union {
+                long long _align;
+                void *_palign;
+                double _dalign;
+        } data[];
+};
+
+struct json_pool_t {
+        struct json_block_t *head;
+        struct json_block_t *cur;
+};
+
+/**
+ * struct json_arena_t - Memory arena for JSON trees
+ * @block_size: Size to allocate new blocks with
+ * @nodes:      Pool for struct json_t's
+ * @strings:    Pool for names and string values
+ */
+struct json_arena_t {
+        size_t block_size;
+        struct json_pool_t nodes;
+        struct json_pool_t strings;
+};
+
+static void *
+pool_alloc(struct json_pool_t *pool, size_t block_size, size_t size)
+{
+        struct json_block_t *b = pool->cur;
+        void *ret;
+
+        size = (size + 7) & ~(size_t)7;
+        if (b == NULL || b->size - b->used < size) {
+                /* Try blocks left over from before json_arena_reset */
+                while (b != NULL && b->next != NULL) {
+                        b = b->next;
+                        if (b->size - b->used >= size)
+                                goto have_block;
+                }
+                if (block_size < size)
+                        block_size = size;
+                b = malloc(sizeof(*b) + block_size);
+                if (!b)
+                        return NULL;
+                b->size = block_size;
+                b->used = 0;
+                b->next = NULL;
+                if (pool->cur != NULL) {
+                        b->next = pool->cur->next;
+                        pool->cur->next = b;
+                } else {
+                        pool->head = b;
+                }
+        }
+have_block:
+        pool->cur = b;
+        ret = (char *)b->data + b->used;
+        b->used += size;
+        return ret;
+}
+
+static void
+pool_free(struct json_pool_t *pool)
+{
+        struct json_block_t *b, *tmp;
+        for (b = pool->head; b != NULL; b = tmp) {
+                tmp = b->next;
+                free(b);
+        }
+        pool->head = pool->cur = NULL;
+}
+
+static void
+pool_reset(struct json_pool_t *pool)
+{
+        struct json_block_t *b;
+        for (b = pool->head; b != NULL; b = b->next)
+                b->used = 0;
+        pool->cur = pool->head;
+}
+
+/**
+ * json_arena_create - Create an arena for json_parse_arena() or
+ *                     json_parse_buf_arena()
+ * @block_size: Size of each block of memory that the arena allocates,
+ *      or zero to use a default.  Bigger blocks mean fewer calls to
+ *      malloc(), but more memory wasted at the end of the last block.
+ *
+ * Return: New arena, or NULL if out of memory
+ */
+struct json_arena_t *
+json_arena_create(size_t block_size)
+{
+        struct json_arena_t *a = malloc(sizeof(*a));
+        if (!a)
+                return NULL;
+        memset(a, 0, sizeof(*a));
+        a->block_size = block_size ? block_size : JSON_ARENA_DEFAULT_BLOCK;
+        return a;
+}
+
+/**
+ * json_arena_reset - Free every tree in an arena, but keep its memory
+ * @a: Arena to reset
+ *
+ * This is for parsing many documents one after another: the next
+ * document reuses the memory of the last one instead of calling
+ * malloc() again.  Trees parsed into @a before this call may not be
+ * used after it.
+ */
+void
+json_arena_reset(struct json_arena_t *a)
+{
+        pool_reset(&a->nodes);
+        pool_reset(&a->strings);
+}
+
+/**
+ * json_arena_free - Free an arena and every tree parsed into it
+ * @a: Arena to free
+ *
+ * This takes time proportional to the number of blocks, not the
+ * number of nodes, since the nodes are not freed one at a time.
+ */
+void
+json_arena_free(struct json_arena_t *a)
+{
+        if (!a)
+                return;
+        pool_free(&a->nodes);
+        pool_free(&a->strings);
+        free(a);
+}
+
+/*
+ * Child index
+ *
+ * Containers with at least JSON_INDEX_MIN children get an index,
+ * built the first time json_find_child() or json_child_at() is called
+ * for them, and stored in their (otherwise unused) .value field.
+ * It has an array of children in order, for finding array members by
+ * position, and for dicts, an open-addressed hash table of positions
+ * in that array, for finding members by name.  The index is dropped
+ * whenever a child is added or removed, and rebuilt on the next
+ * lookup.
+ *
+ * For trees parsed into an arena, the parser leaves behind an unbuilt
+ * index for each big container, so that the lookup functions know
+ * which arena to build it in.
+ */
+enum {
+        JSON_INDEX_MIN = 32,
 };
 
+/**
+ * struct json_index_t - Child index for a container node
+ * @arena:      Arena that @child and @slot are allocated from, or NULL
+ *              if they were allocated with malloc()
+ * @built:      True if the other fields are valid
+ * @nchild:     Array length of @child
+ * @child:      Children, in order, not counting "//" names
+ * @mask:       For dicts, array length of @slot minus one
+ * @slot:       For dicts, hash table of indices into @child, or -1 for
+ *              empty slots.  NULL until the first lookup by name.
+ */
+struct json_index_t {
+        struct json_arena_t *arena;
+        bool built;
+        int nchild;
+        struct json_t **child;
+        unsigned int mask;
+        int *slot;
+};
+
+static inline bool
+is_container(struct json_t *j)
+{
+        return j->type == '{' || j->type == '[';
+}
+
+static inline bool
+is_comment(struct json_t *j)
+{
+        return j->name != NULL && j->name[0] == '/' && j->name[1] == '/';
+}
+
+/*
+ * FNV-1a, folding ASCII case so that the same index works for
+ * json_find_child()'s case-sensitive and -insensitive lookups.
+ */
+static unsigned int
+name_hash(const char *s)
+{
+        unsigned int c, hash = 0x811c9dc5;
+        while ((c = (unsigned char)*s++) != '\0') {
+                if (c - 'A' < 26U)
+                        c += 'a' - 'A';
+                hash = (hash ^ c) * 0x01000193;
+        }
+        return hash;
+}
+
+/* strcasecmp(), but folding ASCII only, the same as name_hash() */
+static int
+name_casecmp(const char *a, const char *b)
+{
+        unsigned int ca, cb;
+
+        do {
+                ca = (unsigned char)*a++;
+                cb = (unsigned char)*b++;
+                if (ca - 'A' < 26U)
+                        ca += 'a' - 'A';
+                if (cb - 'A' < 26U)
+                        cb += 'a' - 'A';
+        } while (ca == cb && ca != '\0');
+        return (int)ca - (int)cb;
+}
+
+static void *
+index_alloc(struct json_arena_t *arena, size_t size)
+{
+        if (arena)
+                return pool_alloc(&arena->strings, arena->block_size, size);
+        return malloc(size);
+}
+
+/* Forget @parent's index, because its children changed */
+static void
+index_drop(struct json_t *parent)
+{
+        struct json_index_t *idx;
+
+        if (!is_container(parent) || (idx = parent->value.idx) == NULL)
+                return;
+        if (idx->arena) {
+                /* Old arrays will be freed with the arena */
+                idx->built = false;
+                return;
+        }
+        free(idx->child);
+        free(idx->slot);
+        free(idx);
+        parent->value.idx = NULL;
+}
+
+/* Get @parent's index, building it if need be, or NULL if no index */
+static struct json_index_t *
+get_index(struct json_t *parent)
+{
+        struct json_index_t *idx = parent->value.idx;
+        struct json_t *child;
+        int i, n;
+
+        if (idx && idx->built)
+                return idx;
+        if (parent->array_size < JSON_INDEX_MIN)
+                return NULL;
+        if (!idx) {
+                /* Arena trees without an index are too small for one */
+                if (!!(parent->flags & JSON_ARENA))
+                        return NULL;
+                idx = malloc(sizeof(*idx));
+                if (!idx)
+                        return NULL;
+                memset(idx, 0, sizeof(*idx));
+                parent->value.idx = idx;
+        }
+
+        n = 0;
+        JSON_FOR_EACH_CHILD(parent, child)
+                ++n;
+        if (!idx->arena) {
+                free(idx->child);
+                free(idx->slot);
+        }
+        /* Old arena arrays will be freed with the arena */
+        idx->slot = NULL;
+        idx->child = index_alloc(idx->arena, (n + 1) * sizeof(*idx->child));
+        if (!idx->child)
+                goto enomem;
+        i = 0;
+        JSON_FOR_EACH_CHILD(parent, child)
+                idx->child[i++] = child;
+        idx->nchild = n;
+        idx->built = true;
+        return idx;
+
+enomem:
+        if (!idx->arena) {
+                free(idx->child);
+                free(idx);
+                parent->value.idx = NULL;
+        }
+        return NULL;
+}
+
+/*
+ * Get dict @parent's index with its name hash table, building them if
+ * need be, or NULL if no index.  The hash table waits for this, the
+ * first lookup by name, so json_child_at() doesn't pay for it.
+ */
+static struct json_index_t *
+get_name_index(struct json_t *parent)
+{
+        struct json_index_t *idx = get_index(parent);
+        unsigned int nslots;
+        int i;
+
+        if (!idx || idx->slot)
+                return idx;
+        for (nslots = 4; nslots < idx->nchild * 2U; nslots *= 2)
+                ;
+        idx->slot = index_alloc(idx->arena, nslots * sizeof(*idx->slot));
+        if (!idx->slot)
+                return NULL;
+        memset(idx->slot, -1, nslots * sizeof(*idx->slot));
+        idx->mask = nslots - 1;
+        for (i = 0; i < idx->nchild; i++) {
+                unsigned int si = name_hash(idx->child[i]->name);
+                while (idx->slot[si & idx->mask] >= 0)
+                        ++si;
+                idx->slot[si & idx->mask] = i;
+        }
+        return idx;
+}
+
+/* Leave an unbuilt index in an arena container; see comment above */
+static void
+index_placeholder(struct jstate_t *state, struct json_t *parent)
+{
+        struct json_index_t *idx;
+
+        if (!state->arena || parent->array_size < JSON_INDEX_MIN)
+                return;
+        idx = index_alloc(state->arena, sizeof(*idx));
+        if (!idx)
+                longjmp(state->env, 1);
+        memset(idx, 0, sizeof(*idx));
+        idx->arena = state->arena;
+        parent->value.idx = idx;
+}
+
+/* Get memory for a string of up to @len bytes plus the nulchar */
+static char *
+jstralloc(struct jstate_t *state, size_t len)
+{
+        char *ret;
+        if (state->arena) {
+                ret = pool_alloc(&state->arena->strings,
+                                 state->arena->block_size, len + 1);
+        } else {
+                ret = malloc(len + 1);
+        }
+        if (!ret)
+                longjmp(state->env, 1);
+        return ret;
+}
+
+/* Copy @len bytes of @s into new memory and nulchar-terminate it */
+static char *
+jstrndup(struct jstate_t *state, const char *s, size_t len)
+{
+        char *ret = jstralloc(state, len);
+        memcpy(ret, s, len);
+        ret[len] = '\0';
+        return ret;
+}
+
+static int
+jlineno(struct jstate_t *state)
+{
+        const char *s;
+        int lineno;
+
+        if (state->fp != NULL)
+                return state->lineno;
+
+        lineno = 1;
+        s = state->start;
+        while ((s = memchr(s, '\n', state->p - s)) != NULL) {
+                ++lineno;
+                ++s;
+        }
+        return lineno;
+}
+
 #define syntax(state_, msg, ...) do { \
         fprintf(stderr, "json_parse near line %d: " msg "\n", \
-                (state_)->lineno, ##__VA_ARGS__); \
+                jlineno(state_), ##__VA_ARGS__); \
         longjmp((state_)->env, 1); \
 } while (0)
 
@@ -29,21 +478,58 @@ check_remaining_string(FILE *fp, const char *s)
         return 0;
 }
 
+static char *decode_string(struct jstate_t *state,
+                           const char *p, size_t n);
+
+/* True if the character at @buf[@i] is escaped by a backslash */
+static bool
+is_escaped(const char *buf, size_t i)
+{
+        size_t j = i;
+        while (j > 0 && buf[j - 1] == '\\')
+                --j;
+        return ((i - j) & 1) != 0;
+}
+
 static void
 copy_string(struct jstate_t *state, int delim)
 {
-        char *end, *s = NULL;
-        size_t n = 0;
-        ssize_t res = getdelim(&s, &n, delim, state->fp);
-        if (res <= 0)
+        char *more = NULL;
+        size_t moresize = 0, len;
+        ssize_t res;
+
+        /* Read into a scratch buffer, decode into the tree below */
+        res = getdelim(&state->sbuf, &state->sbufsize, delim, state->fp);
+        if (res <= 0 || state->sbuf[res - 1] != delim)
                 syntax(state, "Expected: closing delimiter");
+        len = res;
+
+        /* An escaped quote doesn't end the string, keep reading */
+        while (is_escaped(state->sbuf, len - 1)) {
+                res = getdelim(&more, &moresize, delim, state->fp);
+                if (res <= 0 || more[res - 1] != delim)
+                        goto nodelim;
+                if (len + res + 1 > state->sbufsize) {
+                        char *tmp = realloc(state->sbuf, len + res + 1);
+                        if (!tmp) {
+                                free(more);
+                                longjmp(state->env, 1);
+                        }
+                        state->sbuf = tmp;
+                        state->sbufsize = len + res + 1;
+                }
+                memcpy(state->sbuf + len, more, res + 1);
+                len += res;
+        }
+        free(more);
 
         /* Don't include the delimiter */
-        end = s + strlen(s) - 1;
-        if (end > s && *end == delim)
-                *end = '\0';
+        state->cur_token.s = decode_string(state, state->sbuf, len - 1);
+        return;
 
-        state->cur_token.s = s;
+nodelim:
+        free(more);
+        syntax(state, "Expected: closing delimiter");
 }
 
 static int
@@ -83,9 +569,9 @@ get_number(struct jstate_t *state, int c)
         return isflt ? 'f' : 'i';
 }
 
-/* returns one of "{}[]:,qbfi" or EOF */
+/* returns one of "{}[]:,qbfin" or EOF */
 static int
-get_tok(struct jstate_t *state)
+get_tok_file(struct jstate_t *state)
 {
         int c;
         bool comment = false;
@@ -125,6 +611,10 @@ get_tok(struct jstate_t *state)
                         if (check_remaining_string(fp, "alse") < 0)
                                 goto err;
                         state->cur_token.b = false;
+                } else if (toupper(c) == 'N') {
+                        if (check_remaining_string(fp, "ull") < 0)
+                                goto err;
+                        return 'n';
                 } else {
                         goto err;
                 }
@@ -138,478 +628,3635 @@ err:
         return EOF;
 }
 
-static struct json_t *
-new_json(struct json_t *parent)
-{
-        struct json_t *ret = malloc(sizeof(*ret));
+/*
+ * Buffer versions of the above, for json_parse_buf().  These work
+ * directly on the buffer instead of a character at a time.
+ */
 
-        memset(ret, 0, sizeof(*ret));
-        ret->parent = parent;
-        if (parent) {
-                struct json_t *sibs = parent->children;
-                if (sibs != NULL) {
-                        /* Keep children in order of creation */
-                        while (sibs->sib_next != NULL) {
-                                sibs = sibs->sib_next;
-                        }
-                        sibs->sib_next = ret;
-                        ret->sib_prev = sibs;
-                        ret->sib_next = NULL;
-                } else {
-                        parent->children = ret;
-                        ret->sib_prev = NULL;
-                        ret->sib_next = NULL;
+/*
+ * Slide past whitespace, comments, and (like get_tok_file) any other
+ * unprintable characters.
+ */
+static const char *
+buf_slide(const char *p, const char *end)
+{
+        while (p < end) {
+                unsigned int c = (unsigned char)*p;
+                if (c > ' ' && c < 0x7f) {
+                        if (c != '#')
+                                break;
+                        p = memchr(p, '\n', end - p);
+                        if (!p)
+                                return end;
                 }
+                ++p;
         }
-        return ret;
+        return p;
 }
 
-static void
-json_free_memb(struct json_t *memb)
+static inline bool
+buf_isdigit(const char *p, const char *end)
 {
-        struct json_t *child;
+        return p < end && (unsigned)(*p - '0') < 10U;
+}
 
-        /* Don't leave orphans lying around */
-        for (child = memb->children;
-             child != NULL; child = child->sib_next) {
-                json_free_memb(child);
+/*
+ * Powers of ten which are exactly representable as a double,
+ * for buf_number()'s fast path.
+ */
+static const double pow10_exact[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Slow path for buf_number(): let libc do it */
+static int
+buf_number_slow(const char *p, size_t len, bool isflt,
+                union json_value_t *v)
+{
+        char buf[64];
+        char *end;
+
+        if (len >= sizeof(buf))
+                return -1;
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+        if (isflt)
+                v->f = strtod(buf, &end);
+        else
+                v->i = strtoll(buf, &end, 10);
+        return end == &buf[len] ? (isflt ? 'f' : 'i') : -1;
+}
+
+/*
+ * Parse a number at *@pp, and move *@pp past it.
+ * Return 'i' or 'f' and store the number in @v, or return -1 if
+ * it's not a valid number.
+ *
+ * Integers of up to 18 digits, and floats whose significant digits
+ * fit in 2^53 and whose exponent is within what a double can hold
+ * exactly, are calculated here directly.  Since both operands of the
+ * multiply or divide are exact, so is the result (Clinger's fast
+ * path).  Anything else goes to strtod() or strtoll().
+ */
+static int
+buf_number(const char **pp, const char *end, union json_value_t *v)
+{
+        const char *p = *pp;
+        const char *start = p;
+        unsigned long long mant = 0;
+        int ndigits = 0, exp10 = 0;
+        bool neg = false, isflt = false, exact = true;
+
+        if (*p == '-' || *p == '+') {
+                neg = *p == '-';
+                ++p;
+        }
+        if (!buf_isdigit(p, end)
+            && !(p < end && *p == '.' && buf_isdigit(p + 1, end))) {
+                return -1;
         }
 
-        /* Untangled its linked lists */
-        if (memb->parent && memb->parent->children == memb)
-                memb->parent->children = memb->sib_next;
-        if (memb->sib_prev)
-                memb->sib_prev->sib_next = memb->sib_next;
-        if (memb->sib_next)
-                memb->sib_next->sib_prev = memb->sib_prev;
+        for (; buf_isdigit(p, end); ++p) {
+                if (ndigits < 19) {
+                        mant = mant * 10 + (*p - '0');
+                        if (mant != 0)
+                                ++ndigits;
+                } else {
+                        ++exp10;
+                        exact = false;
+                }
+        }
+        if (p < end && *p == '.') {
+                isflt = true;
+                for (++p; buf_isdigit(p, end); ++p) {
+                        if (ndigits < 19) {
+                                mant = mant * 10 + (*p - '0');
+                                if (mant != 0)
+                                        ++ndigits;
+                                --exp10;
+                        } else if (*p != '0') {
+                                exact = false;
+                        }
+                }
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+                int eneg = 0, e = 0;
+                isflt = true;
+                ++p;
+                if (p < end && (*p == '-' || *p == '+')) {
+                        eneg = *p == '-';
+                        ++p;
+                }
+                if (!buf_isdigit(p, end))
+                        return -1;
+                for (; buf_isdigit(p, end); ++p) {
+                        if (e < 10000)
+                                e = e * 10 + (*p - '0');
+                }
+                exp10 += eneg ? -e : e;
+        }
 
-        if (memb->type == 'q' && memb->value.s != NULL)
-                free(memb->value.s);
+        /* Same check as get_number's, for things like "1-2" */
+        if (p < end && strchr(".eE+-", *p) != NULL && *p != '\0')
+                return -1;
+        *pp = p;
 
-        free(memb);
+        if (!isflt) {
+                if (ndigits >= 19)
+                        return buf_number_slow(start, p - start, false, v);
+                v->i = neg ? -(long long)mant : (long long)mant;
+                return 'i';
+        }
+
+        if (exact && mant <= (1ULL << 53)
+            && exp10 >= -22 && exp10 <= 22) {
+                double d = (double)mant;
+                if (exp10 < 0)
+                        d /= pow10_exact[-exp10];
+                else
+                        d *= pow10_exact[exp10];
+                v->f = neg ? -d : d;
+                return 'f';
+        }
+        return buf_number_slow(start, p - start, true, v);
 }
 
-static void parse_array(struct jstate_t *state, struct json_t *parent);
-static void parse_dict(struct jstate_t *state, struct json_t *parent);
-static void parse_atom(struct jstate_t *state, struct json_t *parent);
+/* Like check_remaining_string, for json_parse_buf() */
+static int
+buf_literal(const char **pp, const char *end, const char *s)
+{
+        size_t len = strlen(s);
+        if (end - *pp < len || memcmp(*pp, s, len) != 0)
+                return -1;
+        *pp += len;
+        return 0;
+}
 
-static void
-parse_field_value(struct jstate_t *state, struct json_t *j)
+/*
+ * Find the closing quote of a string whose text starts at @p, or
+ * return NULL if there isn't one.  Skip quotes that are escaped, ie.
+ * preceded by an odd number of backslashes.
+ */
+static const char *
+buf_endquote(const char *p, const char *end)
 {
-        int tok = get_tok(state);
-        j->type = tok;
-        switch (tok) {
-        case '{':
-                parse_dict(state, j);
-                break;
-        case '[':
-                parse_array(state, j);
-                break;
-        case 'q':
-                /* Hand over pointer... easier than strdup+free */
-                j->value.s = state->cur_token.s;
-                break;
-        case 'b':
-                j->value.b = state->cur_token.b;
-                break;
-        case 'f':
-                j->value.f = state->cur_token.f;
-                break;
-        case 'i':
-                j->value.i = state->cur_token.i;
-                break;
-        default:
-                json_free_memb(j);
-                syntax(state, "Unexpected token");
+        const char *q, *s;
+
+        while ((q = memchr(p, '"', end - p)) != NULL) {
+                for (s = q; s > p && s[-1] == '\\'; --s)
+                        ;
+                if (((q - s) & 1) == 0)
+                        return q;
+                p = q + 1;
         }
+        return NULL;
 }
 
-/* Helper for parse_array and parse_dict */
-static void
-check_endtok(struct jstate_t *state, int tok, int c)
+/* True if @c may come right after a number or literal */
+static inline bool
+buf_isdelim(int c)
 {
-        if (tok != c) {
-                syntax(state, "Expected: `%c' at end of %s",
-                        c, c == ']' ? "array" : "dict");
-        }
+        c = (unsigned char)c;
+        return c <= ' ' || c >= 0x7f || c == ',' || c == ':' || c == '"'
+               || (c | 0x20) == '{' || (c | 0x20) == '}';
 }
 
-static void
-parse_array(struct jstate_t *state, struct json_t *parent)
+/*
+ * Structural index
+ *
+ * For json_parse_buf(), a first pass over the whole buffer finds where
+ * every token starts, 64 bytes at a time, using SSE2 or AVX2 compares
+ * where the compiler has them.  get_tok_buf() then jumps from one
+ * token to the next, instead of looking at every byte in between.
+ *
+ * Each 64-byte block is turned into bitmaps of quotes, backslashes,
+ * the structural characters "{}[]:,", and whitespace (which, as in
+ * buf_slide(), is anything that's not printable ASCII).  Quotes after
+ * an odd number of backslashes are dropped.  A prefix XOR of the
+ * quotes that are left gives a mask of what's inside strings.  The
+ * tokens are then the structural characters outside of strings, the
+ * quotes, and the first character of each run of anything else, which
+ * is where numbers and literals start.
+ *
+ * This is done in batches, small enough that the offsets are still in
+ * cache when get_tok_buf() reads them.
+ *
+ * Comments are not handled here.  If there's a '#' outside of a
+ * string, find_tokens() gives up and get_tok_buf() goes back to
+ * buf_slide() for the rest of the buffer.
+ */
+enum {
+        JSON_SCAN_NTOK = 1024,          /* Most tokens per batch */
+        JSON_SCAN_NBYTES = 1 << 20,     /* Most bytes per batch */
+};
+
+/**
+ * struct json_scan_t - Structural index for json_parse_buf()
+ * @base:       Start of the current batch
+ * @next:       Start of the next batch
+ * @npos:       Number of tokens in @pos
+ * @ipos:       Index in @pos of the next token
+ * @in_str:     All ones if @next is inside a string, else zero
+ * @esc_carry:  1 if the character at @next is escaped
+ * @scalar_carry: 1 if the character before @next is part of a number
+ *              or literal
+ * @pos:        Offsets from @base of the tokens in the current batch
+ */
+struct json_scan_t {
+        const char *base;
+        const char *next;
+        size_t npos;
+        size_t ipos;
+        uint64_t in_str;
+        uint64_t esc_carry;
+        uint64_t scalar_carry;
+        uint32_t pos[JSON_SCAN_NTOK];
+};
+struct json_blockbits_t {
+        uint64_t quote;
+        uint64_t bslash;
+        uint64_t op;
+        uint64_t ws;
+        uint64_t hash;
+};
+
+#if defined(__AVX2__)
+typedef __m256i jvec_t;
+# define JVEC_SIZE              32
+# define jvec_load(p_)          _mm256_loadu_si256((const __m256i *)(p_))
+# define jvec_store(p_, v_)     _mm256_storeu_si256((__m256i *)(p_), v_)
+# define jvec_set1(c_)          _mm256_set1_epi8(c_)
+# define jvec_eq(a_, b_)        _mm256_cmpeq_epi8(a_, b_)
+# define jvec_lt(a_, b_)        _mm256_cmpgt_epi8(b_, a_)
+# define jvec_or(a_, b_)        _mm256_or_si256(a_, b_)
+# define jvec_mask(a_)          ((uint32_t)_mm256_movemask_epi8(a_))
+#elif defined(__SSE2__)
+typedef __m128i jvec_t;
+# define JVEC_SIZE              16
+# define jvec_load(p_)          _mm_loadu_si128((const __m128i *)(p_))
+# define jvec_store(p_, v_)     _mm_storeu_si128((__m128i *)(p_), v_)
+# define jvec_set1(c_)          _mm_set1_epi8(c_)
+# define jvec_eq(a_, b_)        _mm_cmpeq_epi8(a_, b_)
+# define jvec_lt(a_, b_)        _mm_cmplt_epi8(a_, b_)
+# define jvec_or(a_, b_)        _mm_or_si128(a_, b_)
+# define jvec_mask(a_)          ((uint32_t)_mm_movemask_epi8(a_))
+#endif
+
+#ifdef JVEC_SIZE
+static inline void
+classify_block(const char *p, struct json_blockbits_t *b)
 {
-        int tok;
-        /*
-         * Note: Don't get and use pointer to parent here,
-         * because it could change location every time a
-         * new json is allocated, due to realloc().
-         * Hence the inline i2j(state, parent) calls below.
-         */
-        do {
-                /* for debugging later */
-                char namebuf[128];
-                struct json_t *child = new_json(parent);
-                sprintf(namebuf, "(%d)", parent->array_size);
-                child->name = strdup(namebuf);
-                parse_field_value(state, child);
-                parent->array_size++;
-        } while ((tok = get_tok(state)) == ',');
-        check_endtok(state, tok, ']');
-}
+        const jvec_t quote = jvec_set1('"');
+        const jvec_t bslash = jvec_set1('\\');
+        const jvec_t hash = jvec_set1('#');
+        const jvec_t lbrace = jvec_set1('{');
+        const jvec_t rbrace = jvec_set1('}');
+        const jvec_t colon = jvec_set1(':');
+        const jvec_t comma = jvec_set1(',');
+        const jvec_t bit5 = jvec_set1(0x20);
+        const jvec_t print = jvec_set1(0x21);
+        const jvec_t del = jvec_set1(0x7f);
+        int i;
 
-static void
-parse_dict(struct jstate_t *state, struct json_t *parent)
+        memset(b, 0, sizeof(*b));
+        for (i = 0; i < 64; i += JVEC_SIZE) {
+                jvec_t v = jvec_load(p + i);
+                /* '[' and ']' are '{' and '}' without bit 5 */
+                jvec_t v5 = jvec_or(v, bit5);
+                jvec_t op = jvec_or(jvec_or(jvec_eq(v5, lbrace),
+                                            jvec_eq(v5, rbrace)),
+                                    jvec_or(jvec_eq(v, colon),
+                                            jvec_eq(v, comma)));
+                /* Signed compare, so 0x80 and up are less than 0x21 */
+                jvec_t ws = jvec_or(jvec_lt(v, print), jvec_eq(v, del));
+
+                b->quote |= (uint64_t)jvec_mask(jvec_eq(v, quote)) << i;
+                b->bslash |= (uint64_t)jvec_mask(jvec_eq(v, bslash)) << i;
+                b->hash |= (uint64_t)jvec_mask(jvec_eq(v, hash)) << i;
+                b->op |= (uint64_t)jvec_mask(op) << i;
+                b->ws |= (uint64_t)jvec_mask(ws) << i;
+        }
+}
+#else /* !JVEC_SIZE */
+static inline void
+classify_block(const char *p, struct json_blockbits_t *b)
 {
-        int tok;
-        do {
-                parse_atom(state, parent);
-                parent->array_size++;
-        } while ((tok = get_tok(state)) == ',');
-        check_endtok(state, tok, '}');
+        int i;
+
+        memset(b, 0, sizeof(*b));
+        for (i = 0; i < 64; i++) {
+                unsigned int c = (unsigned char)p[i];
+                uint64_t bit = 1ULL << i;
+                if (c <= ' ' || c >= 0x7f)
+                        b->ws |= bit;
+                else if (c == '"')
+                        b->quote |= bit;
+                else if (c == '\\')
+                        b->bslash |= bit;
+                else if (c == '#')
+                        b->hash |= bit;
+                else if (strchr("{}[]:,", c) != NULL)
+                        b->op |= bit;
+        }
 }
+#endif /* !JVEC_SIZE */
 
-static void
-parse_atom(struct jstate_t *state, struct json_t *parent)
+/* Bit i of the result is the XOR of bits 0 through i of @x */
+static inline uint64_t
+prefix_xor(uint64_t x)
 {
-        int tok;
-        struct json_t *child = new_json(parent);
-        if ((tok = get_tok(state)) != 'q')
-                syntax(state, "Expected: quoted string");
-        /* Hand over pointer ... better than strdup + free */
-        child->name = state->cur_token.s;
-        if ((tok = get_tok(state)) != ':')
-                syntax(state, "Expected: `:' but got %c", tok);
-
-        parse_field_value(state, child);
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+        return x;
 }
 
-/**
- * json_parse - Parse a file and create a JSON tree.
- * @fp: JSON file to parse
- * @info: Pointer to data containing some additional info about
- *      the tree.  If this is NULL, then json_append_from_file()
- *      and json_create_child() may not be used.
- *
- * Return: Handle to the top level of the JSON tree.
+/*
+ * Return a mask of the characters in a block that are escaped by a
+ * backslash.  @carry is true if the first one is, because the last
+ * block ended with an odd run of backslashes, and is set the same way
+ * for the next block.
  *
- * Note: This is called a "tree" for egg-headed reasons only.
- * For swizzling purposes (some calling code is copying
- * this into SHM), the actual data structure is an array.
+ * Runs of backslashes that start on an even bit are subtracted from
+ * the odd bits, and vice versa, so that the subtraction's carries
+ * mark the character after each odd-length run.
  */
-struct json_t *
-json_parse(FILE *fp)
+static inline uint64_t
+find_escaped(uint64_t bslash, uint64_t *carry)
 {
-        struct jstate_t state;
-        struct json_t *top = NULL;
+        const uint64_t odd = 0xaaaaaaaaaaaaaaaaULL;
+        uint64_t start, code, escaped;
 
-        state.fp = fp;
-        state.lineno = 1;
-
-        if (setjmp(state.env) != 0) {
-                if (top != NULL)
-                        json_free(top);
-                return NULL;
+        if (!bslash) {
+                escaped = *carry;
+                *carry = 0;
+                return escaped;
         }
-        top = new_json(NULL);
-        parse_field_value(&state, top);
-        return top;
+        start = bslash & ~*carry;
+        code = (((start << 1) | odd) - start) ^ odd;
+        escaped = code ^ (bslash | *carry);
+        *carry = (code & bslash) >> 63;
+        return escaped;
 }
 
-/**
- * Parse @fp, whose contents are a descendant of @parent_node
- * @parent_node: Node in a JSON tree to append new json data to
- * @fp: File to parse
- * @info: JSON info filled in by original call to json_parse().
- *      This may not be NULL.
- *
- * Return: 0 if success, -1 if fail.  If return value is -1,
- * the JSON tree may be in an undefined state, and should be
- * freed.  Absurdly cautious people may wish to memcpy everything
- * before calling this funcion.
- *
- * FIXME: Sort of confusing how the hierarchy works here.
+/* Count trailing zeros, with a defined result for zero */
+static inline int
+ctz(uint64_t x)
+{
+        return x ? __builtin_ctzll(x) : 64;
+}
+
+/*
+ * Fill @scan with the next batch of tokens, up to @end.  Return -1 if
+ * there's a comment, zero otherwise.
  */
-int
-json_append_from_file(struct json_t *parent_node, FILE *fp)
+static int
+find_tokens(struct json_scan_t *scan, const char *end)
 {
-        int tok;
-        struct jstate_t state;
+        const char *p = scan->next;
+        size_t count = 0;
+        char tail[64];
 
-        if (!parent_node)
-                return -1;
+        scan->base = p;
+        while (p < end && count <= JSON_SCAN_NTOK - 64
+               && p - scan->base < JSON_SCAN_NBYTES) {
+                struct json_blockbits_t b;
+                uint64_t quote, str, scalar, tok;
+                uint32_t off = p - scan->base;
+                int i, n;
 
-        state.fp        = fp;
-        state.lineno    = 1;
+                if (end - p >= 64) {
+                        classify_block(p, &b);
+                } else {
+                        memset(tail, ' ', sizeof(tail));
+                        memcpy(tail, p, end - p);
+                        classify_block(tail, &b);
+                }
 
-        if (setjmp(state.env) != 0)
-                return -1;
+                quote = b.quote & ~find_escaped(b.bslash, &scan->esc_carry);
+                /* Opening quotes are inside, closing ones outside */
+                str = prefix_xor(quote) ^ scan->in_str;
+                scan->in_str = (uint64_t)((int64_t)str >> 63);
+                if (b.hash & ~str)
+                        return -1;
 
-        tok = get_tok(&state);
-        if (tok != '{')
-                syntax(&state, "Expected: { at start of file");
-        parse_dict(&state, parent_node);
+                scalar = ~(b.op | b.ws | quote | str);
+                tok = (b.op & ~str) | quote
+                      | (scalar & ~((scalar << 1) | scan->scalar_carry));
+                scan->scalar_carry = scalar >> 63;
+
+                /*
+                 * Unrolled, since the number of tokens is unpredictable.
+                 * This may write a few garbage entries past the last
+                 * one, which the next block or npos takes care of.
+                 */
+                n = __builtin_popcountll(tok);
+                for (i = 0; i < n; i += 4) {
+                        uint32_t *pos = &scan->pos[count + i];
+                        pos[0] = off + ctz(tok);
+                        tok &= tok - 1;
+                        pos[1] = off + ctz(tok);
+                        tok &= tok - 1;
+                        pos[2] = off + ctz(tok);
+                        tok &= tok - 1;
+                        pos[3] = off + ctz(tok);
+                        tok &= tok - 1;
+                }
+                count += n;
+                p += 64;
+        }
+        scan->next = p;
+        scan->npos = count;
+        scan->ipos = 0;
         return 0;
 }
 
-/**
- * json_create_child - Append a new child to a parent node
- * @parent_node: Parent node to append a child to
- *
- * Return: Handle to the child node.
- *
- * This is a simple alternative to json_append_from_file, where
- * you need to append just one or two new nodes.
+/*
+ * Get the next token from the index.  Return @state->end if there are
+ * no more, or NULL if the index was given up on.
  */
-struct json_t *
-json_create_child(struct json_t *parent_node)
+static inline const char *
+next_tok(struct jstate_t *state)
 {
-        if (!parent_node)
-                return NULL;
+        struct json_scan_t *scan = state->scan;
 
-        return new_json(parent_node);
+        while (scan->ipos == scan->npos) {
+                if (scan->next >= state->end)
+                        return state->end;
+                if (find_tokens(scan, state->end) < 0) {
+                        state->scan = NULL;
+                        return NULL;
+                }
+        }
+        return scan->base + scan->pos[scan->ipos++];
 }
 
-/* Un-syntax()-able code */
+/*
+ *              String decoding
+ *
+ * Most strings have no escapes and are plain ASCII, so plain_run()
+ * looks for the first byte that isn't, a vector at a time, and if
+ * there is none the string is copied as is.  Otherwise the rest is
+ * decoded and validated by unescape().
+ */
 
-void
-json_free(struct json_t *tbl)
+/* Nonzero if any byte of @w is @c */
+static inline uint64_t
+has_byte(uint64_t w, int c)
 {
-        if (tbl != NULL)
-                json_free_memb(tbl);
+        uint64_t x = w ^ (0x0101010101010101ULL * (unsigned char)c);
+        return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
 }
 
-struct json_t *
-json_parent(struct json_t *child)
+/* Nonzero if any byte of @w is a control character or not ASCII */
+static inline uint64_t
+has_ctl_or_high(uint64_t w)
 {
-        return child->parent;
+        /* A borrow only crosses into the next byte after a hit */
+        return ((w - 0x2020202020202020ULL) | w) & 0x8080808080808080ULL;
 }
 
-/**
- * This returns first result whose name doesn't start with "//".
- * For strict JSON, just use parent->child
+/*
+ * Length of the prefix of @p with no quotes, backslashes, control
+ * characters or non-ASCII bytes.  Short strings are common, so the
+ * tail goes 8 bytes at a time.
  */
-struct json_t *
-json_first_child(struct json_t *parent)
+static inline size_t
+plain_run(const char *p, size_t n)
 {
-        struct json_t *child = parent->children;
-        while (child != NULL && child->name[0] == '/'
-               && child->name[1] == '/') {
-                child = child->sib_next;
+        size_t i = 0;
+        uint64_t w;
+#ifdef JVEC_SIZE
+        const jvec_t quote = jvec_set1('"');
+        const jvec_t bslash = jvec_set1('\\');
+        const jvec_t space = jvec_set1(' ');
+
+        for (; i + JVEC_SIZE <= n; i += JVEC_SIZE) {
+                jvec_t v = jvec_load(p + i);
+                /*
+                 * High bit of each byte: a quote, a backslash, or a
+                 * signed byte below ' ', ie. a control or not ASCII
+                 */
+                uint32_t m = jvec_mask(jvec_or(jvec_or(jvec_eq(v, quote),
+                                                       jvec_eq(v, bslash)),
+                                               jvec_lt(v, space)));
+                if (m)
+                        return i + __builtin_ctz(m);
         }
-        return child;
+#endif
+        for (; i + 8 <= n; i += 8) {
+                memcpy(&w, p + i, 8);
+                if (has_ctl_or_high(w) || has_byte(w, '"')
+                    || has_byte(w, '\\'))
+                        break;
+        }
+        for (; i < n; i++) {
+                if (p[i] == '"' || p[i] == '\\'
+                    || (unsigned char)(p[i] - ' ') >= 0x60) {
+                        break;
+                }
+        }
+        return i;
 }
 
-/**
- * This returns first result whose name doesn't start with "//".
- * For strict JSON, just use parent->child
+/*
+ * Return the length of the UTF-8 sequence at @p, or zero if it isn't
+ * valid: overlong, a surrogate, past U+10FFFF, or cut off by @end.
  */
-struct json_t *
-json_next_child(struct json_t *sibling)
+static int
+utf8_len(const unsigned char *p, const unsigned char *end)
 {
-        struct json_t *ret = sibling;
-        do {
-                ret = ret->sib_next;
-        } while (ret != NULL
-                 && ret->name[0] == '/' && ret->name[1] == '/');
-        return ret;
+        unsigned int c = p[0];
+
+        if (c < 0x80)
+                return 1;
+        if (c < 0xc2)
+                return 0;
+        if (c < 0xe0) {
+                if (end - p < 2 || (p[1] & 0xc0) != 0x80)
+                        return 0;
+                return 2;
+        }
+        if (c < 0xf0) {
+                if (end - p < 3 || (p[1] & 0xc0) != 0x80 ||
+                    (p[2] & 0xc0) != 0x80)
+                        return 0;
+                if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] >= 0xa0))
+                        return 0;
+                return 3;
+        }
+        if (c < 0xf5) {
+                if (end - p < 4 || (p[1] & 0xc0) != 0x80 ||
+                    (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80)
+                        return 0;
+                if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] >= 0x90))
+                        return 0;
+                return 4;
+        }
+        return 0;
 }
 
-struct json_t *
-json_find_child(struct json_t *parent, const char *name, bool case_sensitive)
+/* Value of four hex digits at @p, or -1 */
+static long
+hex4(const char *p)
 {
-        struct json_t *child;
-
-        if (*name == '[') {
-                /*
-                 * Numerical array.
-                 * Just count children rather than strcmp()ing
-                 * all the ASCII numbers with name.
-                 */
-                char *endptr;
-                int idx, count;
-                ++name;
+        long v = 0;
+        int i, c;
 
-                /* Don't try to dereference a non-numerical array */
-                if (parent->type != '[')
-                        return NULL;
+        for (i = 0; i < 4; i++) {
+                c = p[i];
+                if (c >= '0' && c <= '9')
+                        c -= '0';
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                        c = (c | 0x20) - 'a' + 10;
+                else
+                        return -1;
+                v = (v << 4) | c;
+        }
+        return v;
+}
 
-                /*
-                 * Don't get cute with Python-like negative indices.
-                 * Only dereference with positive index numbers.
-                 */
-                idx = strtoul(name, &endptr, 0);
-                if (endptr == name || endptr[0] != ']' || endptr[1] != '\0')
-                        return NULL;
+/* Write @cp as UTF-8 to @out, if it's not NULL, and return the length */
+static int
+utf8_put(char *out, unsigned long cp)
+{
+        unsigned char *o = (unsigned char *)out;
 
-                count = 0;
-                JSON_FOR_EACH_CHILD(parent, child) {
-                        if (count == idx)
-                                return child;
-                        count++;
+        if (cp < 0x80) {
+                if (o)
+                        o[0] = cp;
+                return 1;
+        }
+        if (cp < 0x800) {
+                if (o) {
+                        o[0] = 0xc0 | (cp >> 6);
+                        o[1] = 0x80 | (cp & 0x3f);
                 }
-        } else {
-                /* Associative array. */
-                int (*cmp)(const char *, const char *);
-
-                if (parent->type != '{')
-                        return NULL;
-
-                cmp = case_sensitive ? strcmp : strcasecmp;
-
-                JSON_FOR_EACH_CHILD(parent, child) {
-                        if (!cmp(child->name, name))
-                                return child;
+                return 2;
+        }
+        if (cp < 0x10000) {
+                if (o) {
+                        o[0] = 0xe0 | (cp >> 12);
+                        o[1] = 0x80 | ((cp >> 6) & 0x3f);
+                        o[2] = 0x80 | (cp & 0x3f);
                 }
+                return 3;
         }
-        return NULL;
+        if (o) {
+                o[0] = 0xf0 | (cp >> 18);
+                o[1] = 0x80 | ((cp >> 12) & 0x3f);
+                o[2] = 0x80 | ((cp >> 6) & 0x3f);
+                o[3] = 0x80 | (cp & 0x3f);
+        }
+        return 4;
 }
 
 /*
- * Like json_find_child, but namelen determines end of
- * string rather than the nulchar.
- * Extracted from json_find_descendant to explicitly
- * avoid putting a bunch of buf[]'s on the stack, since it
- * is a recursive function.
+ * Decode the \uXXXX escape at @*pp, and a low surrogate after it if it
+ * starts a pair.  Return the code point and advance @*pp past it, or
+ * return -1 if it's not valid.
  */
-static struct json_t *
-json_find_child_nonul(struct json_t *parent, const char *name,
-                      bool case_sensitive, size_t namelen)
+static long
+unescape_u(const char **pp, const char *end)
 {
-        char buf[512];
+        const char *p = *pp;
+        long cp, lo;
 
-        /* Waaay too long member name */
-        if (namelen >= sizeof(buf))
-                return NULL;
+        if (end - p < 6 || (cp = hex4(p + 2)) < 0)
+                return -1;
+        p += 6;
+        if (cp >= 0xd800 && cp < 0xdc00) {
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u')
+                        return -1;
+                lo = hex4(p + 2);
+                if (lo < 0xdc00 || lo >= 0xe000)
+                        return -1;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
+        } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return -1;
+        }
+        *pp = p;
+        return cp;
+}
 
-        strncpy(buf, name, namelen);
-        buf[namelen] = '\0';
+/**
+ * json_unescape - Decode the text of a JSON string
+ * @p: Text between the quotes, such as json_reader_t.text
+ * @n: Length of @p
+ * @out: Where to write the decoded string, at least @n bytes.  This
+ *      may be the same as @p, since decoding never makes it longer.
+ *      If it's NULL, the text is only checked.
+ *
+ * Escapes are decoded, and the text is checked for valid UTF-8 and for
+ * raw control characters, which must be escaped.  The result is not
+ * nulchar-terminated.  "\u0000" is not allowed, since
+ * the parsed tree can't hold it.
+ *
+ * Return: Length of the decoded string, or -1 if there's an invalid
+ *      escape or UTF-8 sequence, or a control character.
+ */
+ssize_t
+json_unescape(const char *p, size_t n, char *out)
+{
+        const char *end = p + n;
+        size_t k = 0, run;
+        long cp;
+        int len;
 
-        return json_find_child(parent, buf, case_sensitive);
-}
+        while (p < end) {
+                run = plain_run(p, end - p);
+                if (out && out + k != p)
+                        memmove(out + k, p, run);
+                k += run;
+                p += run;
+                if (p == end)
+                        break;
 
+                if (*p != '\\') {
+                        /* JSON wants control characters escaped */
+                        if ((unsigned char)*p < ' ')
+                                return -1;
+                        len = utf8_len((const unsigned char *)p,
+                                       (const unsigned char *)end);
+                        if (!len)
+                                return -1;
+                        if (out && out + k != p)
+                                memmove(out + k, p, len);
+                        k += len;
+                        p += len;
+                        continue;
+                }
+
+                if (end - p < 2)
+                        return -1;
+                switch (p[1]) {
+                case '"':
+                case '\\':
+                case '/':
+                        cp = p[1];
+                        break;
+                case 'b':
+                        cp = '\b';
+                        break;
+                case 'f':
+                        cp = '\f';
+                        break;
+                case 'n':
+                        cp = '\n';
+                        break;
+                case 'r':
+                        cp = '\r';
+                        break;
+                case 't':
+                        cp = '\t';
+                        break;
+                case 'u':
+                        cp = unescape_u(&p, end);
+                        if (cp <= 0)
+                                return -1;
+                        k += utf8_put(out ? out + k : NULL, cp);
+                        continue;
+                default:
+                        return -1;
+                }
+                if (out)
+                        out[k] = cp;
+                k++;
+                p += 2;
+        }
+        return k;
+}
+
+/*
+ * Copy @n bytes from @src to @dst, like memcpy(), but stop at the
+ * first byte that plain_run() would.  Return how many were copied.
+ */
+static inline size_t
+copy_plain(char *dst, const char *src, size_t n)
+{
+        size_t i = 0;
+        uint64_t w;
+#ifdef JVEC_SIZE
+        const jvec_t quote = jvec_set1('"');
+        const jvec_t bslash = jvec_set1('\\');
+        const jvec_t space = jvec_set1(' ');
+
+        for (; i + JVEC_SIZE <= n; i += JVEC_SIZE) {
+                jvec_t v = jvec_load(src + i);
+                uint32_t m = jvec_mask(jvec_or(jvec_or(jvec_eq(v, quote),
+                                                       jvec_eq(v, bslash)),
+                                               jvec_lt(v, space)));
+                if (m)
+                        break;
+                jvec_store(dst + i, v);
+        }
+#endif
+        for (; i + 8 <= n; i += 8) {
+                memcpy(&w, src + i, 8);
+                if (has_ctl_or_high(w) || has_byte(w, '"')
+                    || has_byte(w, '\\'))
+                        break;
+                memcpy(dst + i, &w, 8);
+        }
+        /* The last few bytes, as a word that overlaps what's done */
+        if (i < n && n - i < 8 && n >= 8) {
+                memcpy(&w, src + n - 8, 8);
+                if (!has_ctl_or_high(w) && !has_byte(w, '"')
+                    && !has_byte(w, '\\')) {
+                        memcpy(dst + n - 8, &w, 8);
+                        return n;
+                }
+        }
+        for (; i < n; i++) {
+                if (src[i] == '"' || src[i] == '\\'
+                    || (unsigned char)(src[i] - ' ') >= 0x60) {
+                        break;
+                }
+                dst[i] = src[i];
+        }
+        return i;
+}
+
+/* Copy string text into new memory, decoding escapes */
+static char *
+decode_string(struct jstate_t *state, const char *p, size_t n)
+{
+        char *s = jstralloc(state, n);
+        size_t run = copy_plain(s, p, n);
+        ssize_t len = 0;
+
+        if (run < n) {
+                len = json_unescape(p + run, n - run, s + run);
+                if (len < 0) {
+                        if (!state->arena)
+                                free(s);
+                        syntax(state, "Bad character or escape in string");
+                }
+        }
+        s[run + len] = '\0';
+        return s;
+}
+
+/* returns one of "{}[]:,qbfin" or EOF */
+static int
+get_tok_buf(struct jstate_t *state)
+{
+        const char *p, *end = state->end;
+        const char *q;
+        int c, tok;
+
+        if (!state->scan || (p = next_tok(state)) == NULL)
+                p = buf_slide(state->p, end);
+        state->p = p;
+        if (p >= end)
+                return EOF;
+
+        c = *p++;
+        switch (c) {
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+        case ',':
+        case ':':
+                state->p = p;
+                return c;
+        case '"':
+                /* With the index, the next token is the closing quote */
+                if (!state->scan || (q = next_tok(state)) == NULL)
+                        q = buf_endquote(p, end);
+                else if (q >= end)
+                        q = NULL;
+                if (!q)
+                        syntax(state, "Expected: closing delimiter");
+                state->cur_token.s = decode_string(state, p, q - p);
+                state->p = q + 1;
+                return 'q';
+        case 't':
+        case 'T':
+                if (buf_literal(&p, end, "rue") < 0)
+                        goto err;
+                state->cur_token.b = true;
+                tok = 'b';
+                break;
+        case 'f':
+        case 'F':
+                if (buf_literal(&p, end, "alse") < 0)
+                        goto err;
+                state->cur_token.b = false;
+                tok = 'b';
+                break;
+        case 'n':
+        case 'N':
+                if (buf_literal(&p, end, "ull") < 0)
+                        goto err;
+                tok = 'n';
+                break;
+        default:
+                --p;
+                tok = buf_number(&p, end, &state->cur_token);
+                if (tok < 0) {
+                        if (buf_isdigit(p, end) || strchr(".-+", c))
+                                syntax(state,
+                                       "Cannot evaluate numeric expression");
+                        goto err;
+                }
+                break;
+        }
+        /*
+         * With the index, whatever is left of a bad literal or number
+         * would be skipped, not seen as the next token, so check here.
+         */
+        if (state->scan && p < end && !buf_isdelim(*p)) {
+                state->p = p;
+                goto err;
+        }
+        state->p = p;
+        return tok;
+
+err:
+        syntax(state, "Unknown token type");
+        return EOF;
+}
+
+static int
+get_tok(struct jstate_t *state)
+{
+        if (state->saved_tok) {
+                int tok = state->saved_tok;
+                state->saved_tok = 0;
+                return tok;
+        }
+        return state->fp ? get_tok_file(state) : get_tok_buf(state);
+}
+
+/* Push back a token.  Don't use with "qbfi", they'd lose their value */
+static void
+unget_tok(struct jstate_t *state, int tok)
+{
+        state->saved_tok = tok;
+}
+
+/*
+ * Create a new node and append it to @parent's children, right
+ * after @prev, which must be @parent's last child, or NULL if
+ * @parent has no children yet.  Allocate it from @arena, or with
+ * malloc() if @arena is NULL.
+ */
+static struct json_t *
+new_json_after(struct json_arena_t *arena,
+               struct json_t *parent, struct json_t *prev)
+{
+        struct json_t *ret;
+
+        if (arena)
+                ret = pool_alloc(&arena->nodes, arena->block_size,
+                                 sizeof(*ret));
+        else
+                ret = malloc(sizeof(*ret));
+        if (!ret)
+                return NULL;
+
+        memset(ret, 0, sizeof(*ret));
+        if (arena)
+                ret->flags |= JSON_ARENA;
+        ret->parent = parent;
+        if (parent)
+                index_drop(parent);
+        if (prev != NULL) {
+                prev->sib_next = ret;
+                ret->sib_prev = prev;
+        } else if (parent != NULL) {
+                parent->children = ret;
+        }
+        return ret;
+}
+
+static struct json_t *
+new_json(struct json_t *parent)
+{
+        struct json_t *sibs = NULL;
+        struct json_t *ret;
+
+        if (parent && (sibs = parent->children) != NULL) {
+                /* Keep children in order of creation */
+                while (sibs->sib_next != NULL)
+                        sibs = sibs->sib_next;
+        }
+        ret = new_json_after(NULL, parent, sibs);
+        if (ret && parent)
+                parent->array_size++;
+        return ret;
+}
+
+/* new_json_after() for the parser, which longjmp's if out of memory */
+static struct json_t *
+jnew_json(struct jstate_t *state, struct json_t *parent,
+          struct json_t *prev)
+{
+        struct json_t *ret = new_json_after(state->arena, parent, prev);
+        if (!ret)
+                longjmp(state->env, 1);
+        return ret;
+}
+
+static void
+json_free_memb(struct json_t *memb)
+{
+        struct json_t *child;
+        bool arena = !!(memb->flags & JSON_ARENA);
+
+        /*
+         * Don't leave orphans lying around.  Each call unlinks
+         * @child from memb->children, so don't use child->sib_next
+         * afterward.  (Arena nodes' children are freed along with the
+         * arena.)
+         */
+        while (!arena && (child = memb->children) != NULL)
+                json_free_memb(child);
+
+        /* Untangled its linked lists */
+        if (memb->parent) {
+                index_drop(memb->parent);
+                memb->parent->array_size--;
+        }
+        if (memb->parent && memb->parent->children == memb)
+                memb->parent->children = memb->sib_next;
+        if (memb->sib_prev)
+                memb->sib_prev->sib_next = memb->sib_next;
+        if (memb->sib_next)
+                memb->sib_next->sib_prev = memb->sib_prev;
+
+        if (arena)
+                return;
+
+        if (memb->type == 'q' && memb->value.s != NULL)
+                free(memb->value.s);
+        else if (is_container(memb))
+                index_drop(memb);
+
+        free(memb);
+}
+
+static void parse_array(struct jstate_t *state, struct json_t *parent);
+static void parse_dict(struct jstate_t *state, struct json_t *parent);
+static struct json_t *parse_atom(struct jstate_t *state,
+                                 struct json_t *parent,
+                                 struct json_t *prev);
+
+static void
+parse_field_value(struct jstate_t *state, struct json_t *j)
+{
+        int tok = get_tok(state);
+        j->type = tok;
+        switch (tok) {
+        case '{':
+                parse_dict(state, j);
+                break;
+        case '[':
+                parse_array(state, j);
+                break;
+        case 'q':
+                /* Hand over pointer... easier than strdup+free */
+                j->value.s = state->cur_token.s;
+                break;
+        case 'b':
+                j->value.b = state->cur_token.b;
+                break;
+        case 'f':
+                j->value.f = state->cur_token.f;
+                break;
+        case 'i':
+                j->value.i = state->cur_token.i;
+                break;
+        case 'n':
+                break;
+        default:
+                /* The top has no parent; parse_top() frees that one */
+                if (j->parent)
+                        json_free_memb(j);
+                syntax(state, "Unexpected token");
+        }
+}
+
+/* Helper for parse_array and parse_dict */
+static void
+check_endtok(struct jstate_t *state, int tok, int c)
+{
+        if (tok != c) {
+                syntax(state, "Expected: `%c' at end of %s",
+                        c, c == ']' ? "array" : "dict");
+        }
+}
+
+static void
+parse_array(struct jstate_t *state, struct json_t *parent)
+{
+        int tok;
+        struct json_t *child = NULL;
+
+        if ((tok = get_tok(state)) == ']')
+                return;
+        unget_tok(state, tok);
+        do {
+                /* for debugging later */
+                char namebuf[128];
+                int len;
+                child = jnew_json(state, parent, child);
+                len = sprintf(namebuf, "(%d)", parent->array_size);
+                child->name = jstrndup(state, namebuf, len);
+                parse_field_value(state, child);
+                parent->array_size++;
+        } while ((tok = get_tok(state)) == ',');
+        check_endtok(state, tok, ']');
+        index_placeholder(state, parent);
+}
+
+static void
+parse_dict(struct jstate_t *state, struct json_t *parent)
+{
+        int tok;
+        struct json_t *child = NULL;
+
+        /* Appending from file, parent may already have children */
+        if ((child = parent->children) != NULL) {
+                while (child->sib_next != NULL)
+                        child = child->sib_next;
+        }
+
+        if ((tok = get_tok(state)) == '}')
+                return;
+        unget_tok(state, tok);
+        do {
+                child = parse_atom(state, parent, child);
+                parent->array_size++;
+        } while ((tok = get_tok(state)) == ',');
+        check_endtok(state, tok, '}');
+        index_placeholder(state, parent);
+}
+
+static struct json_t *
+parse_atom(struct jstate_t *state, struct json_t *parent,
+           struct json_t *prev)
+{
+        int tok;
+        struct json_t *child = jnew_json(state, parent, prev);
+        if ((tok = get_tok(state)) != 'q')
+                syntax(state, "Expected: quoted string");
+        /* Hand over pointer ... better than strdup + free */
+        child->name = state->cur_token.s;
+        if ((tok = get_tok(state)) != ':')
+                syntax(state, "Expected: `:' but got %c", tok);
+
+        parse_field_value(state, child);
+        return child;
+}
+
+/**
+ * json_parse - Parse a file and create a JSON tree.
+ * @fp: JSON file to parse
+ * @info: Pointer to data containing some additional info about
+ *      the tree.  If this is NULL, then json_append_from_file()
+ *      and json_create_child() may not be used.
+ *
+ * Return: Handle to the top level of the JSON tree.
+ *
+ * Note: This is called a "tree" for egg-headed reasons only.
+ * For swizzling purposes (some calling code is copying
+ * this into SHM), the actual data structure is an array.
+ */
+struct json_t *
+json_parse(FILE *fp)
+{
+        return json_parse_arena(fp, NULL);
+}
+
+/* Parse @state's input into a new tree */
+static struct json_t *
+parse_top(struct jstate_t *state)
+{
+        struct json_t *volatile top = NULL;
+
+        if (setjmp(state->env) != 0) {
+                if (top != NULL && !state->arena)
+                        json_free(top);
+                top = NULL;
+        } else {
+                top = jnew_json(state, NULL, NULL);
+                parse_field_value(state, top);
+        }
+        free(state->sbuf);
+        return top;
+}
+
+/**
+ * json_parse_arena - Like json_parse(), but allocate from an arena
+ * @fp: JSON file to parse
+ * @arena: Arena created with json_arena_create(), or NULL to
+ *      allocate with malloc() like json_parse() does.
+ *
+ * Return: Handle to the top level of the JSON tree, or NULL if there
+ *      was a syntax error or not enough memory.
+ *
+ * Every node and string in the tree is allocated from @arena.  They
+ * are freed all at once, by calling json_arena_free() or
+ * json_arena_reset(), instead of calling json_free() on the tree.
+ * Calling json_free() on any node in the tree only unlinks it from its
+ * parent and siblings.  Nodes added later with json_create_child() or
+ * json_append_from_file() are allocated with malloc(), so call
+ * json_free() on them before freeing the arena.
+ *
+ * The memory for a tree which failed to parse is not reclaimed until
+ * @arena is reset or freed.
+ */
+struct json_t *
+json_parse_arena(FILE *fp, struct json_arena_t *arena)
+{
+        struct jstate_t state;
+
+        memset(&state, 0, sizeof(state));
+        state.fp = fp;
+        state.lineno = 1;
+        state.arena = arena;
+        return parse_top(&state);
+}
+
+/**
+ * json_parse_buf - Parse a buffer and create a JSON tree.
+ * @p: Buffer containing JSON text.  It need not be nulchar-terminated,
+ *      so this may be a file mapped with mmap().
+ * @n: Length of @p
+ *
+ * Return: Handle to the top level of the JSON tree, or NULL if
+ *      there was a syntax error.
+ *
+ * This gives the same result as json_parse() would for the same text,
+ * but it's faster: it scans @p directly rather than through stdio,
+ * most numbers are converted here without copying them into a buffer
+ * for strtod() or strtoll(), and tokens are found with SIMD compares,
+ * 64 bytes at a time, when compiled for SSE2 or AVX2.
+ */
+struct json_t *
+json_parse_buf(const char *p, size_t n)
+{
+        return json_parse_buf_arena(p, n, NULL);
+}
+
+/**
+ * json_parse_buf_arena - Like json_parse_buf(), but allocate from
+ *                        an arena
+ * @p: Buffer containing JSON text
+ * @n: Length of @p
+ * @arena: Arena created with json_arena_create(), or NULL to
+ *      allocate with malloc() like json_parse_buf() does.
+ *
+ * Return: Handle to the top level of the JSON tree, or NULL if there
+ *      was a syntax error or not enough memory.
+ *
+ * See json_parse_arena() for how to free the tree.
+ */
+struct json_t *
+json_parse_buf_arena(const char *p, size_t n, struct json_arena_t *arena)
+{
+        struct jstate_t state;
+
+        struct json_scan_t scan;
+
+        memset(&state, 0, sizeof(state));
+        state.start = state.p = p;
+        state.end = p + n;
+        state.arena = arena;
+
+        scan.next = p;
+        scan.npos = scan.ipos = 0;
+        scan.in_str = scan.esc_carry = scan.scalar_carry = 0;
+        state.scan = &scan;
+
+        return parse_top(&state);
+}
+
+/**
+ * Parse @fp, whose contents are a descendant of @parent_node
+ * @parent_node: Node in a JSON tree to append new json data to
+ * @fp: File to parse
+ * @info: JSON info filled in by original call to json_parse().
+ *      This may not be NULL.
+ *
+ * Return: 0 if success, -1 if fail.  If return value is -1,
+ * the JSON tree may be in an undefined state, and should be
+ * freed.  Absurdly cautious people may wish to memcpy everything
+ * before calling this funcion.
+ *
+ * FIXME: Sort of confusing how the hierarchy works here.
+ */
+int
+json_append_from_file(struct json_t *parent_node, FILE *fp)
+{
+        int tok;
+        struct jstate_t state;
+
+        if (!parent_node)
+                return -1;
+
+        memset(&state, 0, sizeof(state));
+        state.fp        = fp;
+        state.lineno    = 1;
+
+        if (setjmp(state.env) != 0) {
+                free(state.sbuf);
+                return -1;
+        }
+
+        tok = get_tok(&state);
+        if (tok != '{')
+                syntax(&state, "Expected: { at start of file");
+        parse_dict(&state, parent_node);
+        free(state.sbuf);
+        return 0;
+}
+
+/**
+ * json_create_child - Append a new child to a parent node
+ * @parent_node: Parent node to append a child to
+ *
+ * Return: Handle to the child node.
+ *
+ * This is a simple alternative to json_append_from_file, where
+ * you need to append just one or two new nodes.
+ */
+struct json_t *
+json_create_child(struct json_t *parent_node)
+{
+        if (!parent_node)
+                return NULL;
+
+        return new_json(parent_node);
+}
+
+/* Un-syntax()-able code */
+
+void
+json_free(struct json_t *tbl)
+{
+        if (tbl != NULL)
+                json_free_memb(tbl);
+}
+
+struct json_t *
+json_parent(struct json_t *child)
+{
+        return child->parent;
+}
+
+/**
+ * This returns first result whose name doesn't start with "//".
+ * For strict JSON, just use parent->child
+ */
+struct json_t *
+json_first_child(struct json_t *parent)
+{
+        struct json_t *child = parent->children;
+        while (child != NULL && child->name[0] == '/'
+               && child->name[1] == '/') {
+                child = child->sib_next;
+        }
+        return child;
+}
+
+/**
+ * This returns first result whose name doesn't start with "//".
+ * For strict JSON, just use parent->child
+ */
+struct json_t *
+json_next_child(struct json_t *sibling)
+{
+        struct json_t *ret = sibling;
+        do {
+                ret = ret->sib_next;
+        } while (ret != NULL
+                 && ret->name[0] == '/' && ret->name[1] == '/');
+        return ret;
+}
+
+struct json_t *
+json_find_child(struct json_t *parent, const char *name, bool case_sensitive)
+{
+        struct json_t *child;
+
+        if (*name == '[') {
+                /*
+                 * Numerical array.
+                 * Just count children rather than strcmp()ing
+                 * all the ASCII numbers with name.
+                 */
+                char *endptr;
+                int idx;
+                ++name;
+
+                /* Don't try to dereference a non-numerical array */
+                if (parent->type != '[')
+                        return NULL;
+
+                /*
+                 * Don't get cute with Python-like negative indices.
+                 * Only dereference with positive index numbers.
+                 */
+                idx = strtoul(name, &endptr, 0);
+                if (endptr == name || endptr[0] != ']' || endptr[1] != '\0')
+                        return NULL;
+
+                return json_child_at(parent, idx);
+        } else {
+                /* Associative array. */
+                int (*cmp)(const char *, const char *);
+                struct json_index_t *ix;
+
+                if (parent->type != '{')
+                        return NULL;
+
+                cmp = case_sensitive ? strcmp : name_casecmp;
+
+                if ((ix = get_name_index(parent)) != NULL) {
+                        /*
+                         * Keep probing past the first match, in case of
+                         * duplicate names.  Return the first in order,
+                         * same as the linear search below.
+                         */
+                        unsigned int si = name_hash(name);
+                        int i, best = -1;
+                        while ((i = ix->slot[si & ix->mask]) >= 0) {
+                                if ((best < 0 || i < best)
+                                    && !cmp(ix->child[i]->name, name)) {
+                                        best = i;
+                                }
+                                ++si;
+                        }
+                        return best >= 0 ? ix->child[best] : NULL;
+                }
+
+                JSON_FOR_EACH_CHILD(parent, child) {
+                        if (!cmp(child->name, name))
+                                return child;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * json_child_at - Get a child by its position
+ * @parent: Parent node
+ * @n: Position of child, not counting children whose names begin
+ *      with "//"
+ *
+ * Return: The child, or NULL if @parent has @n or fewer children.
+ *
+ * For containers with many children, this is O(1) after the first
+ * call, rather than a walk down the sibling list.
+ */
+struct json_t *
+json_child_at(struct json_t *parent, int n)
+{
+        struct json_t *child;
+        struct json_index_t *ix;
+
+        if (n < 0 || !is_container(parent))
+                return NULL;
+
+        if ((ix = get_index(parent)) != NULL)
+                return n < ix->nchild ? ix->child[n] : NULL;
+
+        JSON_FOR_EACH_CHILD(parent, child) {
+                if (n-- == 0)
+                        return child;
+        }
+        return NULL;
+}
+
+/**
+ * json_idx - Get the position of a node among its siblings
+ *
+ * Return: Same number that json_child_at() would need to find @memb,
+ *      or -1 if @memb has no parent.
+ */
+int
+json_idx(struct json_t *memb)
+{
+        struct json_t *sib;
+        int n = 0;
+
+        if (!memb->parent)
+                return -1;
+        for (sib = memb->sib_prev; sib != NULL; sib = sib->sib_prev) {
+                if (!is_comment(sib))
+                        ++n;
+        }
+        return n;
+}
+
+/*
+ * Like json_find_child, but namelen determines end of
+ * string rather than the nulchar.
+ * Extracted from json_find_descendant to explicitly
+ * avoid putting a bunch of buf[]'s on the stack, since it
+ * is a recursive function.
+ */
+static struct json_t *
+json_find_child_nonul(struct json_t *parent, const char *name,
+                      bool case_sensitive, size_t namelen)
+{
+        char buf[512];
+
+        /* Waaay too long member name */
+        if (namelen >= sizeof(buf))
+                return NULL;
+
+        strncpy(buf, name, namelen);
+        buf[namelen] = '\0';
+
+        return json_find_child(parent, buf, case_sensitive);
+}
+
+struct json_t *
+json_find_descendant(struct json_t *parent, const char *name,
+                     bool case_sensitive, int delim)
+{
+        const char *end;
+        size_t len;
+        struct json_t *child;
+
+        /*
+         * Square brackets in ``name" are reserved for numerical arrays.
+         *
+         * In a perfect world, delim is a period `.',
+         * allowing ``name" to be something that looks like javascript.
+         * In our world, delim is probably a hyphen `-'.
+         */
+        if (delim == '[')
+                return NULL;
+
+        for (end = name; *end != '\0'; end++) {
+                if (*end == delim
+                    || (end != name && *end == '[')) {
+                        break;
+                }
+        }
+
+        /* We have reached the end of our recursion */
+        if (*end == '\0')
+                return json_find_child(parent, name, case_sensitive);
+        len = end - name;
+
+        /* Move past delimiter, if not [#] */
+        if (*end == delim)
+                ++end;
+
+        child = json_find_child_nonul(parent, name, case_sensitive, len);
+        if (!child)
+                return NULL;
+
+        return json_find_descendant(child, end, case_sensitive, delim);
+}
+
+int
+json_count_children(struct json_t *memb)
+{
+        int count = 0;
+        struct json_t *child;
+
+        /*
+         * XXX: If we don't skipp '//' entries,
+         * then this could be reduced to just
+         *
+         *      return memb->array_size;
+         */
+
+        JSON_FOR_EACH_CHILD(memb, child)
+                ++count;
+        return count;
+}
+
+static void
+prnlsp(FILE *fp, int depth, bool eol)
+{
+        if (!eol)
+                return;
+
+        putc('\n', fp);
+        while (depth-- > 0) {
+                putc(' ', fp);
+                putc(' ', fp);
+        }
+}
+
+static void
+json_print_r(FILE *fp, struct json_t *j, int depth, bool eol)
+{
+        prnlsp(fp, depth, eol);
+
+        /* If we're not an array member, print name */
+        if (j->parent != NULL && j->parent->type != '[')
+                fprintf(fp, "\"%s\": ", j->name);
+
+        if (j->type == '[' || j->type == '{') {
+                struct json_t *child;
+                int nchild;
+
+                putc(j->type, fp);
+
+                nchild = 0;
+                JSON_FOR_EACH_CHILD_STRICT(j, child) {
+                        if (nchild > 0)
+                                putc(',', fp);
+                        json_print_r(fp, child, depth + 1, eol);
+                        ++nchild;
+                }
+
+                prnlsp(fp, depth, eol);
+                putc(j->type + 2, fp);
+        } else {
+                switch (j->type) {
+                case 'q':
+                        fprintf(fp, "\"%s\"", j->value.s);
+                        break;
+                case 'f':
+                        fprintf(fp, "%.15e", j->value.f);
+                        break;
+                case 'i':
+                        fprintf(fp, "%lld", j->value.i);
+                        break;
+                case 'b':
+                        fprintf(fp, "%s", j->value.b ? "true" : "false");
+                        break;
+                case 'n':
+                        fputs("null", fp);
+                        break;
+                default:
+                        /* TODO: BUG */
+                        break;
+                }
+        }
+}
+
+void
+json_print(FILE *fp, struct json_t *tbl, bool eol)
+{
+        json_print_r(fp, tbl, 0, eol);
+        if (eol)
+                putc('\n', fp);
+}
+
+
+
+/*
+ * Serializer
+ *
+ * json_write() appends to a growable buffer instead of going through
+ * stdio for every token.  Strings are copied in runs between the
+ * characters that need escaping, integers are converted two digits at
+ * a time, and indentation is copied from a string of spaces.
+ */
+enum {
+        JSON_BUF_MIN = 4096,
+        /* Longest number we write, plus slack */
+        JSON_NUMBER_MAX = 32,
+};
+
+/* "\n" followed by enough spaces for most documents */
+static const char json_indent[] =
+        "\n                                                                ";
+
+static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+/*
+ * Nonzero for characters that need escaping: the letter after '\'.
+ * Control characters are all spelled out, since overriding a range
+ * initializer entry by entry draws -Woverride-init.
+ */
+static const char json_escape[256] = {
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',         /* 0x00 */
+        'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',         /* 0x08 */
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',         /* 0x10 */
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',         /* 0x18 */
+        ['"'] = '"',
+        ['\\'] = '\\',
+};
+
+/**
+ * json_buf_free - Free a buffer filled by json_write()
+ *
+ * The buffer is left empty, ready to be written to again.
+ */
+void
+json_buf_free(struct json_buf_t *b)
+{
+        free(b->p);
+        b->p = NULL;
+        b->len = b->size = 0;
+}
+
+/* Make room for @n more bytes, return where they go, or NULL */
+static char *
+buf_reserve(struct json_buf_t *b, size_t n)
+{
+        if (b->size - b->len < n) {
+                size_t size = b->size ? b->size : JSON_BUF_MIN;
+                char *p;
+
+                while (size - b->len < n)
+                        size *= 2;
+                p = realloc(b->p, size);
+                if (!p)
+                        return NULL;
+                b->p = p;
+                b->size = size;
+        }
+        return b->p + b->len;
+}
+
+static int
+buf_append(struct json_buf_t *b, const char *s, size_t n)
+{
+        char *p = buf_reserve(b, n);
+        if (!p)
+                return -1;
+        memcpy(p, s, n);
+        b->len += n;
+        return 0;
+}
+
+/*
+ * Write @v's digits backward, ending just before @end.
+ * Return where they start.
+ */
+static char *
+fmt_u64(char *end, unsigned long long v)
+{
+        while (v >= 100) {
+                unsigned int r = v % 100;
+                v /= 100;
+                end -= 2;
+                memcpy(end, &digit_pairs[r * 2], 2);
+        }
+        if (v >= 10) {
+                end -= 2;
+                memcpy(end, &digit_pairs[v * 2], 2);
+        } else {
+                *--end = '0' + v;
+        }
+        return end;
+}
+
+/* Write @v into @buf, return its length */
+static int
+fmt_int(char *buf, long long v)
+{
+        char tmp[JSON_NUMBER_MAX];
+        char *end = &tmp[sizeof(tmp)];
+        unsigned long long u = v;
+        char *p;
+
+        if (v < 0)
+                u = -u;
+        p = fmt_u64(end, u);
+        if (v < 0)
+                *--p = '-';
+        memcpy(buf, p, end - p);
+        return end - p;
+}
+
+/*
+ * Shortest round-trip formatting of doubles, with Grisu2 (Florian
+ * Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers", PLDI 2010).
+ *
+ * The double and the midpoints to its neighbors are scaled by a cached
+ * power of ten into 64-bit fixed point, and digits are generated until
+ * the result is closer to the double than to either neighbor.  All of
+ * it is integer arithmetic.  The output always reads back as the same
+ * double, and is the shortest that does for all but a tiny fraction of
+ * inputs, where it's one digit longer.
+ */
+struct diyfp_t {
+        uint64_t f;
+        int e;
+};
+
+/* 10^-348, 10^-340, ..., 10^340, normalized */
+static const uint64_t cached_pow_f[] = {
+        0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+        0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+        0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+        0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+        0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+        0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+        0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+        0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+        0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+        0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+        0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+        0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+        0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+        0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+        0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+        0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+        0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+        0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+        0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+        0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+        0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+        0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+        0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+        0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+        0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+        0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+        0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+        0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+        0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t cached_pow_e[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+        -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+        -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+        -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+        -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+        109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+        375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+        641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+        907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL,
+};
+
+/* High 64 bits of the 128-bit product, rounded */
+static struct diyfp_t
+diyfp_mul(struct diyfp_t x, struct diyfp_t y)
+{
+        const uint64_t m32 = 0xffffffffULL;
+        uint64_t a = x.f >> 32, b = x.f & m32;
+        uint64_t c = y.f >> 32, d = y.f & m32;
+        uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+        uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+        struct diyfp_t r;
+
+        tmp += 1U << 31;
+        r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+        r.e = x.e + y.e + 64;
+        return r;
+}
+
+static struct diyfp_t
+diyfp_normalize(struct diyfp_t x)
+{
+        int s = __builtin_clzll(x.f);
+        x.f <<= s;
+        x.e -= s;
+        return x;
+}
+
+/* Move last digit of @buf down while it's still in range and closer */
+static void
+grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+            uint64_t ten_kappa, uint64_t wp_w)
+{
+        while (rest < wp_w && delta - rest >= ten_kappa
+               && (rest + ten_kappa < wp_w
+                   || wp_w - rest > rest + ten_kappa - wp_w)) {
+                buf[len - 1]--;
+                rest += ten_kappa;
+        }
+}
+
+/*
+ * Write the digits of @d, which must be finite and positive, into
+ * @buf.  Return how many, and set *@k to the power of ten that the
+ * last one is in.
+ */
+static int
+grisu2(double d, char *buf, int *k)
+{
+        struct diyfp_t v, w, wp, wm, c, one;
+        uint64_t bits, delta, wp_w, p2, tmp;
+        uint32_t p1;
+        int kappa, len = 0, idx;
+        double dk;
+
+        memcpy(&bits, &d, sizeof(bits));
+        v.f = bits & ((1ULL << 52) - 1);
+        v.e = (int)(bits >> 52);
+        if (v.e != 0) {
+                v.f += 1ULL << 52;
+                v.e -= 1075;
+        } else {
+                v.e = -1074;
+        }
+
+        /* Midpoints to the neighbors, with the same exponent */
+        wp.f = (v.f << 1) + 1;
+        wp.e = v.e - 1;
+        wp = diyfp_normalize(wp);
+        if (v.f == 1ULL << 52) {
+                /* Lower neighbor is closer, at a power of two */
+                wm.f = (v.f << 2) - 1;
+                wm.e = v.e - 2;
+        } else {
+                wm.f = (v.f << 1) - 1;
+                wm.e = v.e - 1;
+        }
+        wm.f <<= wm.e - wp.e;
+        wm.e = wp.e;
+
+        /* Scale so the exponent is in [-60, -32] */
+        dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+        idx = (int)dk;
+        if (dk - idx > 0.0)
+                idx++;
+        idx = (idx >> 3) + 1;
+        *k = -(-348 + idx * 8);
+        c.f = cached_pow_f[idx];
+        c.e = cached_pow_e[idx];
+
+        w = diyfp_mul(diyfp_normalize(v), c);
+        wp = diyfp_mul(wp, c);
+        wm = diyfp_mul(wm, c);
+        wm.f++;
+        wp.f--;
+        delta = wp.f - wm.f;
+        wp_w = wp.f - w.f;
+
+        /* Integer part of wp, then the fraction */
+        one.e = wp.e;
+        one.f = 1ULL << -one.e;
+        p1 = wp.f >> -one.e;
+        p2 = wp.f & (one.f - 1);
+        for (kappa = 1; kappa < 10 && p1 >= pow10_u64[kappa]; kappa++)
+                ;
+
+        while (kappa > 0) {
+                uint32_t digit = p1 / pow10_u64[kappa - 1];
+                p1 %= pow10_u64[kappa - 1];
+                if (digit || len)
+                        buf[len++] = '0' + digit;
+                kappa--;
+                tmp = ((uint64_t)p1 << -one.e) + p2;
+                if (tmp <= delta) {
+                        *k += kappa;
+                        grisu_round(buf, len, delta, tmp,
+                                    pow10_u64[kappa] << -one.e, wp_w);
+                        return len;
+                }
+        }
+
+        for (;;) {
+                int digit;
+
+                p2 *= 10;
+                delta *= 10;
+                digit = p2 >> -one.e;
+                if (digit || len)
+                        buf[len++] = '0' + digit;
+                p2 &= one.f - 1;
+                kappa--;
+                if (p2 < delta) {
+                        *k += kappa;
+                        grisu_round(buf, len, delta, p2, one.f,
+                                    -kappa < 20 ? wp_w * pow10_u64[-kappa]
+                                                : 0);
+                        return len;
+                }
+        }
+}
+
+/*
+ * Write @d into @buf, return its length.  Like JavaScript, use plain
+ * decimals for exponents from -6 to 20, otherwise scientific notation.
+ * Always have a '.' or 'e', so it reads back as a float.
+ */
+static int
+fmt_double(char *buf, double d)
+{
+        char digits[20];
+        char *p = buf;
+        int len, k, point;
+
+        if (!isfinite(d)) {
+                /* JSON can't say it, so do what JavaScript does */
+                memcpy(buf, "null", 4);
+                return 4;
+        }
+        if (signbit(d)) {
+                *p++ = '-';
+                d = -d;
+        }
+        if (d == 0.0) {
+                memcpy(p, "0.0", 3);
+                return p + 3 - buf;
+        }
+
+        len = grisu2(d, digits, &k);
+        /* Position of the decimal point, from the first digit */
+        point = len + k;
+
+        if (k >= 0 && point <= 21) {
+                /* Integer: 1234000.0 */
+                memcpy(p, digits, len);
+                p += len;
+                memset(p, '0', k);
+                p += k;
+                memcpy(p, ".0", 2);
+                p += 2;
+        } else if (point > 0 && point <= 21) {
+                /* 1234.5678 */
+                memcpy(p, digits, point);
+                p += point;
+                *p++ = '.';
+                memcpy(p, &digits[point], len - point);
+                p += len - point;
+        } else if (point > -6 && point <= 0) {
+                /* 0.00012345 */
+                memcpy(p, "0.", 2);
+                p += 2;
+                memset(p, '0', -point);
+                p += -point;
+                memcpy(p, digits, len);
+                p += len;
+        } else {
+                /* 1.2345e-67 */
+                *p++ = digits[0];
+                if (len > 1) {
+                        *p++ = '.';
+                        memcpy(p, &digits[1], len - 1);
+                        p += len - 1;
+                }
+                *p++ = 'e';
+                if (point - 1 < 0) {
+                        *p++ = '-';
+                        p += fmt_int(p, 1 - point);
+                } else {
+                        *p++ = '+';
+                        p += fmt_int(p, point - 1);
+                }
+        }
+        return p - buf;
+}
+
+/* Write @s as a quoted, escaped JSON string */
+static int
+write_string(struct json_buf_t *b, const char *s)
+{
+        const unsigned char *run = (const unsigned char *)s;
+        const unsigned char *u = run;
+        char esc[6];
+        int c;
+
+        if (buf_append(b, "\"", 1) < 0)
+                return -1;
+        for (;;) {
+                while ((c = *u) != '\0' && !json_escape[c])
+                        ++u;
+                if (buf_append(b, (const char *)run, u - run) < 0)
+                        return -1;
+                if (c == '\0')
+                        break;
+                esc[0] = '\\';
+                esc[1] = json_escape[c];
+                if (esc[1] == 'u') {
+                        memcpy(&esc[2], "00", 2);
+                        esc[4] = "0123456789abcdef"[c >> 4];
+                        esc[5] = "0123456789abcdef"[c & 0xf];
+                }
+                if (buf_append(b, esc, esc[1] == 'u' ? 6 : 2) < 0)
+                        return -1;
+                run = ++u;
+        }
+        return buf_append(b, "\"", 1);
+}
+
+static int
+write_indent(struct json_buf_t *b, int depth)
+{
+        size_t n = depth * 2 + 1;
+        size_t max = sizeof(json_indent) - 1;
+        char *p;
+
+        if (n <= max)
+                return buf_append(b, json_indent, n);
+
+        if ((p = buf_reserve(b, n)) == NULL)
+                return -1;
+        *p = '\n';
+        memset(p + 1, ' ', n - 1);
+        b->len += n;
+        return 0;
+}
+
+static int
+json_write_r(struct json_buf_t *b, struct json_t *j, int depth, bool pretty)
+{
+        struct json_t *child;
+        char *p;
+
+        switch (j->type) {
+        case '[':
+        case '{':
+                if ((p = buf_reserve(b, 1)) == NULL)
+                        return -1;
+                *p = j->type;
+                b->len++;
+                JSON_FOR_EACH_CHILD_STRICT(j, child) {
+                        if (child != j->children
+                            && buf_append(b, ",", 1) < 0) {
+                                return -1;
+                        }
+                        if (pretty && write_indent(b, depth + 1) < 0)
+                                return -1;
+                        if (j->type == '{') {
+                                if (write_string(b, child->name) < 0)
+                                        return -1;
+                                if (buf_append(b, ": ", pretty ? 2 : 1) < 0)
+                                        return -1;
+                        }
+                        if (json_write_r(b, child, depth + 1, pretty) < 0)
+                                return -1;
+                }
+                if (pretty && j->children != NULL
+                    && write_indent(b, depth) < 0) {
+                        return -1;
+                }
+                p = buf_reserve(b, 1);
+                if (!p)
+                        return -1;
+                *p = j->type + 2;
+                b->len++;
+                return 0;
+        case 'q':
+                return write_string(b, j->value.s);
+        case 'i':
+        case 'f':
+                p = buf_reserve(b, JSON_NUMBER_MAX);
+                if (!p)
+                        return -1;
+                if (j->type == 'i')
+                        b->len += fmt_int(p, j->value.i);
+                else
+                        b->len += fmt_double(p, j->value.f);
+                return 0;
+        case 'b':
+                return j->value.b ? buf_append(b, "true", 4)
+                                  : buf_append(b, "false", 5);
+        case 'n':
+                return buf_append(b, "null", 4);
+        default:
+                /* Same as json_print() */
+                return 0;
+        }
+}
+
+/**
+ * json_write - Serialize a JSON tree into a buffer
+ * @b: Buffer to append to.  Set it to all zeros before the first call,
+ *      and free it with json_buf_free().
+ * @j: Tree, or subtree, to write
+ * @flags: JSON_WRITE_PRETTY to put each member on its own line,
+ *      indented by two spaces per level, or zero for no whitespace
+ *      at all
+ *
+ * Return: 0 on success, -1 if out of memory.  If -1, @b still has
+ *      everything written before the failure, but no more.
+ *
+ * Unlike json_print(), the output is valid JSON: strings are escaped,
+ * and floats are written with (nearly always) the fewest digits that
+ * read back as the same double, with a ".0" if they'd look like
+ * integers otherwise.
+ * Infinities and NaNs are written as null.  @b is not nulchar-
+ * terminated.
+ */
+int
+json_write(struct json_buf_t *b, struct json_t *j, int flags)
+{
+        size_t len = b->len;
+
+        if (json_write_r(b, j, 0, !!(flags & JSON_WRITE_PRETTY)) < 0) {
+                b->len = len;
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * json_fwrite - Like json_write(), but write to a file
+ *
+ * Return: 0 on success, -1 if out of memory or a write error.
+ */
+int
+json_fwrite(FILE *fp, struct json_t *j, int flags)
+{
+        struct json_buf_t b = { NULL, 0, 0 };
+        int res = json_write(&b, j, flags);
+
+        if (res == 0 && fwrite(b.p, 1, b.len, fp) != b.len)
+                res = -1;
+        json_buf_free(&b);
+        return res;
+}
+
+/*
+ * Binary encoding
+ *
+ * json_bin_encode() writes a tree in a form that can be read in place,
+ * e.g. straight out of an mmap()ed file, without parsing.  Values are
+ * referred to by their byte offset from the start of the encoding, and
+ * each one starts at a multiple of 4, with its type byte (one of
+ * `qbfin[{') first:
+ *
+ *      'n'     4 bytes: type, 0, 0, 0
+ *      'b'     4 bytes: type, 0 or 1, 0, 0
+ *      'i' 'f' 12 bytes: type, 3 bytes of padding, long long or double
+ *      'q'     type, 3 bytes of padding, u32 length, the text, a nulchar,
+ *              padding
+ *      '['     type, 3 bytes of padding, u32 count, then that many u32
+ *              offsets of members, in order
+ *      '{'     like '[', followed by count u32 offsets of the keys, which
+ *              are 'q' values, and then count u32 indices of members in
+ *              order of their keys, for binary search
+ *
+ * Members and keys always come after their container, which keeps a
+ * corrupt encoding from sending the readers around in circles.  All of
+ * it is in native byte order, so it's for passing between processes on
+ * one machine, not for saving forever.  The readers check every offset
+ * against the size, so a bad encoding gets errors, not crashes.
+ */
+enum {
+        JSON_BIN_MAGIC = 0x424e534a, /* "JSNB" on little-endian */
+        JSON_BIN_VERSION = 1,
+        JSON_BIN_HDR = 16,
+};
+
+static uint32_t
+bin_get32(const unsigned char *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static void
+bin_put32(struct json_buf_t *b, size_t off, uint32_t v)
+{
+        memcpy(b->p + off, &v, sizeof(v));
+}
+
+/* Append @n zero bytes, rounded up to a multiple of 4, return offset */
+static ssize_t
+bin_alloc(struct json_buf_t *b, size_t n)
+{
+        size_t off = b->len;
+        char *p;
+
+        n = (n + 3) & ~(size_t)3;
+        if (n > UINT32_MAX - off || (p = buf_reserve(b, n)) == NULL)
+                return -1;
+        memset(p, 0, n);
+        b->len += n;
+        return off;
+}
+
+/* Append string @s, return its offset from @base */
+static ssize_t
+bin_string(struct json_buf_t *b, size_t base, const char *s)
+{
+        size_t len = s ? strlen(s) : 0;
+        ssize_t off = bin_alloc(b, 8 + len + 1);
+
+        if (off < 0)
+                return -1;
+        b->p[off] = 'q';
+        bin_put32(b, off + 4, len);
+        if (len)
+                memcpy(b->p + off + 8, s, len);
+        return off - base;
+}
+
+static bool
+bin_encodable(struct json_t *j)
+{
+        return j->type != '\0' && strchr("qbfin[{", j->type) != NULL;
+}
+
+struct bin_key_t {
+        const char *name;
+        uint32_t idx;
+};
+
+static int
+bin_key_cmp(const void *a, const void *b)
+{
+        const struct bin_key_t *ka = a, *kb = b;
+        int res = strcmp(ka->name, kb->name);
+        if (res)
+                return res;
+        /* So that the first of any duplicates is found */
+        return ka->idx < kb->idx ? -1 : 1;
+}
+
+/* Fill in the sorted-keys table of the dict at @off, with @n members */
+static int
+bin_sort_keys(struct json_buf_t *b, size_t base, size_t off, uint32_t n)
+{
+        struct bin_key_t *keys;
+        size_t keytab = off + 8 + (size_t)n * 4;
+        size_t sorttab = keytab + (size_t)n * 4;
+        uint32_t i;
+
+        if (n == 0)
+                return 0;
+        keys = malloc(n * sizeof(*keys));
+        if (!keys)
+                return -1;
+        for (i = 0; i < n; i++) {
+                uint32_t k = bin_get32((unsigned char *)b->p + keytab + i * 4);
+                keys[i].name = b->p + base + k + 8;
+                keys[i].idx = i;
+        }
+        qsort(keys, n, sizeof(*keys), bin_key_cmp);
+        for (i = 0; i < n; i++)
+                bin_put32(b, sorttab + i * 4, keys[i].idx);
+        free(keys);
+        return 0;
+}
+
+/* Append @j, return its offset from @base, or -1 if out of memory */
+static ssize_t
+bin_encode_r(struct json_buf_t *b, size_t base, struct json_t *j)
+{
+        struct json_t *child;
+        ssize_t off, sub;
+        uint32_t n = 0, i = 0;
+        size_t ntab;
+
+        switch (j->type) {
+        case 'n':
+        case 'b':
+                off = bin_alloc(b, 4);
+                if (off < 0)
+                        return -1;
+                b->p[off] = j->type;
+                b->p[off + 1] = j->type == 'b' && j->value.b;
+                return off - base;
+        case 'i':
+        case 'f':
+                off = bin_alloc(b, 12);
+                if (off < 0)
+                        return -1;
+                b->p[off] = j->type;
+                if (j->type == 'i')
+                        memcpy(b->p + off + 4, &j->value.i, 8);
+                else
+                        memcpy(b->p + off + 4, &j->value.f, 8);
+                return off - base;
+        case 'q':
+                return bin_string(b, base, j->value.s);
+        case '[':
+        case '{':
+                break;
+        default:
+                return -1;
+        }
+
+        JSON_FOR_EACH_CHILD_STRICT(j, child) {
+                if (bin_encodable(child))
+                        ++n;
+        }
+        ntab = j->type == '{' ? 3 : 1;
+        off = bin_alloc(b, 8 + ntab * n * 4);
+        if (off < 0)
+                return -1;
+        b->p[off] = j->type;
+        bin_put32(b, off + 4, n);
+
+        JSON_FOR_EACH_CHILD_STRICT(j, child) {
+                if (!bin_encodable(child))
+                        continue;
+                if (j->type == '{') {
+                        sub = bin_string(b, base, child->name);
+                        if (sub < 0)
+                                return -1;
+                        bin_put32(b, off + 8 + (n + i) * 4, sub);
+                }
+                sub = bin_encode_r(b, base, child);
+                if (sub < 0)
+                        return -1;
+                bin_put32(b, off + 8 + i * 4, sub);
+                ++i;
+        }
+        if (j->type == '{' && bin_sort_keys(b, base, off, n) < 0)
+                return -1;
+        return off - base;
+}
+
+/**
+ * json_bin_encode - Encode a JSON tree in binary
+ * @b: Buffer to append to, as for json_write()
+ * @j: Tree, or subtree, to encode
+ *
+ * The encoding can be read in place with json_bin_init() or
+ * json_bin_open(), without parsing.  See "Binary encoding" above for
+ * the layout.
+ *
+ * Return: 0 on success, or -1 if out of memory or the encoding would
+ *      be over 4GB, in which case @b is left as it was.
+ */
+int
+json_bin_encode(struct json_buf_t *b, struct json_t *j)
+{
+        size_t base = b->len;
+        ssize_t hdr, root;
+
+        if ((hdr = bin_alloc(b, JSON_BIN_HDR)) < 0)
+                goto err;
+        if ((root = bin_encode_r(b, base, j)) < 0)
+                goto err;
+        bin_put32(b, hdr, JSON_BIN_MAGIC);
+        bin_put32(b, hdr + 4, JSON_BIN_VERSION);
+        bin_put32(b, hdr + 8, b->len - base);
+        bin_put32(b, hdr + 12, root);
+        return 0;
+
+err:
+        b->len = base;
+        return -1;
+}
+
+/**
+ * json_bin_init - Start reading an encoding from json_bin_encode()
+ * @bin: Reader to initialize
+ * @p: The encoding, which must stay valid while @bin is in use
+ * @n: Length of @p, which may be more than the encoding's
+ *
+ * Only the header is checked, so this takes the same time however big
+ * the encoding is.
+ *
+ * Return: 0 on success, or -1 if @p doesn't start with an encoding.
+ */
+int
+json_bin_init(struct json_bin_t *bin, const void *p, size_t n)
+{
+        const unsigned char *hdr = p;
+        uint32_t size;
+
+        memset(bin, 0, sizeof(*bin));
+        if (n < JSON_BIN_HDR || bin_get32(hdr) != JSON_BIN_MAGIC
+            || bin_get32(hdr + 4) != JSON_BIN_VERSION) {
+                return -1;
+        }
+        size = bin_get32(hdr + 8);
+        if (size < JSON_BIN_HDR || size > n)
+                return -1;
+        bin->p = hdr;
+        bin->size = size;
+        if (json_bin_type(bin, json_bin_root(bin)) == 0) {
+                bin->p = NULL;
+                bin->size = 0;
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * json_bin_open - Map a file written from json_bin_encode()
+ * @bin: Reader to initialize
+ * @path: File to map
+ *
+ * Release it with json_bin_close().
+ *
+ * Return: 0 on success, or -1 with errno set.  errno is EINVAL if the
+ *      file is not an encoding.
+ */
+int
+json_bin_open(struct json_bin_t *bin, const char *path)
+{
+        struct stat st;
+        void *map;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        if (fstat(fd, &st) < 0) {
+                close(fd);
+                return -1;
+        }
+        if (st.st_size < JSON_BIN_HDR) {
+                close(fd);
+                errno = EINVAL;
+                return -1;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return -1;
+        if (json_bin_init(bin, map, st.st_size) < 0) {
+                munmap(map, st.st_size);
+                errno = EINVAL;
+                return -1;
+        }
+        bin->map = map;
+        bin->mapsize = st.st_size;
+        return 0;
+}
+
+/**
+ * json_bin_close - Unmap what json_bin_open() mapped
+ *
+ * Does nothing for readers from json_bin_init(), whose memory belongs
+ * to the caller.
+ */
+void
+json_bin_close(struct json_bin_t *bin)
+{
+        if (bin->map)
+                munmap(bin->map, bin->mapsize);
+        memset(bin, 0, sizeof(*bin));
+}
+
+/* Pointer to @n bytes at offset @v, or NULL if they're out of bounds */
+static const unsigned char *
+bin_ptr(const struct json_bin_t *bin, uint32_t v, size_t n)
+{
+        if (v < JSON_BIN_HDR || n > bin->size || v > bin->size - n)
+                return NULL;
+        return bin->p + v;
+}
+
+/*
+ * Number of members of container @v with tables in bounds, or -1 if
+ * @v isn't a container
+ */
+static long
+bin_count(const struct json_bin_t *bin, uint32_t v)
+{
+        const unsigned char *p = bin_ptr(bin, v, 8);
+        uint32_t n;
+
+        if (!p || (p[0] != '[' && p[0] != '{'))
+                return -1;
+        n = bin_get32(p + 4);
+        if (!bin_ptr(bin, v, 8 + (size_t)n * (p[0] == '{' ? 12 : 4)))
+                return -1;
+        return n;
+}
+
+/* Offset of the @nth u32 in @v's tables, if it comes after @v */
+static uint32_t
+bin_slot(const struct json_bin_t *bin, uint32_t v, size_t n)
+{
+        uint32_t off = bin_get32(bin->p + v + 8 + n * 4);
+        return off > v ? off : 0;
+}
+
+/**
+ * json_bin_root - Get the top value of an encoding
+ *
+ * Return: Offset of the value, for the other json_bin_*() functions.
+ */
+uint32_t
+json_bin_root(const struct json_bin_t *bin)
+{
+        return bin->p ? bin_get32(bin->p + 12) : 0;
+}
+
+/**
+ * json_bin_type - Get the type of an encoded value
+ * @bin: The encoding
+ * @v: Offset of the value
+ *
+ * Return: One of `qbfin[{', as in struct json_t.type, or zero if @v
+ *      isn't a valid value.
+ */
+int
+json_bin_type(const struct json_bin_t *bin, uint32_t v)
+{
+        const unsigned char *p = bin_ptr(bin, v, 4);
+
+        if (!p)
+                return 0;
+        switch (p[0]) {
+        case 'n':
+        case 'b':
+                return p[0];
+        case 'i':
+        case 'f':
+                return bin_ptr(bin, v, 12) ? p[0] : 0;
+        case 'q':
+                return json_bin_str(bin, v, NULL) ? 'q' : 0;
+        case '[':
+        case '{':
+                return bin_count(bin, v) >= 0 ? p[0] : 0;
+        default:
+                return 0;
+        }
+}
+
+/**
+ * json_bin_size - Get the number of members of an encoded container
+ *
+ * Return: The number of members, or -1 if @v isn't an array or dict.
+ */
+long
+json_bin_size(const struct json_bin_t *bin, uint32_t v)
+{
+        return bin_count(bin, v);
+}
+
+/**
+ * json_bin_at - Get a member of an encoded container by position
+ * @bin: The encoding
+ * @v: Array or dict
+ * @n: Position of the member, from zero
+ *
+ * Return: Offset of the member, or zero if there's no such member.
+ */
+uint32_t
+json_bin_at(const struct json_bin_t *bin, uint32_t v, long n)
+{
+        long count = bin_count(bin, v);
+
+        if (n < 0 || n >= count)
+                return 0;
+        return bin_slot(bin, v, n);
+}
+
+/**
+ * json_bin_key_at - Get the name of a member of an encoded dict
+ *
+ * Return: The name, nulchar-terminated, or NULL if @v isn't a dict
+ *      or has no such member.
+ */
+const char *
+json_bin_key_at(const struct json_bin_t *bin, uint32_t v, long n)
+{
+        long count = bin_count(bin, v);
+
+        if (n < 0 || n >= count || bin->p[v] != '{')
+                return NULL;
+        return json_bin_str(bin, bin_slot(bin, v, count + n), NULL);
+}
+
+/**
+ * json_bin_find - Look up a member of an encoded dict by name
+ * @bin: The encoding
+ * @v: Dict to look in
+ * @name: Name of the member, case-sensitive
+ *
+ * This is a binary search, so it's O(log n) in the size of @v.  As
+ * with json_find_child(), the first of any duplicates is found.
+ *
+ * Return: Offset of the member, or zero if there is none.
+ */
+uint32_t
+json_bin_find(const struct json_bin_t *bin, uint32_t v, const char *name)
+{
+        long count = bin_count(bin, v);
+        long lo = 0, hi = count, mid;
+        const char *key;
+        uint32_t idx;
+
+        if (count <= 0 || bin->p[v] != '{')
+                return 0;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                idx = bin_get32(bin->p + v + 8 + (2 * count + mid) * 4);
+                if (idx >= count
+                    || (key = json_bin_key_at(bin, v, idx)) == NULL) {
+                        return 0;
+                }
+                if (strcmp(key, name) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (lo == count)
+                return 0;
+        idx = bin_get32(bin->p + v + 8 + (2 * count + lo) * 4);
+        if (idx >= count || (key = json_bin_key_at(bin, v, idx)) == NULL
+            || strcmp(key, name) != 0) {
+                return 0;
+        }
+        return bin_slot(bin, v, idx);
+}
+
+/**
+ * json_bin_str - Get an encoded string
+ * @bin: The encoding
+ * @v: The string
+ * @len: If not NULL, where to store the string's length
+ *
+ * Return: The string, nulchar-terminated, or NULL if @v isn't one.
+ */
+const char *
+json_bin_str(const struct json_bin_t *bin, uint32_t v, size_t *len)
+{
+        const unsigned char *p = bin_ptr(bin, v, 8);
+        uint32_t n;
+
+        if (!p || p[0] != 'q')
+                return NULL;
+        n = bin_get32(p + 4);
+        if (!bin_ptr(bin, v, 8 + (size_t)n + 1) || p[8 + n] != '\0')
+                return NULL;
+        if (len)
+                *len = n;
+        return (const char *)p + 8;
+}
+
+/**
+ * json_bin_int - Get an encoded integer
+ *
+ * Return: The value, or zero if @v isn't an integer.
+ */
+long long
+json_bin_int(const struct json_bin_t *bin, uint32_t v)
+{
+        const unsigned char *p = bin_ptr(bin, v, 12);
+        long long i = 0;
+
+        if (p && p[0] == 'i')
+                memcpy(&i, p + 4, sizeof(i));
+        return i;
+}
+
+/**
+ * json_bin_float - Get an encoded float
+ *
+ * Return: The value, or zero if @v isn't a float.
+ */
+double
+json_bin_float(const struct json_bin_t *bin, uint32_t v)
+{
+        const unsigned char *p = bin_ptr(bin, v, 12);
+        double f = 0.0;
+
+        if (p && p[0] == 'f')
+                memcpy(&f, p + 4, sizeof(f));
+        return f;
+}
+
+/**
+ * json_bin_bool - Get an encoded bool
+ *
+ * Return: The value, or false if @v isn't a bool.
+ */
+bool
+json_bin_bool(const struct json_bin_t *bin, uint32_t v)
+{
+        const unsigned char *p = bin_ptr(bin, v, 4);
+        return p && p[0] == 'b' && p[1] != 0;
+}
+
+/*
+ * Decode @v into the (already linked) node @j, @depth containers
+ * down.  Nesting is capped like json_read()'s, so a hostile encoding
+ * can't run us out of stack.
+ */
+static void
+bin_decode_r(struct jstate_t *state, const struct json_bin_t *bin,
+             uint32_t v, struct json_t *j, int depth)
+{
+        struct json_t *child = NULL;
+        const char *s;
+        char namebuf[32];
+        size_t len;
+        long i, n;
+
+        j->type = json_bin_type(bin, v);
+        switch (j->type) {
+        case 'n':
+                return;
+        case 'b':
+                j->value.b = json_bin_bool(bin, v);
+                return;
+        case 'i':
+                j->value.i = json_bin_int(bin, v);
+                return;
+        case 'f':
+                j->value.f = json_bin_float(bin, v);
+                return;
+        case 'q':
+                s = json_bin_str(bin, v, &len);
+                j->value.s = jstrndup(state, s, len);
+                return;
+        case '[':
+        case '{':
+                if (depth >= JSON_READER_MAX_DEPTH)
+                        longjmp(state->env, 1);
+                break;
+        default:
+                longjmp(state->env, 1);
+        }
+
+        n = bin_count(bin, v);
+        for (i = 0; i < n; i++) {
+                child = jnew_json(state, j, child);
+                if (j->type == '{') {
+                        s = json_bin_key_at(bin, v, i);
+                        if (!s)
+                                longjmp(state->env, 1);
+                        child->name = jstrndup(state, s, strlen(s));
+                } else {
+                        len = sprintf(namebuf, "(%ld)", i);
+                        child->name = jstrndup(state, namebuf, len);
+                }
+                bin_decode_r(state, bin, bin_slot(bin, v, i), child,
+                             depth + 1);
+                j->array_size++;
+        }
+        index_placeholder(state, j);
+}
+
+/**
+ * json_bin_decode - Turn an encoded value back into a tree
+ * @bin: The encoding
+ * @v: Value to decode, e.g. json_bin_root(@bin)
+ * @arena: Arena to allocate the tree from, or NULL to use malloc()
+ *
+ * Return: The tree, or NULL if out of memory, the encoding is bad, or
+ *      it nests more than JSON_READER_MAX_DEPTH containers deep.
+ *      As with json_parse_arena(), a tree from an arena is freed with
+ *      the arena, not json_free().
+ */
 struct json_t *
-json_find_descendant(struct json_t *parent, const char *name,
-                     bool case_sensitive, int delim)
+json_bin_decode(const struct json_bin_t *bin, uint32_t v,
+                struct json_arena_t *arena)
+{
+        struct json_t *volatile top = NULL;
+        struct jstate_t state;
+
+        memset(&state, 0, sizeof(state));
+        state.arena = arena;
+        if (setjmp(state.env) != 0) {
+                if (top != NULL && !arena)
+                        json_free(top);
+                return NULL;
+        }
+        top = jnew_json(&state, NULL, NULL);
+        bin_decode_r(&state, bin, v, top, 0);
+        return top;
+}
+
+/*
+ * Pull parser
+ *
+ * json_read() returns one event per call, using the same scanners as
+ * json_parse_buf(), but it builds no tree and allocates nothing.  The
+ * only state is struct json_reader_t itself, so a huge input can be
+ * filtered in constant memory, e.g. by mmap()ing it.
+ */
+enum {
+        RD_TOP,         /* Between top-level values */
+        RD_VALUE,       /* After ':', or ',' in an array */
+        RD_FIRST_VALUE, /* After '[': value or ']' */
+        RD_FIRST_KEY,   /* After '{': key or '}' */
+        RD_KEY,         /* After ',' in an object */
+        RD_NEXT,        /* After a value in a container: ',' or close */
+        RD_ERROR,
+};
+
+/**
+ * json_reader_init - Start reading a buffer with json_read()
+ * @r: Reader to initialize
+ * @p: Buffer of JSON text.  This must stay valid and unchanged while
+ *      @r is in use, since the strings json_read() returns point into
+ *      it.  It need not be nulchar-terminated.
+ * @n: Length of @p
+ *
+ * The buffer may contain any number of top-level values, one after
+ * another, as in newline-delimited JSON.
+ */
+void
+json_reader_init(struct json_reader_t *r, const char *p, size_t n)
+{
+        memset(r, 0, sizeof(*r));
+        r->start = r->p = p;
+        r->end = p + n;
+        r->state = RD_TOP;
+}
+
+/**
+ * json_reader_lineno - Get the line number json_read() has reached
+ *
+ * For error messages.  It's calculated on each call, so don't call it
+ * for every token.
+ */
+int
+json_reader_lineno(struct json_reader_t *r)
+{
+        const char *s = r->start;
+        int lineno = 1;
+
+        while ((s = memchr(s, '\n', r->p - s)) != NULL) {
+                ++lineno;
+                ++s;
+        }
+        return lineno;
+}
+
+static enum json_event_t
+reader_error(struct json_reader_t *r, const char *msg)
+{
+        r->state = RD_ERROR;
+        r->error = msg;
+        r->last = JSON_EV_ERROR;
+        return JSON_EV_ERROR;
+}
+
+/* After a scalar or a closing bracket */
+static enum json_event_t
+reader_done(struct json_reader_t *r, const char *start,
+            const char *p, enum json_event_t ev)
 {
-        const char *end;
-        size_t len;
-        struct json_t *child;
+        r->text.p = start;
+        r->text.len = p - start;
+        r->p = p;
+        r->state = r->depth ? RD_NEXT : RD_TOP;
+        return ev;
+}
 
-        /*
-         * Square brackets in ``name" are reserved for numerical arrays.
-         *
-         * In a perfect world, delim is a period `.',
-         * allowing ``name" to be something that looks like javascript.
-         * In our world, delim is probably a hyphen `-'.
-         */
-        if (delim == '[')
-                return NULL;
+static enum json_event_t
+reader_close(struct json_reader_t *r, const char *p)
+{
+        int open = *p == '}' ? '{' : '[';
 
-        for (end = name; *end != '\0'; end++) {
-                if (*end == delim
-                    || (end != name && *end == '[')) {
-                        break;
-                }
+        if ((*p != '}' && *p != ']')
+            || r->depth == 0 || r->stack[r->depth - 1] != open) {
+                r->p = p;
+                return reader_error(r, "Expected: ',' or closing bracket");
         }
+        r->depth--;
+        return reader_done(r, p, p + 1,
+                           open == '{' ? JSON_EV_END_OBJECT
+                                       : JSON_EV_END_ARRAY);
+}
 
-        /* We have reached the end of our recursion */
-        if (*end == '\0')
-                return json_find_child(parent, name, case_sensitive);
-        len = end - name;
+/*
+ * Set @r->text to the string whose opening quote is at @p, and check
+ * it.  Return the closing quote, or NULL if there's an error.
+ */
+static const char *
+reader_string(struct json_reader_t *r, const char *p)
+{
+        const char *q, *s = p + 1;
+        ssize_t len;
 
-        /* Move past delimiter, if not [#] */
-        if (*end == delim)
-                ++end;
+        /* Usually the closing quote comes before anything to check */
+        q = s + plain_run(s, r->end - s);
+        if (q < r->end && *q == '"') {
+                r->text.p = s;
+                r->text.len = q - s;
+                r->escaped = false;
+                return q;
+        }
 
-        child = json_find_child_nonul(parent, name, case_sensitive, len);
-        if (!child)
+        q = buf_endquote(q, r->end);
+        if (!q) {
+                reader_error(r, "Expected: closing delimiter");
                 return NULL;
-
-        return json_find_descendant(child, end, case_sensitive, delim);
+        }
+        r->text.p = s;
+        r->text.len = q - s;
+        len = json_unescape(r->text.p, r->text.len, NULL);
+        if (len < 0) {
+                r->p = p;
+                reader_error(r, "Bad character or escape in string");
+                return NULL;
+        }
+        /* Every escape decodes to fewer bytes than it takes */
+        r->escaped = (size_t)len != r->text.len;
+        return q;
 }
 
-int
-json_count_children(struct json_t *memb)
+static enum json_event_t
+reader_key(struct json_reader_t *r, const char *p)
 {
-        int count = 0;
-        struct json_t *child;
+        const char *end = r->end;
+        const char *q;
 
-        /*
-         * XXX: If we don't skipp '//' entries,
-         * then this could be reduced to just
-         *
-         *      return memb->array_size;
-         */
+        if (*p != '"')
+                return reader_error(r, "Expected: key");
+        q = reader_string(r, p);
+        if (!q)
+                return JSON_EV_ERROR;
 
-        JSON_FOR_EACH_CHILD(memb, child)
-                ++count;
-        return count;
+        p = buf_slide(q + 1, end);
+        if (p >= end || *p != ':') {
+                r->p = p;
+                return reader_error(r, "Expected: ':'");
+        }
+        r->p = p + 1;
+        r->state = RD_VALUE;
+        return JSON_EV_KEY;
 }
 
-static void
-prnlsp(FILE *fp, int depth, bool eol)
+static enum json_event_t
+reader_value(struct json_reader_t *r, const char *p)
 {
-        if (!eol)
-                return;
+        const char *q, *start = p, *end = r->end;
+        int tok;
 
-        putc('\n', fp);
-        while (depth-- > 0) {
-                putc(' ', fp);
-                putc(' ', fp);
+        switch (*p) {
+        case '{':
+        case '[':
+                if (r->depth == JSON_READER_MAX_DEPTH)
+                        return reader_error(r, "Nested too deeply");
+                r->stack[r->depth++] = *p;
+                r->text.p = p;
+                r->text.len = 1;
+                r->p = p + 1;
+                if (*p == '{') {
+                        r->state = RD_FIRST_KEY;
+                        return JSON_EV_START_OBJECT;
+                }
+                r->state = RD_FIRST_VALUE;
+                return JSON_EV_START_ARRAY;
+        case '"':
+                q = reader_string(r, p);
+                if (!q)
+                        return JSON_EV_ERROR;
+                r->p = q + 1;
+                r->state = r->depth ? RD_NEXT : RD_TOP;
+                return JSON_EV_STRING;
+        case 't':
+        case 'T':
+                ++p;
+                if (buf_literal(&p, end, "rue") < 0)
+                        break;
+                r->value.b = true;
+                return reader_done(r, start, p, JSON_EV_BOOL);
+        case 'f':
+        case 'F':
+                ++p;
+                if (buf_literal(&p, end, "alse") < 0)
+                        break;
+                r->value.b = false;
+                return reader_done(r, start, p, JSON_EV_BOOL);
+        case 'n':
+        case 'N':
+                ++p;
+                if (buf_literal(&p, end, "ull") < 0)
+                        break;
+                return reader_done(r, start, p, JSON_EV_NULL);
+        default:
+                tok = buf_number(&p, end, &r->value);
+                if (tok < 0)
+                        break;
+                return reader_done(r, start, p,
+                                   tok == 'f' ? JSON_EV_FLOAT
+                                              : JSON_EV_INT);
         }
+        r->p = start;
+        return reader_error(r, "Unknown token type");
 }
 
-static void
-json_print_r(FILE *fp, struct json_t *j, int depth, bool eol)
+/**
+ * json_read - Get the next event from a JSON buffer
+ * @r: Reader set up with json_reader_init()
+ *
+ * Return: The event.  Once the end of the buffer is reached,
+ *      JSON_EV_EOF is returned; if it's reached in the middle of a
+ *      value, or there is a syntax error, JSON_EV_ERROR is returned
+ *      instead.  Either one is returned again by every later call.
+ *
+ * Keys and strings are returned as slices of the buffer in r->text,
+ * with no copying and no nulchar.  Numbers and bools are returned in
+ * r->value, and r->text also has their raw text.  Colons and commas
+ * are checked but not returned.
+ */
+enum json_event_t
+json_read(struct json_reader_t *r)
 {
-        prnlsp(fp, depth, eol);
-
-        /* If we're not an array member, print name */
-        if (j->parent != NULL && j->parent->type != '[')
-                fprintf(fp, "\"%s\": ", j->name);
+        const char *p, *end = r->end;
+        enum json_event_t ev;
 
-        if (j->type == '[' || j->type == '{') {
-                struct json_t *child;
-                int nchild;
+        if (r->state == RD_ERROR)
+                return JSON_EV_ERROR;
 
-                putc(j->type, fp);
+again:
+        p = buf_slide(r->p, end);
+        r->p = p;
+        if (p >= end) {
+                if (r->state != RD_TOP)
+                        return reader_error(r, "Unexpected end of input");
+                ev = JSON_EV_EOF;
+                goto out;
+        }
 
-                nchild = 0;
-                JSON_FOR_EACH_CHILD_STRICT(j, child) {
-                        if (nchild > 0)
-                                putc(',', fp);
-                        json_print_r(fp, child, depth + 1, eol);
-                        ++nchild;
+        switch (r->state) {
+        case RD_NEXT:
+                if (*p == ',') {
+                        r->p = p + 1;
+                        r->state = r->stack[r->depth - 1] == '{'
+                                   ? RD_KEY : RD_VALUE;
+                        goto again;
+                }
+                ev = reader_close(r, p);
+                break;
+        case RD_FIRST_KEY:
+                if (*p == '}') {
+                        ev = reader_close(r, p);
+                        break;
+                }
+                /* fall through */
+        case RD_KEY:
+                ev = reader_key(r, p);
+                break;
+        case RD_FIRST_VALUE:
+                if (*p == ']') {
+                        ev = reader_close(r, p);
+                        break;
                 }
+                /* fall through */
+        default:
+                ev = reader_value(r, p);
+                break;
+        }
+out:
+        r->last = ev;
+        return ev;
+}
 
-                prnlsp(fp, depth, eol);
-                putc(j->type + 2, fp);
-        } else {
-                switch (j->type) {
-                case 'q':
-                        fprintf(fp, "\"%s\"", j->value.s);
+/* Find the next quote, bracket or '#' at or after @p, or return @end */
+static const char *
+skip_scan(const char *p, const char *end)
+{
+#ifdef JVEC_SIZE
+        const jvec_t quote = jvec_set1('"');
+        const jvec_t hash = jvec_set1('#');
+        const jvec_t lbrace = jvec_set1('{');
+        const jvec_t rbrace = jvec_set1('}');
+        const jvec_t bit5 = jvec_set1(0x20);
+
+        for (; end - p >= JVEC_SIZE; p += JVEC_SIZE) {
+                jvec_t v = jvec_load(p);
+                /* '[' and ']' are '{' and '}' with bit 5 clear */
+                jvec_t v5 = jvec_or(v, bit5);
+                uint32_t m = jvec_mask(jvec_or(jvec_or(jvec_eq(v, quote),
+                                                       jvec_eq(v, hash)),
+                                               jvec_or(jvec_eq(v5, lbrace),
+                                                       jvec_eq(v5, rbrace))));
+                if (m)
+                        return p + __builtin_ctz(m);
+        }
+#endif
+        for (; p < end; p++) {
+                int c = *p | 0x20;
+                if (*p == '"' || *p == '#' || c == '{' || c == '}')
                         break;
+        }
+        return p;
+}
+
+/* Skip the scalar at @p, after a key, without converting it */
+static enum json_event_t
+skip_scalar(struct json_reader_t *r, const char *p)
+{
+        const char *q, *end = r->end;
+        enum json_event_t ev;
+
+        if (*p == '"') {
+                q = buf_endquote(p + 1, end);
+                if (!q) {
+                        r->p = p;
+                        return reader_error(r, "Expected: closing delimiter");
+                }
+                r->text.p = p + 1;
+                r->text.len = q - p - 1;
+                r->escaped = memchr(r->text.p, '\\', r->text.len) != NULL;
+                r->p = q + 1;
+                ev = JSON_EV_STRING;
+        } else {
+                for (q = p; q < end && !buf_isdelim(*q); q++)
+                        ;
+                if (q == p) {
+                        r->p = p;
+                        return reader_error(r, "Expected: value");
+                }
+                switch (*p | 0x20) {
+                case 't':
                 case 'f':
-                        fprintf(fp, "%.15e", j->value.f);
+                        ev = JSON_EV_BOOL;
                         break;
-                case 'i':
-                        fprintf(fp, "%lld", j->value.i);
+                case 'n':
+                        ev = JSON_EV_NULL;
                         break;
-                case 'b':
-                        fprintf(fp, "%s", j->value.b ? "true" : "false");
+                default:
+                        ev = memchr(p, '.', q - p) || memchr(p, 'e', q - p)
+                             || memchr(p, 'E', q - p)
+                             ? JSON_EV_FLOAT : JSON_EV_INT;
+                        break;
+                }
+                r->text.p = p;
+                r->text.len = q - p;
+                r->p = q;
+        }
+        r->state = RD_NEXT;
+        r->last = ev;
+        return ev;
+}
+
+/**
+ * json_skip - Skip the value json_read() just started
+ * @r: Reader whose last event was JSON_EV_KEY, JSON_EV_START_OBJECT or
+ *      JSON_EV_START_ARRAY
+ *
+ * After a key, skip its value; after the start of an object or array,
+ * skip to its end.  This is for ignoring the parts of a document that
+ * are not wanted.  It still scans them, but nothing is converted: a
+ * skipped scalar's text is in @r->text, but @r->value isn't set.
+ *
+ * Return: The last event skipped, or the same as the last event if
+ *      there was nothing to skip.  This is JSON_EV_ERROR or
+ *      JSON_EV_EOF if the input ran out or was bad.
+ */
+enum json_event_t
+json_skip(struct json_reader_t *r)
+{
+        const char *p, *q, *end = r->end;
+        enum json_event_t ev = r->last;
+        int depth;
+
+        if (ev == JSON_EV_KEY) {
+                p = buf_slide(r->p, end);
+                if (p < end && *p != '{' && *p != '[')
+                        return skip_scalar(r, p);
+                ev = json_read(r);
+                if (ev != JSON_EV_START_OBJECT && ev != JSON_EV_START_ARRAY)
+                        return ev;
+        } else if (ev != JSON_EV_START_OBJECT && ev != JSON_EV_START_ARRAY) {
+                return ev;
+        }
+
+        /*
+         * Only brackets and strings matter here.  The syntax inside
+         * isn't checked, but the brackets still have to match.
+         */
+        depth = r->depth;
+        for (p = skip_scan(r->p, end); p < end; p = skip_scan(p + 1, end)) {
+                switch (*p) {
+                case '"':
+                        q = buf_endquote(p + 1, end);
+                        if (!q)
+                                goto eof;
+                        p = q;
+                        break;
+                case '#':
+                        q = memchr(p, '\n', end - p);
+                        if (!q)
+                                goto eof;
+                        p = q;
+                        break;
+                case '{':
+                case '[':
+                        if (r->depth == JSON_READER_MAX_DEPTH) {
+                                r->p = p;
+                                return reader_error(r, "Nested too deeply");
+                        }
+                        r->stack[r->depth++] = *p;
+                        break;
+                case '}':
+                case ']':
+                        ev = reader_close(r, p);
+                        if (ev == JSON_EV_ERROR)
+                                return ev;
+                        if (r->depth < depth) {
+                                r->last = ev;
+                                return ev;
+                        }
                         break;
                 default:
-                        /* TODO: BUG */
                         break;
                 }
         }
+eof:
+        r->p = end;
+        return reader_error(r, "Unexpected end of input");
+}
+
+/*
+ * Path queries
+ *
+ * json_query_compile() splits a path into steps once, so that running
+ * it against many documents doesn't split it again each time, the
+ * way json_find_descendant() does.  The steps can be run against a
+ * tree with json_query_each(), or against json_read()'s events with
+ * json_query_read(), which skips the parts of the input that can't
+ * match without converting anything in them.
+ */
+enum {
+        QS_NAME,        /* Member of a dict, by name */
+        QS_INDEX,       /* Member of an array, by position */
+        QS_ANY,         /* Every member of a dict or array */
+};
+
+/**
+ * struct json_query_step_t - One step of a compiled path
+ * @kind:       One of QS_*
+ * @index:      For QS_INDEX, the position
+ * @name:       For QS_NAME, the name, nulchar-terminated
+ * @len:        For QS_NAME, length of @name
+ */
+struct json_query_step_t {
+        int kind;
+        long index;
+        const char *name;
+        size_t len;
+};
+
+/**
+ * struct json_query_t - Compiled path, from json_query_compile()
+ * @flags:      Flags passed to json_query_compile()
+ * @nstep:      Number of steps
+ * @step:       The steps.  The names follow them in the same block.
+ */
+struct json_query_t {
+        int flags;
+        int nstep;
+        struct json_query_step_t step[];
+};
+
+/*
+ * Split @path into steps, and return how many.  If @q is not NULL,
+ * fill in its steps too, copying the names to @names.  Return -1 if
+ * there's a syntax error.
+ */
+static int
+query_parse(const char *path, int delim, struct json_query_t *q,
+            char *names)
+{
+        const char *p = path, *s;
+        char *endp;
+        int n = 0;
+        struct json_query_step_t st;
+
+        while (*p != '\0') {
+                memset(&st, 0, sizeof(st));
+                if (*p == '[') {
+                        if (p[1] == '*' && p[2] == ']') {
+                                st.kind = QS_ANY;
+                                p += 3;
+                        } else {
+                                if (p[1] < '0' || p[1] > '9')
+                                        return -1;
+                                st.kind = QS_INDEX;
+                                st.index = strtol(p + 1, &endp, 10);
+                                if (*endp != ']' || st.index < 0)
+                                        return -1;
+                                p = endp + 1;
+                        }
+                } else {
+                        for (s = p; *s != '\0' && *s != delim && *s != '['; s++)
+                                ;
+                        if (s == p)
+                                return -1;
+                        if (s - p == 1 && *p == '*') {
+                                st.kind = QS_ANY;
+                        } else {
+                                st.kind = QS_NAME;
+                                st.len = s - p;
+                                if (names) {
+                                        memcpy(names, p, st.len);
+                                        names[st.len] = '\0';
+                                        st.name = names;
+                                        names += st.len + 1;
+                                }
+                        }
+                        p = s;
+                }
+                if (q)
+                        q->step[n] = st;
+                ++n;
+
+                if (*p == delim) {
+                        /* A delimiter must have a step after it */
+                        if (*++p == '\0')
+                                return -1;
+                } else if (*p != '\0' && *p != '[') {
+                        return -1;
+                }
+        }
+        return n;
+}
+
+/**
+ * json_query_compile - Compile a path for json_query_each() and
+ *                      json_query_read()
+ * @path: Path to compile, e.g. "users[*].name" with a @delim of '.'.
+ *      Each step is a member name, "*" for every member of a dict or
+ *      array, "[N]" for member N of an array, counting from zero, or
+ *      "[*]", the same as "*".  Names can't contain @delim or '['.
+ *      An empty path matches the whole document.
+ * @delim: Character that separates names, usually '.'
+ * @flags: JSON_QUERY_NOCASE to match names case-insensitively
+ *
+ * Return: The query, to free with json_query_free(), or NULL with
+ *      errno set to EINVAL if @path is bad, or ENOMEM.
+ */
+struct json_query_t *
+json_query_compile(const char *path, int delim, int flags)
+{
+        struct json_query_t *q;
+        int n;
+
+        if (delim == '[' || delim == '\0'
+            || (n = query_parse(path, delim, NULL, NULL)) < 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+        /* The names fit in the length of @path */
+        q = malloc(sizeof(*q) + n * sizeof(q->step[0]) + strlen(path) + 1);
+        if (!q)
+                return NULL;
+        q->flags = flags;
+        q->nstep = n;
+        query_parse(path, delim, q, (char *)&q->step[n]);
+        return q;
 }
 
+/* Free a query from json_query_compile() */
 void
-json_print(FILE *fp, struct json_t *tbl, bool eol)
+json_query_free(struct json_query_t *q)
 {
-        json_print_r(fp, tbl, 0, eol);
-        if (eol)
-                putc('\n', fp);
+        free(q);
 }
 
+static int
+query_each_r(const struct json_query_t *q, int level, struct json_t *j,
+             int (*cb)(struct json_t *, void *), void *arg)
+{
+        const struct json_query_step_t *st = &q->step[level];
+        struct json_t *child;
+        int res;
+
+        if (level == q->nstep)
+                return cb(j, arg);
+        if (!is_container(j))
+                return 0;
+
+        switch (st->kind) {
+        case QS_NAME:
+                if (j->type != '{')
+                        return 0;
+                child = json_find_child(j, st->name,
+                                        !(q->flags & JSON_QUERY_NOCASE));
+                break;
+        case QS_INDEX:
+                if (j->type != '[' || st->index > INT_MAX)
+                        return 0;
+                child = json_child_at(j, st->index);
+                break;
+        default:
+                JSON_FOR_EACH_CHILD(j, child) {
+                        res = query_each_r(q, level + 1, child, cb, arg);
+                        if (res)
+                                return res;
+                }
+                return 0;
+        }
+        return child ? query_each_r(q, level + 1, child, cb, arg) : 0;
+}
+
+/**
+ * json_query_each - Find the values in a tree that a query matches
+ * @q: Query from json_query_compile()
+ * @j: Tree to search
+ * @cb: Function to call for each match, in document order.  Return
+ *      nonzero to stop.
+ * @arg: Argument to pass to @cb
+ *
+ * Names are looked up with json_find_child(), so if a dict has
+ * duplicate names, only the first of them matches.
+ *
+ * Return: Zero, or what @cb returned to stop.
+ */
+int
+json_query_each(const struct json_query_t *q, struct json_t *j,
+                int (*cb)(struct json_t *, void *), void *arg)
+{
+        return query_each_r(q, 0, j, cb, arg);
+}
+
+static int
+query_first_cb(struct json_t *j, void *arg)
+{
+        *(struct json_t **)arg = j;
+        return 1;
+}
+
+/**
+ * json_query_first - Find the first value in a tree that a query matches
+ *
+ * Return: The value, or NULL if nothing matches.
+ */
+struct json_t *
+json_query_first(const struct json_query_t *q, struct json_t *j)
+{
+        struct json_t *found = NULL;
+
+        json_query_each(q, j, query_first_cb, &found);
+        return found;
+}
+
+/* True if the key json_read() just returned matches @st's name */
+static bool
+query_key_match(const struct json_query_t *q,
+                const struct json_query_step_t *st,
+                struct json_reader_t *r)
+{
+        char buf[256], *key = (char *)r->text.p;
+        ssize_t len = r->text.len;
+        bool match;
+
+        /* Escapes never make a key longer */
+        if ((size_t)len < st->len)
+                return false;
+        if (r->escaped) {
+                key = len <= (ssize_t)sizeof(buf) ? buf : malloc(len);
+                if (!key)
+                        return false;
+                len = json_unescape(r->text.p, r->text.len, key);
+        }
+        if ((size_t)len != st->len)
+                match = false;
+        else if (q->flags & JSON_QUERY_NOCASE)
+                match = strncasecmp(key, st->name, len) == 0;
+        else
+                match = memcmp(key, st->name, len) == 0;
+        if (key != buf && key != r->text.p)
+                free(key);
+        return match;
+}
+
+/*
+ * Match the rest of @q against the value whose first event, @ev,
+ * json_read() just returned.  The value is read or skipped to its end.
+ */
+static int
+query_read_r(const struct json_query_t *q, int level,
+             struct json_reader_t *r, enum json_event_t ev,
+             int (*cb)(struct json_reader_t *, enum json_event_t, void *),
+             void *arg)
+{
+        const struct json_query_step_t *st = &q->step[level];
+        bool container = ev == JSON_EV_START_OBJECT
+                         || ev == JSON_EV_START_ARRAY;
+        int depth = r->depth;
+        long idx = 0;
+        int res;
+
+        if (level == q->nstep) {
+                res = cb(r, ev, arg);
+                if (res)
+                        return res;
+                /* If @cb didn't read the value, skip it */
+                if (container && r->depth == depth
+                    && json_skip(r) == JSON_EV_ERROR) {
+                        return -1;
+                }
+                return 0;
+        }
+        if (!container)
+                return 0;
+
+        for (;;) {
+                bool match;
+
+                ev = json_read(r);
+                if (ev == JSON_EV_END_OBJECT || ev == JSON_EV_END_ARRAY)
+                        return 0;
+                if (ev <= JSON_EV_EOF)
+                        return -1;
+                if (ev == JSON_EV_KEY) {
+                        match = st->kind == QS_ANY
+                                || (st->kind == QS_NAME
+                                    && query_key_match(q, st, r));
+                        if (!match) {
+                                if (json_skip(r) <= JSON_EV_EOF)
+                                        return -1;
+                                continue;
+                        }
+                        ev = json_read(r);
+                        if (ev <= JSON_EV_EOF)
+                                return -1;
+                } else {
+                        match = st->kind == QS_ANY
+                                || (st->kind == QS_INDEX && st->index == idx);
+                        ++idx;
+                        if (!match) {
+                                if (json_skip(r) <= JSON_EV_EOF)
+                                        return -1;
+                                continue;
+                        }
+                }
+                res = query_read_r(q, level + 1, r, ev, cb, arg);
+                if (res)
+                        return res;
+        }
+}
+
+/**
+ * json_query_read - Find the values in json_read()'s input that a
+ *                   query matches
+ * @q: Query from json_query_compile()
+ * @r: Reader, which is read to the end of its input.  Each top-level
+ *      value is matched separately, as for newline-delimited JSON.
+ * @cb: Function to call for each match, with the match's first event,
+ *      which json_read() has just returned.  For a scalar, the value
+ *      is in @r as usual.  For an object or array, @cb may read it to
+ *      its end, e.g. with json_skip(), or leave it to be skipped, but
+ *      must not read just part of it.  Return a positive number to
+ *      stop.
+ * @arg: Argument to pass to @cb
+ *
+ * Only the parts of the input that can match are parsed; the rest is
+ * skipped with json_skip().  Unlike json_query_each(), every one of
+ * any duplicate names in a dict matches.
+ *
+ * Return: Zero at the end of the input, -1 if there's a syntax error
+ *      (see @r->error), or what @cb returned to stop.
+ */
+int
+json_query_read(const struct json_query_t *q, struct json_reader_t *r,
+                int (*cb)(struct json_reader_t *, enum json_event_t, void *),
+                void *arg)
+{
+        enum json_event_t ev;
+        int res;
 
+        while ((ev = json_read(r)) > JSON_EV_EOF) {
+                res = query_read_r(q, 0, r, ev, cb, arg);
+                if (res)
+                        return res;
+        }
+        return ev == JSON_EV_EOF ? 0 : -1;
+}
@@ -4,19 +4,30 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+
+struct json_index_t;
 
 union json_value_t {
         char *s;
         long long i;
         double f;
         bool b;
+        /* For '{' and '[' - private, see json_find_child() */
+        struct json_index_t *idx;
+};
+
+/* struct json_t.flags */
+enum {
+        JSON_ARENA = 0x0001, /* allocated from a struct json_arena_t */
 };
 
 struct json_t {
         char *name;
         union json_value_t value;
-        int type; /* one of `qbfi[{' */
+        int type; /* one of `qbfin[{' */
         int array_size;
+        int flags;
 
         /* Array indices */
         struct json_t *parent;
@@ -30,9 +41,154 @@ struct json_state_t {
         size_t alloc_size;
 };
 
+struct json_arena_t;
+
+/* Events returned by json_read() */
+enum json_event_t {
+        JSON_EV_ERROR = -1,
+        JSON_EV_EOF = 0,
+        JSON_EV_START_OBJECT,
+        JSON_EV_END_OBJECT,
+        JSON_EV_START_ARRAY,
+        JSON_EV_END_ARRAY,
+        JSON_EV_KEY,
+        JSON_EV_STRING,
+        JSON_EV_INT,
+        JSON_EV_FLOAT,
+        JSON_EV_BOOL,
+        JSON_EV_NULL,
+};
+
+/* Text in a json_read() input buffer, not nulchar-terminated */
+struct json_slice_t {
+        const char *p;
+        size_t len;
+};
+
+enum {
+        JSON_READER_MAX_DEPTH = 256,
+};
+
+/**
+ * struct json_reader_t - Pull parser state, see json_reader_init()
+ * @text:       Text of the last token.  For JSON_EV_KEY and
+ *              JSON_EV_STRING this is what's between the quotes,
+ *              which has been checked for valid escapes and UTF-8.
+ * @escaped:    For JSON_EV_KEY and JSON_EV_STRING, true if @text has
+ *              escapes, so it needs json_unescape() to get the string
+ * @value:      Value of the last JSON_EV_INT, JSON_EV_FLOAT or
+ *              JSON_EV_BOOL token (.s is not used)
+ * @depth:      Nesting level after the last event, zero at top level
+ * @error:      Description of the syntax error, if json_read()
+ *              returned JSON_EV_ERROR
+ *
+ * The rest is private.
+ */
+struct json_reader_t {
+        struct json_slice_t text;
+        bool escaped;
+        union json_value_t value;
+        int depth;
+        const char *error;
+
+        const char *start;
+        const char *p;
+        const char *end;
+        int state;
+        enum json_event_t last;
+        char stack[JSON_READER_MAX_DEPTH];
+};
+
+/**
+ * struct json_buf_t - Output buffer for json_write()
+ * @p:          The output, not nulchar-terminated
+ * @len:        Length of the output
+ * @size:       Allocated size of @p
+ */
+struct json_buf_t {
+        char *p;
+        size_t len;
+        size_t size;
+};
+
+/**
+ * struct json_bin_t - Reader for json_bin_encode()'s output
+ * @p:          The encoding
+ * @size:       Length of @p
+ *
+ * The rest is private.
+ */
+struct json_bin_t {
+        const unsigned char *p;
+        size_t size;
+
+        void *map;
+        size_t mapsize;
+};
+
+struct json_query_t;
+
+/* json_query_compile() flags */
+enum {
+        JSON_QUERY_NOCASE = 0x01,
+};
+
+/* json_write() flags */
+enum {
+        JSON_WRITE_PRETTY = 0x01,
+};
+
 extern void json_print(FILE *fp, struct json_t *j, bool eol);
+extern int json_write(struct json_buf_t *b, struct json_t *j, int flags);
+extern int json_fwrite(FILE *fp, struct json_t *j, int flags);
+extern void json_buf_free(struct json_buf_t *b);
+extern int json_bin_encode(struct json_buf_t *b, struct json_t *j);
+extern int json_bin_init(struct json_bin_t *bin, const void *p, size_t n);
+extern int json_bin_open(struct json_bin_t *bin, const char *path);
+extern void json_bin_close(struct json_bin_t *bin);
+extern uint32_t json_bin_root(const struct json_bin_t *bin);
+extern int json_bin_type(const struct json_bin_t *bin, uint32_t v);
+extern long json_bin_size(const struct json_bin_t *bin, uint32_t v);
+extern uint32_t json_bin_at(const struct json_bin_t *bin, uint32_t v, long n);
+extern const char *json_bin_key_at(const struct json_bin_t *bin,
+                                   uint32_t v, long n);
+extern uint32_t json_bin_find(const struct json_bin_t *bin, uint32_t v,
+                              const char *name);
+extern const char *json_bin_str(const struct json_bin_t *bin, uint32_t v,
+                                size_t *len);
+extern long long json_bin_int(const struct json_bin_t *bin, uint32_t v);
+extern double json_bin_float(const struct json_bin_t *bin, uint32_t v);
+extern bool json_bin_bool(const struct json_bin_t *bin, uint32_t v);
+extern struct json_t *json_bin_decode(const struct json_bin_t *bin,
+                                      uint32_t v,
+                                      struct json_arena_t *arena);
 extern void json_free(struct json_t *j);
 extern struct json_t *json_parse(FILE *fp);
+extern struct json_t *json_parse_buf(const char *p, size_t n);
+extern struct json_arena_t *json_arena_create(size_t block_size);
+extern void json_arena_reset(struct json_arena_t *a);
+extern void json_arena_free(struct json_arena_t *a);
+extern struct json_t *json_parse_arena(FILE *fp, struct json_arena_t *arena);
+extern struct json_t *json_parse_buf_arena(const char *p, size_t n,
+                                           struct json_arena_t *arena);
+extern void json_reader_init(struct json_reader_t *r,
+                             const char *p, size_t n);
+extern enum json_event_t json_read(struct json_reader_t *r);
+extern enum json_event_t json_skip(struct json_reader_t *r);
+extern int json_reader_lineno(struct json_reader_t *r);
+extern ssize_t json_unescape(const char *p, size_t n, char *out);
+extern struct json_query_t *json_query_compile(const char *path,
+                                               int delim, int flags);
+extern void json_query_free(struct json_query_t *q);
+extern int json_query_each(const struct json_query_t *q, struct json_t *j,
+                           int (*cb)(struct json_t *, void *), void *arg);
+extern struct json_t *json_query_first(const struct json_query_t *q,
+                                       struct json_t *j);
+extern int json_query_read(const struct json_query_t *q,
+                           struct json_reader_t *r,
+                           int (*cb)(struct json_reader_t *,
+                                     enum json_event_t, void *),
+                           void *arg);
 extern int json_append_from_file(struct json_t *parent_node, FILE *fp);
 extern struct json_t *json_create_child(struct json_t *parent_node);
 extern struct json_t *json_find_child(struct json_t *parent,
@@ -42,6 +198,7 @@ extern struct json_t *json_first_child(struct json_t *parent);
 extern struct json_t *json_next_child(struct json_t *sibling);
 extern struct json_t *json_parent(struct json_t *memb);
 extern int json_idx(struct json_t *memb);
+extern struct json_t *json_child_at(struct json_t *parent, int n);
 extern struct json_t *json_find_descendant(struct json_t *parent,
                        const char *name, bool case_sensitive, int delim);
 
@@ -0,0 +1,342 @@
+/*
+ * ndjson.c - Parse newline-delimited JSON on several threads
+ *
+ * The file is mmap'd and handed out to worker threads in chunks of
+ * about NDJSON_CHUNK bytes, each ending at a newline.  Each worker
+ * parses its chunk a line at a time with json_parse_buf_arena(), into
+ * an arena of its own, so the threads don't share anything but the
+ * chunk counter.
+ *
+ * In ordered mode, a worker keeps its chunk's documents until every
+ * earlier chunk has been delivered, then calls back for all of them.
+ * Otherwise it calls back as soon as each document is parsed.
+ */
+#include "ndjson.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum {
+        NDJSON_CHUNK = 1024 * 1024,
+        NDJSON_MAX_THREADS = 64,
+};
+
+/**
+ * struct ndjson_t - State shared by the workers
+ * @map:        The file
+ * @size:       Length of @map
+ * @flags:      Flags passed to ndjson_parse_file()
+ * @cb:         Callback passed to ndjson_parse_file()
+ * @arg:        Argument for @cb
+ * @lock:       Lock for everything below
+ * @turn:       Signalled when @deliver changes, or @result is set
+ * @pos:        Offset of the next chunk to hand out
+ * @seq:        Sequence number of the next chunk to hand out
+ * @deliver:    In ordered mode, sequence number of the next chunk
+ *              to call back for
+ * @result:     First nonzero return value of @cb, or -1 if out of
+ *              memory.  Once it's set, everyone stops.
+ */
+struct ndjson_t {
+        const char *map;
+        size_t size;
+        int flags;
+        ndjson_cb_t cb;
+        void *arg;
+
+        pthread_mutex_t lock;
+        pthread_cond_t turn;
+        size_t pos;
+        unsigned long seq;
+        unsigned long deliver;
+        int result;
+};
+
+/* A parsed document waiting for its turn, in ordered mode */
+struct ndjson_doc_t {
+        struct json_t *doc;
+        off_t offset;
+};
+
+/**
+ * struct ndjson_worker_t - One worker thread
+ * @nd:         Shared state
+ * @arena:      Where this thread's documents are parsed into
+ * @docs:       In ordered mode, documents parsed from the current
+ *              chunk
+ * @ndocs:      Number of documents in @docs
+ * @docs_size:  Array length of @docs
+ * @tid:        Thread ID
+ */
+struct ndjson_worker_t {
+        struct ndjson_t *nd;
+        struct json_arena_t *arena;
+        struct ndjson_doc_t *docs;
+        size_t ndocs;
+        size_t docs_size;
+        pthread_t tid;
+};
+
+static void
+set_result(struct ndjson_t *nd, int result)
+{
+        pthread_mutex_lock(&nd->lock);
+        if (!nd->result)
+                nd->result = result;
+        pthread_cond_broadcast(&nd->turn);
+        pthread_mutex_unlock(&nd->lock);
+}
+
+/*
+ * Get the next chunk to parse.  Return false if there are no more, or
+ * if someone has told us to stop.
+ */
+static bool
+get_chunk(struct ndjson_t *nd, size_t *start, size_t *end,
+          unsigned long *seq)
+{
+        const char *nl;
+        bool ret = false;
+
+        pthread_mutex_lock(&nd->lock);
+        if (nd->result == 0 && nd->pos < nd->size) {
+                *start = nd->pos;
+                *end = nd->size;
+                if (nd->size - nd->pos > NDJSON_CHUNK) {
+                        nl = memchr(nd->map + nd->pos + NDJSON_CHUNK, '\n',
+                                    nd->size - nd->pos - NDJSON_CHUNK);
+                        if (nl)
+                                *end = nl - nd->map + 1;
+                }
+                nd->pos = *end;
+                *seq = nd->seq++;
+                ret = true;
+        }
+        pthread_mutex_unlock(&nd->lock);
+        return ret;
+}
+
+/* True if line has no document, just whitespace or a comment */
+static bool
+is_blank(const char *p, const char *end)
+{
+        while (p < end && (unsigned char)*p <= ' ')
+                ++p;
+        return p == end || *p == '#';
+}
+
+/* Keep a document until it's this chunk's turn, return -1 if no mem */
+static int
+save_doc(struct ndjson_worker_t *w, struct json_t *doc, off_t offset)
+{
+        if (w->ndocs == w->docs_size) {
+                size_t size = w->docs_size ? w->docs_size * 2 : 256;
+                struct ndjson_doc_t *docs;
+
+                docs = realloc(w->docs, size * sizeof(*docs));
+                if (!docs)
+                        return -1;
+                w->docs = docs;
+                w->docs_size = size;
+        }
+        w->docs[w->ndocs].doc = doc;
+        w->docs[w->ndocs].offset = offset;
+        w->ndocs++;
+        return 0;
+}
+
+/* Call back for @w's saved documents, once the earlier chunks are done */
+static void
+deliver_chunk(struct ndjson_worker_t *w, unsigned long seq)
+{
+        struct ndjson_t *nd = w->nd;
+        size_t i;
+        int res = 0;
+
+        pthread_mutex_lock(&nd->lock);
+        while (nd->deliver != seq && nd->result == 0)
+                pthread_cond_wait(&nd->turn, &nd->lock);
+        res = nd->result;
+        pthread_mutex_unlock(&nd->lock);
+        if (res)
+                return;
+
+        for (i = 0; i < w->ndocs; i++) {
+                res = nd->cb(w->docs[i].doc, w->docs[i].offset, nd->arg);
+                if (res)
+                        break;
+        }
+
+        pthread_mutex_lock(&nd->lock);
+        if (res && !nd->result)
+                nd->result = res;
+        nd->deliver++;
+        pthread_cond_broadcast(&nd->turn);
+        pthread_mutex_unlock(&nd->lock);
+}
+
+static void *
+worker(void *arg)
+{
+        struct ndjson_worker_t *w = arg;
+        struct ndjson_t *nd = w->nd;
+        bool ordered = !!(nd->flags & NDJSON_ORDERED);
+        size_t start, end;
+        unsigned long seq;
+
+        while (get_chunk(nd, &start, &end, &seq)) {
+                const char *p = nd->map + start;
+                const char *stop = nd->map + end;
+
+                while (p < stop) {
+                        const char *nl = memchr(p, '\n', stop - p);
+                        const char *eol = nl ? nl : stop;
+                        off_t offset = p - nd->map;
+                        struct json_t *doc;
+                        int res;
+
+                        if (is_blank(p, eol)) {
+                                p = eol + 1;
+                                continue;
+                        }
+                        doc = json_parse_buf_arena(p, eol - p, w->arena);
+                        p = eol + 1;
+
+                        if (ordered) {
+                                if (save_doc(w, doc, offset) < 0) {
+                                        set_result(nd, -1);
+                                        return NULL;
+                                }
+                                continue;
+                        }
+
+                        res = nd->cb(doc, offset, nd->arg);
+                        json_arena_reset(w->arena);
+                        if (res) {
+                                set_result(nd, res);
+                                return NULL;
+                        }
+                }
+
+                if (ordered) {
+                        deliver_chunk(w, seq);
+                        w->ndocs = 0;
+                        json_arena_reset(w->arena);
+                }
+        }
+        return NULL;
+}
+
+static int
+default_nthreads(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1)
+                return 1;
+        return n > NDJSON_MAX_THREADS ? NDJSON_MAX_THREADS : n;
+}
+
+/**
+ * ndjson_parse_file - Parse a file of newline-delimited JSON
+ * @path: File to parse, one document per line.  Blank lines and lines
+ *      starting with '#' are skipped.
+ * @nthreads: Number of threads to parse with, or zero for one per CPU
+ * @flags: NDJSON_ORDERED to call back in file order, one document at
+ *      a time.  Otherwise @cb is called from all the threads at once,
+ *      in no particular order.
+ * @cb: Function to call back for each document
+ * @arg: Argument to pass to @cb
+ *
+ * Each document is only valid until @cb returns.  It's allocated from
+ * an arena that is reused for the next document, so don't call
+ * json_free() on it, and copy out anything that needs to be kept.
+ *
+ * Return: Zero if every document was called back for.  Otherwise, the
+ *      nonzero value that @cb returned to stop early, or -1 if @path
+ *      couldn't be read or there was not enough memory, with errno set.
+ */
+int
+ndjson_parse_file(const char *path, int nthreads, int flags,
+                  ndjson_cb_t cb, void *arg)
+{
+        struct ndjson_worker_t *workers = NULL;
+        struct ndjson_t nd;
+        struct stat st;
+        int fd, i, nstarted = 0;
+        void *map;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        if (fstat(fd, &st) < 0) {
+                close(fd);
+                return -1;
+        }
+        if (st.st_size == 0) {
+                close(fd);
+                return 0;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return -1;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        memset(&nd, 0, sizeof(nd));
+        nd.map = map;
+        nd.size = st.st_size;
+        nd.flags = flags;
+        nd.cb = cb;
+        nd.arg = arg;
+        pthread_mutex_init(&nd.lock, NULL);
+        pthread_cond_init(&nd.turn, NULL);
+
+        if (nthreads <= 0)
+                nthreads = default_nthreads();
+        else if (nthreads > NDJSON_MAX_THREADS)
+                nthreads = NDJSON_MAX_THREADS;
+
+        workers = calloc(nthreads, sizeof(*workers));
+        if (!workers)
+                goto enomem;
+        for (i = 0; i < nthreads; i++) {
+                workers[i].nd = &nd;
+                workers[i].arena = json_arena_create(0);
+                if (!workers[i].arena)
+                        goto enomem;
+        }
+
+        /* Worker 0 is this thread */
+        for (i = 1; i < nthreads; i++) {
+                if (pthread_create(&workers[i].tid, NULL,
+                                   worker, &workers[i]) != 0) {
+                        break;
+                }
+                nstarted++;
+        }
+        worker(&workers[0]);
+        for (i = 1; i <= nstarted; i++)
+                pthread_join(workers[i].tid, NULL);
+        goto out;
+
+enomem:
+        nd.result = -1;
+        errno = ENOMEM;
+out:
+        if (workers) {
+                for (i = 0; i < nthreads; i++) {
+                        json_arena_free(workers[i].arena);
+                        free(workers[i].docs);
+                }
+                free(workers);
+        }
+        pthread_cond_destroy(&nd.turn);
+        pthread_mutex_destroy(&nd.lock);
+        munmap(map, st.st_size);
+        return nd.result;
+}
@@ -0,0 +1,22 @@
+#ifndef NDJSON_H
+#define NDJSON_H
+
+#include "json.h"
+#include <sys/types.h>
+
+/* ndjson_parse_file() flags */
+enum {
+        NDJSON_ORDERED = 0x01, /* call back in file order, one at a time */
+};
+
+/*
+ * Called for each document.  @doc is NULL if the line had a syntax
+ * error.  @offset is where the line starts in the file.  Return
+ * nonzero to stop.
+ */
+typedef int (*ndjson_cb_t)(struct json_t *doc, off_t offset, void *arg);
+
+extern int ndjson_parse_file(const char *path, int nthreads, int flags,
+                             ndjson_cb_t cb, void *arg);
+
+#endif /* NDJSON_H */
@@ -1,8 +1,12 @@
 #include "json.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static void
 die(int signo)
@@ -11,23 +15,545 @@ die(int signo)
         _exit(EXIT_FAILURE);
 }
 
+/* Parse @path with json_parse_buf, using a mmap'd copy of the file */
+static struct json_t *
+parse_mapped(const char *path, struct json_arena_t *arena)
+{
+        struct json_t *j;
+        struct stat st;
+        void *p;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        j = json_parse_buf_arena(p, st.st_size, arena);
+        munmap(p, st.st_size);
+        return j;
+}
+
+/*
+ * Check that json_find_child() and json_child_at() agree with a
+ * plain walk of the children, for every container in @j.  The big
+ * ones go through the child index.
+ */
+static int
+check_lookups(struct json_t *j)
+{
+        struct json_t *child, *found;
+        char idxname[16];
+        int n = 0, nerr = 0;
+
+        JSON_FOR_EACH_CHILD(j, child) {
+                if (j->type == '{') {
+                        /* First of any duplicates wins */
+                        found = json_find_child(j, child->name, true);
+                        if (found != child && json_idx(found) >= n)
+                                goto bad;
+                        found = json_find_child(j, child->name, false);
+                        if (!found || json_idx(found) > n
+                            || strcasecmp(found->name, child->name))
+                                goto bad;
+                } else {
+                        sprintf(idxname, "[%d]", n);
+                        if (json_find_child(j, idxname, true) != child)
+                                goto bad;
+                }
+                if (json_child_at(j, n) != child || json_idx(child) != n)
+                        goto bad;
+                nerr += check_lookups(child);
+                ++n;
+                continue;
+
+        bad:
+                fprintf(stderr, "Lookup of %s failed\n", child->name);
+                ++nerr;
+        }
+        if (json_child_at(j, n) != NULL)
+                ++nerr;
+        return nerr;
+}
+
+/*
+ * Check that the strings in the "escapes" object were decoded, and
+ * that json_unescape() turns down what isn't valid.
+ */
+static int
+check_strings(struct json_t *j)
+{
+        static const struct {
+                const char *name;
+                const char *value;
+        } good[] = {
+                { "quote", "say \"hi\"" },
+                { "path", "C:\\dir\\" },
+                { "slash", "a/b" },
+                { "ctl", "tab\there\r\n" },
+                { "uni", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80" },
+                { "raw", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80" },
+                { "escaped key", NULL },
+        };
+        static const char *const bad[] = {
+                "\\x", "\\", "\\u12", "\\u12G4", "\\u0000",
+                "\\ud83d", "\\ude00", "\\ud83d\\u0041",
+                "\xc3", "\xc3\x28", "\xc0\xaf", "\xe0\x80\xaf",
+                "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xff", "\x80",
+        };
+        struct json_t *esc, *child;
+        size_t i;
+        int nerr = 0;
+
+        /* Only test_json.json has these */
+        esc = json_find_child(j, "escapes", true);
+        for (i = 0; esc && i < sizeof(good) / sizeof(good[0]); i++) {
+                child = json_find_child(esc, good[i].name, true);
+                if (!child || (good[i].value
+                               && strcmp(child->value.s, good[i].value))) {
+                        fprintf(stderr, "Bad string %s\n", good[i].name);
+                        ++nerr;
+                }
+        }
+        for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+                if (json_unescape(bad[i], strlen(bad[i]), NULL) >= 0) {
+                        fprintf(stderr, "Accepted bad string %zu\n", i);
+                        ++nerr;
+                }
+        }
+        return nerr;
+}
+
+/*
+ * Check that buffers without a value in them don't parse, nor ones
+ * with raw control characters in strings, which json_read() must
+ * turn down too
+ */
+static int
+check_bad_bufs(struct json_arena_t *arena)
+{
+        static const char *const bad[] = {
+                "", "]", ",", "}", ":", "  \n", "# just a comment\n",
+                "[1, ]", "{\"a\": }",
+        };
+        static const char *const ctl[] = {
+                "\"raw\ttab\"", "[\"line\nbreak\"]", "{\"a\x01\": 1}",
+                "\"long enough for the vector scan, then \x1f\"",
+        };
+        struct json_reader_t r;
+        enum json_event_t ev;
+        struct json_t *j;
+        size_t i;
+        int nerr = 0;
+
+        for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+                j = json_parse_buf_arena(bad[i], strlen(bad[i]), arena);
+                if (j != NULL) {
+                        fprintf(stderr, "Parsed bad buffer \"%s\"\n",
+                                bad[i]);
+                        if (!arena)
+                                json_free(j);
+                        ++nerr;
+                }
+        }
+        for (i = 0; i < sizeof(ctl) / sizeof(ctl[0]); i++) {
+                j = json_parse_buf_arena(ctl[i], strlen(ctl[i]), arena);
+                json_reader_init(&r, ctl[i], strlen(ctl[i]));
+                while ((ev = json_read(&r)) > JSON_EV_EOF)
+                        ;
+                if (j != NULL || ev != JSON_EV_ERROR) {
+                        fprintf(stderr, "Took control character in \"%s\"\n",
+                                ctl[i]);
+                        if (j && !arena)
+                                json_free(j);
+                        ++nerr;
+                }
+        }
+        return nerr;
+}
+
+/* Check that encoded value @v matches @j, using the in-place readers */
+static int
+check_bin_value(const struct json_bin_t *bin, uint32_t v, struct json_t *j)
+{
+        struct json_t *child;
+        const char *s;
+        long n = 0;
+        int nerr = 0;
+
+        if (json_bin_type(bin, v) != j->type)
+                return 1;
+        switch (j->type) {
+        case 'q':
+                s = json_bin_str(bin, v, NULL);
+                return !s || strcmp(s, j->value.s);
+        case 'i':
+                return json_bin_int(bin, v) != j->value.i;
+        case 'f':
+                return memcmp(&(double){ json_bin_float(bin, v) },
+                              &j->value.f, sizeof(double)) != 0;
+        case 'b':
+                return json_bin_bool(bin, v) != j->value.b;
+        case 'n':
+                return 0;
+        }
+
+        JSON_FOR_EACH_CHILD_STRICT(j, child) {
+                if (j->type == '{') {
+                        s = json_bin_key_at(bin, v, n);
+                        if (!s || strcmp(s, child->name))
+                                ++nerr;
+                        /* First of any duplicates wins */
+                        if (json_bin_find(bin, v, child->name)
+                            != json_bin_at(bin, v,
+                                           json_idx(json_find_child(j,
+                                                child->name, true)))) {
+                                ++nerr;
+                        }
+                }
+                nerr += check_bin_value(bin, json_bin_at(bin, v, n), child);
+                ++n;
+        }
+        if (json_bin_size(bin, v) != n || json_bin_at(bin, v, n) != 0)
+                ++nerr;
+        if (j->type == '{' && json_bin_find(bin, v, "no such key") != 0)
+                ++nerr;
+        return nerr;
+}
+
+/*
+ * Encode @j with json_bin_encode(), and check that it reads back the
+ * same in place, and decodes to the same tree.  Then check that bad
+ * or cut-off encodings are turned down, not crashed on.
+ */
+static int
+check_bin(struct json_t *j, struct json_arena_t *arena)
+{
+        char deep[(JSON_READER_MAX_DEPTH + 1) * 2];
+        struct json_buf_t b, b1, b2;
+        struct json_bin_t bin;
+        struct json_t *j2;
+        size_t i;
+        int nerr = 0;
+
+        memset(&b, 0, sizeof(b));
+        if (json_bin_encode(&b, j) < 0 || json_bin_init(&bin, b.p, b.len) < 0)
+                return 1;
+        nerr += check_bin_value(&bin, json_bin_root(&bin), j);
+
+        memset(&b1, 0, sizeof(b1));
+        memset(&b2, 0, sizeof(b2));
+        j2 = json_bin_decode(&bin, json_bin_root(&bin), arena);
+        if (!j2 || json_write(&b1, j, 0) < 0 || json_write(&b2, j2, 0) < 0
+            || b1.len != b2.len || memcmp(b1.p, b2.p, b1.len)) {
+                ++nerr;
+        }
+        if (j2 && !arena)
+                json_free(j2);
+        json_buf_free(&b1);
+        json_buf_free(&b2);
+
+        for (i = 0; i < b.len; i++) {
+                /* Cut off */
+                if (json_bin_init(&bin, b.p, i) == 0)
+                        ++nerr;
+                /* Corrupt */
+                b.p[i] ^= 0x5a;
+                if (json_bin_init(&bin, b.p, b.len) == 0) {
+                        j2 = json_bin_decode(&bin, json_bin_root(&bin),
+                                             arena);
+                        if (j2 && !arena)
+                                json_free(j2);
+                }
+                b.p[i] ^= 0x5a;
+        }
+        json_buf_free(&b);
+
+        /* Nested deeper than the decoder will go */
+        memset(deep, '[', JSON_READER_MAX_DEPTH + 1);
+        memset(deep + JSON_READER_MAX_DEPTH + 1, ']',
+               JSON_READER_MAX_DEPTH + 1);
+        j2 = json_parse_buf_arena(deep, sizeof(deep), NULL);
+        memset(&b, 0, sizeof(b));
+        if (!j2 || json_bin_encode(&b, j2) < 0
+            || json_bin_init(&bin, b.p, b.len) < 0
+            || json_bin_decode(&bin, json_bin_root(&bin), NULL) != NULL) {
+                fprintf(stderr, "Decoded nesting too deep\n");
+                ++nerr;
+        }
+        if (j2)
+                json_free(j2);
+        json_buf_free(&b);
+        return nerr;
+}
+
+static int
+query_tree_cb(struct json_t *j, void *arg)
+{
+        struct json_buf_t *b = arg;
+
+        if (json_write(b, j, 0) < 0)
+                return -1;
+        /* One per line */
+        if (b->len == b->size) {
+                char *p = realloc(b->p, b->size + 1);
+                if (!p)
+                        return -1;
+                b->p = p;
+                b->size++;
+        }
+        b->p[b->len++] = '\n';
+        return 0;
+}
+
+/* Same as query_tree_cb(), by parsing the matched text */
+static int
+query_read_cb(struct json_reader_t *r, enum json_event_t ev, void *arg)
+{
+        const char *start = r->text.p, *end = r->text.p + r->text.len;
+        struct json_t *j;
+        int res;
+
+        if (ev == JSON_EV_STRING) {
+                --start;
+                ++end;
+        } else if (ev == JSON_EV_START_OBJECT || ev == JSON_EV_START_ARRAY) {
+                if (json_skip(r) <= JSON_EV_EOF)
+                        return -1;
+                end = r->p;
+        }
+        j = json_parse_buf(start, end - start);
+        if (!j)
+                return -1;
+        res = query_tree_cb(j, arg);
+        json_free(j);
+        return res;
+}
+
+/*
+ * Check that json_query_each() on @j and json_query_read() on the text
+ * of @path find the same values, and that bad paths don't compile.
+ */
+static int
+check_queries(struct json_t *j, const char *path)
+{
+        static const struct {
+                const char *path;
+                int flags;
+        } good[] = {
+                { "", 0 }, { "name", 0 }, { "list[*]", 0 },
+                { "list[4][1]", 0 }, { "list.*", 0 }, { "*[*]", 0 },
+                { "nested.a.b.c", 0 }, { "*.a", 0 },
+                { "escapes.escaped key", 0 }, { "wide.k05", 0 },
+                { "long[39]", 0 }, { "long[40]", 0 }, { "skip.x[2].y", 0 },
+                { "nothing", 0 }, { "missing.x", 0 }, { "name.x", 0 },
+                { "list[0].x", 0 }, { "NESTED.A.b", JSON_QUERY_NOCASE },
+                { "NESTED.A.b", 0 },
+        };
+        static const char *const bad[] = {
+                "a..b", "a[", "a[x]", "a.", ".a", "[-1]", "a[0]b",
+        };
+        struct json_buf_t b1, b2;
+        struct json_reader_t r;
+        struct json_query_t *q;
+        size_t i, total = 0;
+        struct stat st;
+        int fd, nerr = 0;
+        void *p;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0)
+                return 1;
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+                return 1;
+
+        for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+                q = json_query_compile(good[i].path, '.', good[i].flags);
+                if (!q) {
+                        ++nerr;
+                        continue;
+                }
+                memset(&b1, 0, sizeof(b1));
+                memset(&b2, 0, sizeof(b2));
+                json_reader_init(&r, p, st.st_size);
+                if (json_query_each(q, j, query_tree_cb, &b1) != 0
+                    || json_query_read(q, &r, query_read_cb, &b2) != 0
+                    || b1.len != b2.len
+                    || (b1.len && memcmp(b1.p, b2.p, b1.len))) {
+                        fprintf(stderr, "Query \"%s\" failed\n",
+                                good[i].path);
+                        ++nerr;
+                }
+                if ((json_query_first(q, j) != NULL) != (b1.len != 0))
+                        ++nerr;
+                total += b1.len;
+                json_buf_free(&b1);
+                json_buf_free(&b2);
+                json_query_free(q);
+        }
+        for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+                q = json_query_compile(bad[i], '.', 0);
+                if (q) {
+                        fprintf(stderr, "Compiled bad query \"%s\"\n",
+                                bad[i]);
+                        json_query_free(q);
+                        ++nerr;
+                }
+        }
+        munmap(p, st.st_size);
+        return nerr || total == 0;
+}
+
+/* Print json_read()'s events for @path, one per line */
+static int
+dump_events(const char *path)
+{
+        static const char *names[] = {
+                [JSON_EV_EOF] = "eof",
+                [JSON_EV_START_OBJECT] = "start-object",
+                [JSON_EV_END_OBJECT] = "end-object",
+                [JSON_EV_START_ARRAY] = "start-array",
+                [JSON_EV_END_ARRAY] = "end-array",
+                [JSON_EV_KEY] = "key",
+                [JSON_EV_STRING] = "string",
+                [JSON_EV_INT] = "int",
+                [JSON_EV_FLOAT] = "float",
+                [JSON_EV_BOOL] = "bool",
+                [JSON_EV_NULL] = "null",
+        };
+        struct json_reader_t r;
+        enum json_event_t ev;
+        struct stat st;
+        void *p;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        json_reader_init(&r, p, st.st_size);
+        while ((ev = json_read(&r)) > JSON_EV_EOF) {
+                bool start = ev == JSON_EV_START_OBJECT
+                             || ev == JSON_EV_START_ARRAY;
+                printf("%*s%s", (r.depth - start) * 2, "", names[ev]);
+                if (!start && ev != JSON_EV_END_OBJECT
+                    && ev != JSON_EV_END_ARRAY) {
+                        printf(" %.*s", (int)r.text.len, r.text.p);
+                }
+                putchar('\n');
+                /* Test json_skip() too */
+                if (ev == JSON_EV_KEY && r.text.len == 4
+                    && !memcmp(r.text.p, "skip", 4)) {
+                        if ((ev = json_skip(&r)) == JSON_EV_ERROR)
+                                break;
+                        printf("%*s(skipped)\n", r.depth * 2, "");
+                }
+        }
+        if (ev == JSON_EV_ERROR) {
+                fprintf(stderr, "%s:%d: %s\n",
+                        path, json_reader_lineno(&r), r.error);
+        }
+        munmap(p, st.st_size);
+        return ev == JSON_EV_EOF ? 0 : 1;
+}
+
+/*
+ * Print @j with json_write(), and check that what's written reads
+ * back the same: parsing it and writing it again must give the same
+ * text, in both modes.
+ */
+static int
+check_write(struct json_t *j)
+{
+        static const int modes[] = { 0, JSON_WRITE_PRETTY };
+        struct json_buf_t b1, b2;
+        struct json_t *j2;
+        int i, nerr = 0;
+
+        for (i = 0; i < 2; i++) {
+                memset(&b1, 0, sizeof(b1));
+                memset(&b2, 0, sizeof(b2));
+                if (json_write(&b1, j, modes[i]) < 0) {
+                        ++nerr;
+                        continue;
+                }
+                printf("Written%s:\n%.*s\n", modes[i] ? " (pretty)" : "",
+                       (int)b1.len, b1.p);
+                j2 = json_parse_buf(b1.p, b1.len);
+                if (!j2 || json_write(&b2, j2, modes[i]) < 0
+                    || b1.len != b2.len || memcmp(b1.p, b2.p, b1.len)) {
+                        ++nerr;
+                }
+                if (j2)
+                        json_free(j2);
+                json_buf_free(&b1);
+                json_buf_free(&b2);
+        }
+        return nerr;
+}
+
 int
 main(int argc, char **argv)
 {
         FILE *fp;
         struct json_t *j;
+        struct json_arena_t *arena = NULL;
+        int usebuf = 0;
+        int stream = 0;
+        int opt;
 
+        while ((opt = getopt(argc, argv, "abs")) != -1) {
+                switch (opt) {
+                case 'a':
+                        /* Small blocks, to test block chaining */
+                        arena = json_arena_create(256);
+                        break;
+                case 'b':
+                        usebuf = 1;
+                        break;
+                case 's':
+                        stream = 1;
+                        break;
+                default:
+                        return 1;
+                }
+        }
+        argc -= optind - 1;
+        argv += optind - 1;
         if (argc <= 1) {
-                fprintf(stderr, "Expected: json file");
+                fprintf(stderr, "Expected: [-a] [-b] [-s] json file\n");
                 return 1;
         }
         signal(SIGTERM, die);
         signal(SIGQUIT, die);
         signal(SIGSEGV, die);
 
-        fp = fopen(argv[1], "r");
-        j = json_parse(fp);
-        fclose(fp);
+        if (stream)
+                return dump_events(argv[1]);
+
+        if (usebuf) {
+                j = parse_mapped(argv[1], arena);
+        } else {
+                fp = fopen(argv[1], "r");
+                j = json_parse_arena(fp, arena);
+                fclose(fp);
+        }
 
         if (j != NULL) {
                 printf("Without EOL:\n");
@@ -38,9 +564,20 @@ main(int argc, char **argv)
 
                 printf("With EOL:\n");
                 json_print(stdout, j, true);
-                json_free(j);
+
+                printf("Lookups: %s\n", check_lookups(j) ? "FAIL" : "OK");
+                printf("Strings: %s\n", check_strings(j) ? "FAIL" : "OK");
+                printf("Round trip: %s\n", check_write(j) ? "FAIL" : "OK");
+                printf("Queries: %s\n",
+                       check_queries(j, argv[1]) ? "FAIL" : "OK");
+                printf("Binary: %s\n",
+                       check_bin(j, arena) ? "FAIL" : "OK");
+                printf("Bad buffers: %s\n",
+                       check_bad_bufs(arena) ? "FAIL" : "OK");
+                if (!arena)
+                        json_free(j);
         }
+        json_arena_free(arena);
 
         return 0;
 }
-
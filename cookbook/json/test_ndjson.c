@@ -0,0 +1,111 @@
+/*
+ * test_ndjson.c - Parse a newline-delimited JSON file with
+ *                 ndjson_parse_file()
+ *
+ * Usage: ndjson_test [-o] [-j NTHREADS] [-p] FILE
+ *
+ *      -o      Ordered.  Check that documents arrive in file order.
+ *      -j      Number of threads, default one per CPU
+ *      -p      Print each document, with json_write()
+ *
+ * Prints the number of documents and syntax errors, and the speed.
+ */
+#include "ndjson.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+struct count_t {
+        pthread_mutex_t lock;
+        unsigned long ndocs;
+        unsigned long nerrs;
+        off_t last;
+        bool ordered;
+        bool print;
+        bool out_of_order;
+};
+
+static int
+count_doc(struct json_t *doc, off_t offset, void *arg)
+{
+        struct count_t *c = arg;
+
+        pthread_mutex_lock(&c->lock);
+        if (doc)
+                c->ndocs++;
+        else
+                c->nerrs++;
+        if (c->ordered) {
+                if (c->ndocs + c->nerrs > 1 && offset <= c->last)
+                        c->out_of_order = true;
+                c->last = offset;
+        }
+        if (c->print && doc) {
+                printf("%lld: ", (long long)offset);
+                json_fwrite(stdout, doc, 0);
+                putchar('\n');
+        }
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct count_t c;
+        struct timespec t0, t1;
+        struct stat st;
+        int nthreads = 0, flags = 0;
+        int opt, res;
+        double secs;
+
+        memset(&c, 0, sizeof(c));
+        while ((opt = getopt(argc, argv, "oj:p")) != -1) {
+                switch (opt) {
+                case 'o':
+                        flags |= NDJSON_ORDERED;
+                        c.ordered = true;
+                        break;
+                case 'j':
+                        nthreads = atoi(optarg);
+                        break;
+                case 'p':
+                        c.print = true;
+                        break;
+                default:
+                        return 1;
+                }
+        }
+        if (optind >= argc) {
+                fprintf(stderr,
+                        "Expected: [-o] [-j NTHREADS] [-p] ndjson file\n");
+                return 1;
+        }
+        if (stat(argv[optind], &st) < 0) {
+                perror(argv[optind]);
+                return 1;
+        }
+        pthread_mutex_init(&c.lock, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        res = ndjson_parse_file(argv[optind], nthreads, flags,
+                                count_doc, &c);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (res < 0) {
+                perror(argv[optind]);
+                return 1;
+        }
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%lu documents, %lu errors, %.1f MB/s\n",
+               c.ndocs, c.nerrs, st.st_size / 1e6 / secs);
+        if (c.out_of_order) {
+                printf("Out of order!\n");
+                return 1;
+        }
+        return 0;
+}
@@ -11,6 +11,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include <stdio.h>
 #include <setjmp.h>
 
@@ -29,7 +30,19 @@ extern void eg_paragraph(const char *s, unsigned int startcol,
 struct tm;
 extern int eg_parse_date(const char *s, struct tm *tm);
 
-extern uint32_t eg_fletcher32(uint16_t *data, size_t len);
+extern uint32_t eg_fletcher32(const uint16_t *data, size_t len);
+
+/* eg_fletcher32() of data that comes in pieces of any number of bytes */
+struct eg_fletcher32_t {
+        uint32_t sum1;
+        uint32_t sum2;
+        unsigned char odd;      /* first half of a word, if have_odd */
+        unsigned char have_odd;
+};
+extern void eg_fletcher32_init(struct eg_fletcher32_t *f);
+extern void eg_fletcher32_update(struct eg_fletcher32_t *f, const void *data,
+                                 size_t len);
+extern uint32_t eg_fletcher32_final(struct eg_fletcher32_t *f);
 
 #define EG_BINARY    (0x0001U)
 #define EG_RECURSIVE (0x0002U)
@@ -38,9 +51,55 @@ extern int eg_dir_foreach(const char *path, unsigned int flags,
 extern int eg_sdir_foreach(const char *path, unsigned int flags,
                            int (*fn)(const char *, void *), void *priv);
 
+/* eg_dir_walk() also takes EG_RECURSIVE */
+#define EG_WALK_ORDERED (0x0004U)
+struct eg_dirent_t {
+        const char *path;       /* path, starting with the walk's root */
+        const char *name;       /* last part of path */
+        int dirfd;              /* fd of its directory, for *at() calls */
+        unsigned char type;     /* DT_REG, DT_LNK... from <dirent.h> */
+};
+typedef int (*eg_walk_fn)(const struct eg_dirent_t *ent, void *priv);
+extern int eg_dir_walk(const char *path, unsigned int flags, int nthreads,
+                       eg_walk_fn fn, void *priv);
+
+/* eg_dir_foreach_data() also takes EG_RECURSIVE */
+#define EG_NO_URING (0x0008U)
+typedef int (*eg_data_fn)(const char *path, const void *data, size_t len,
+                          void *priv);
+extern int eg_dir_foreach_data(const char *path, unsigned int flags,
+                               eg_data_fn fn, void *priv);
+
+/* Finds what's new since the last scan; also takes EG_RECURSIVE */
+#define EG_WALK_WATCH (0x0010U)
+struct eg_walk_cache_t;
+extern struct eg_walk_cache_t *eg_walk_cache_open(const char *root,
+                                                  const char *path,
+                                                  unsigned int flags);
+extern int eg_walk_cache_scan(struct eg_walk_cache_t *c,
+                              int (*fn)(const char *, void *), void *priv);
+extern int eg_walk_cache_save(struct eg_walk_cache_t *c);
+extern void eg_walk_cache_close(struct eg_walk_cache_t *c);
+
 extern int eg_popd(void);
 extern int eg_pushd(const char *dir);
 
+/* Like eg_pushd(), but thread-safe and without chdir() */
+struct stat;
+struct eg_dirstack_t;
+extern struct eg_dirstack_t *eg_dirstack_new(void);
+extern struct eg_dirstack_t *eg_dirstack_self(void);
+extern void eg_dirstack_free(struct eg_dirstack_t *ds);
+extern int eg_dirstack_push(struct eg_dirstack_t *ds, const char *dir);
+extern int eg_dirstack_pop(struct eg_dirstack_t *ds);
+extern int eg_dirstack_fd(const struct eg_dirstack_t *ds);
+extern int eg_dirstack_open(const struct eg_dirstack_t *ds,
+                            const char *path, int flags, mode_t mode);
+extern int eg_dirstack_stat(const struct eg_dirstack_t *ds,
+                            const char *path, struct stat *st);
+extern FILE *eg_dirstack_fopen(const struct eg_dirstack_t *ds,
+                               const char *path, const char *mode);
+
 /* TODO: Deprecate this - it was a bad idea */
 extern void bail_on(int cond, jmp_buf env, int ret);
 extern int file_backup(const char *dst_path, const char *src_path);
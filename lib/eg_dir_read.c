@@ -0,0 +1,586 @@
+/*
+ * eg_dir_read.c - Read every file under a directory, many at a time
+ *
+ * eg_dir_foreach() opens one file at a time, so with a cold cache a
+ * big tree of small files takes a disk round trip per file.  Here the
+ * tree is walked with eg_dir_walk(), and up to URING_DEPTH files are
+ * kept being opened and read through an io_uring, using the raw
+ * system calls.  Each file is handed to the callback as soon as its
+ * last read completes.
+ *
+ * Where there's no io_uring, the walk's own thread pool reads the
+ * files with plain open() and read() instead, and the callbacks take
+ * turns under a lock.  Either way, the callback is only ever called
+ * from one thread at a time.
+ */
+#include "config.h"
+#include "eg-devel.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+/* OPENAT and READ came with 5.6, the same as this */
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_CUR_PERSONALITY)
+#  define USE_URING 1
+# endif
+#endif
+
+enum {
+        /* Files to have in flight at once */
+        URING_DEPTH = 64,
+        /* First read size; buffers grow for bigger files */
+        READ_CHUNK = 64 * 1024,
+        /* Threads for the fallback, mostly waiting on the disk */
+        READ_THREADS = 16,
+};
+
+/**
+ * struct read_t - State for either way of reading
+ * @fn:         Callback passed to eg_dir_foreach_data()
+ * @priv:       Argument for @fn
+ * @lock:       In the fallback, held while calling @fn
+ * @err:        errno of the first file that couldn't be read
+ * @stopped:    True once @fn has stopped the walk, or @err is set
+ */
+struct read_t {
+        eg_data_fn fn;
+        void *priv;
+        pthread_mutex_t lock;
+        int err;
+        bool stopped;
+};
+
+/* Fallback: read @ent's file into memory, then call back */
+static int
+read_one(const struct eg_dirent_t *ent, void *priv)
+{
+        struct read_t *r = priv;
+        struct stat st;
+        char *buf = NULL;
+        size_t size, len = 0;
+        ssize_t n;
+        int fd, res = 0;
+
+        if (ent->type != DT_REG)
+                return 0;
+        fd = openat(ent->dirfd, ent->name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0)
+                goto error;
+
+        /* One more byte, to see the end of the file in one go */
+        size = st.st_size + 1;
+        for (;;) {
+                if (len == size || !buf) {
+                        char *p;
+
+                        if (buf)
+                                size *= 2;
+                        p = realloc(buf, size);
+                        if (!p)
+                                goto error;
+                        buf = p;
+                }
+                n = read(fd, buf + len, size - len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        goto error;
+                if (n == 0)
+                        break;
+                len += n;
+        }
+        close(fd);
+
+        pthread_mutex_lock(&r->lock);
+        if (!r->stopped && r->fn(ent->path, buf, len, r->priv) < 0) {
+                r->stopped = true;
+                res = -1;
+        }
+        pthread_mutex_unlock(&r->lock);
+        free(buf);
+        return res;
+
+error:
+        pthread_mutex_lock(&r->lock);
+        if (!r->stopped) {
+                r->err = errno;
+                r->stopped = true;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (fd >= 0)
+                close(fd);
+        free(buf);
+        return -1;
+}
+
+#ifdef USE_URING
+
+/**
+ * struct uring_t - An io_uring and the files in flight in it
+ * @r:          Shared state
+ * @fd:         The ring
+ * @map:        Where the rings are mapped
+ * @mapsize:    Size of @map
+ * @sqes:       Submission queue entries
+ * @sqesize:    Size of @sqes
+ * @sq_head:    The submission ring's head, moved by the kernel
+ * @sq_tail:    The submission ring's tail, moved by us
+ * @sq_mask:    Mask for indexes into @sq_array
+ * @sq_array:   Indexes into @sqes
+ * @cq_head:    The completion ring's head, moved by us
+ * @cq_tail:    The completion ring's tail, moved by the kernel
+ * @cq_mask:    Mask for indexes into @cqes
+ * @cqes:       Completion queue entries
+ * @tosubmit:   Entries queued since the last io_uring_enter()
+ * @inflight:   Files being opened or read
+ * @slots:      One per file in flight; the index is the user_data
+ * @free:       Stack of indexes of free @slots
+ * @nfree:      Number of entries in @free
+ */
+struct uring_t {
+        struct read_t *r;
+        int fd;
+        void *map;
+        size_t mapsize;
+        struct io_uring_sqe *sqes;
+        size_t sqesize;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+        unsigned tosubmit;
+        unsigned inflight;
+        struct uring_slot_t {
+                char *path;
+                int fd;
+                char *buf;
+                size_t size;
+                size_t len;
+                size_t expect;  /* st_size when opened, or SIZE_MAX */
+        } slots[URING_DEPTH];
+        int free[URING_DEPTH];
+        int nfree;
+};
+
+static int
+uring_setup(struct uring_t *u)
+{
+        struct io_uring_params p;
+        char *map;
+        size_t sqsize, cqsize;
+        int i;
+
+        memset(&p, 0, sizeof(p));
+        u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+        if (u->fd < 0)
+                return -1;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+            || !(p.features & IORING_FEAT_CUR_PERSONALITY)) {
+                close(u->fd);
+                errno = ENOSYS;
+                return -1;
+        }
+
+        sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqsize = p.cq_off.cqes
+                 + p.cq_entries * sizeof(struct io_uring_cqe);
+        u->mapsize = sqsize > cqsize ? sqsize : cqsize;
+        u->map = mmap(NULL, u->mapsize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        if (u->map == MAP_FAILED)
+                goto error;
+        u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sqes == MAP_FAILED) {
+                munmap(u->map, u->mapsize);
+                goto error;
+        }
+
+        map = u->map;
+        u->sq_head = (unsigned *)(map + p.sq_off.head);
+        u->sq_tail = (unsigned *)(map + p.sq_off.tail);
+        u->sq_mask = *(unsigned *)(map + p.sq_off.ring_mask);
+        u->sq_array = (unsigned *)(map + p.sq_off.array);
+        u->cq_head = (unsigned *)(map + p.cq_off.head);
+        u->cq_tail = (unsigned *)(map + p.cq_off.tail);
+        u->cq_mask = *(unsigned *)(map + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)(map + p.cq_off.cqes);
+
+        for (i = 0; i < URING_DEPTH; i++) {
+                u->slots[i].fd = -1;
+                u->free[i] = URING_DEPTH - 1 - i;
+        }
+        u->nfree = URING_DEPTH;
+        return 0;
+
+error:
+        close(u->fd);
+        return -1;
+}
+
+static void
+uring_teardown(struct uring_t *u)
+{
+        int i;
+
+        for (i = 0; i < URING_DEPTH; i++) {
+                if (u->slots[i].fd >= 0)
+                        close(u->slots[i].fd);
+                free(u->slots[i].path);
+                free(u->slots[i].buf);
+        }
+        munmap(u->sqes, u->sqesize);
+        munmap(u->map, u->mapsize);
+        close(u->fd);
+}
+
+/*
+ * Get an entry to fill in.  There's always room, since there's never
+ * more than one entry per slot in flight.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring_t *u, int slot)
+{
+        unsigned tail = *u->sq_tail;
+        unsigned i = tail & u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[i];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = slot;
+        u->sq_array[i] = i;
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        u->tosubmit++;
+        return sqe;
+}
+
+static void
+uring_open(struct uring_t *u, int slot)
+{
+        struct io_uring_sqe *sqe = uring_sqe(u, slot);
+
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)u->slots[slot].path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void
+uring_read(struct uring_t *u, int slot)
+{
+        struct uring_slot_t *s = &u->slots[slot];
+        struct io_uring_sqe *sqe = uring_sqe(u, slot);
+
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = s->fd;
+        sqe->addr = (unsigned long)(s->buf + s->len);
+        sqe->len = s->size - s->len;
+        sqe->off = s->len;
+}
+
+/* Submit what's queued, and wait for at least @wait completions */
+static int
+uring_enter(struct uring_t *u, unsigned wait)
+{
+        int res;
+
+        do {
+                res = syscall(__NR_io_uring_enter, u->fd, u->tosubmit,
+                              wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                              NULL, 0);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0)
+                return -1;
+        u->tosubmit -= res;
+        return 0;
+}
+
+static void
+slot_done(struct uring_t *u, int slot)
+{
+        struct uring_slot_t *s = &u->slots[slot];
+
+        if (s->fd >= 0)
+                close(s->fd);
+        s->fd = -1;
+        free(s->path);
+        s->path = NULL;
+        u->free[u->nfree++] = slot;
+        u->inflight--;
+}
+
+static void
+slot_error(struct uring_t *u, int slot, int err)
+{
+        if (!u->r->stopped) {
+                u->r->err = err;
+                u->r->stopped = true;
+        }
+        slot_done(u, slot);
+}
+
+/* Deal with one completion */
+static void
+uring_complete(struct uring_t *u, struct io_uring_cqe *cqe)
+{
+        int slot = cqe->user_data;
+        struct uring_slot_t *s = &u->slots[slot];
+        struct read_t *r = u->r;
+
+        if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+                /* Try again */
+                if (s->fd < 0)
+                        uring_open(u, slot);
+                else
+                        uring_read(u, slot);
+                return;
+        }
+        if (cqe->res < 0) {
+                slot_error(u, slot, -cqe->res);
+                return;
+        }
+        if (r->stopped) {
+                /* Just winding down */
+                if (s->fd < 0)
+                        s->fd = cqe->res;
+                slot_done(u, slot);
+                return;
+        }
+
+        if (s->fd < 0) {
+                /*
+                 * Opened.  The inode is in memory now, so fstat() is
+                 * cheap, and then a single read gets the whole file.
+                 */
+                struct stat st;
+                size_t size = READ_CHUNK;
+
+                s->fd = cqe->res;
+                s->len = 0;
+                s->expect = SIZE_MAX;
+                if (fstat(s->fd, &st) == 0) {
+                        s->expect = st.st_size;
+                        if ((size_t)st.st_size >= size)
+                                size = st.st_size + 1;
+                }
+                if (size > s->size) {
+                        char *buf = realloc(s->buf, size);
+
+                        if (!buf) {
+                                slot_error(u, slot, ENOMEM);
+                                return;
+                        }
+                        s->buf = buf;
+                        s->size = size;
+                }
+                uring_read(u, slot);
+                return;
+        }
+
+        s->len += cqe->res;
+        /*
+         * Reads of regular files can come back short, so it's only
+         * the end at a zero-length read, or where fstat() said.
+         */
+        if (cqe->res > 0 && s->len != s->expect && s->len < s->size) {
+                uring_read(u, slot);
+                return;
+        }
+        if (cqe->res > 0 && s->len == s->size) {
+                /* Might be more */
+                char *buf = realloc(s->buf, s->size * 2);
+
+                if (!buf) {
+                        slot_error(u, slot, ENOMEM);
+                        return;
+                }
+                s->buf = buf;
+                s->size *= 2;
+                uring_read(u, slot);
+                return;
+        }
+
+        if (r->fn(s->path, s->buf, s->len, r->priv) < 0)
+                r->stopped = true;
+        slot_done(u, slot);
+}
+
+/* Handle every completion that's ready, return how many there were */
+static unsigned
+uring_reap(struct uring_t *u)
+{
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+
+        while (head != tail) {
+                struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+
+                head++;
+                __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+                uring_complete(u, &cqe);
+                n++;
+        }
+        return n;
+}
+
+/* Wait until at least one slot is free, return -1 on error */
+static int
+uring_wait_slot(struct uring_t *u)
+{
+        while (u->nfree == 0 || u->tosubmit) {
+                if (uring_enter(u, u->nfree == 0) < 0)
+                        return -1;
+                uring_reap(u);
+        }
+        return 0;
+}
+
+/* eg_dir_walk() callback: start reading @ent */
+static int
+uring_add(const struct eg_dirent_t *ent, void *priv)
+{
+        struct uring_t *u = priv;
+        int slot;
+
+        if (ent->type != DT_REG)
+                return 0;
+        /* Pick up whatever finished meanwhile */
+        uring_reap(u);
+        if (uring_wait_slot(u) < 0)
+                goto error;
+        if (u->r->stopped)
+                return -1;
+
+        slot = u->free[--u->nfree];
+        u->slots[slot].path = strdup(ent->path);
+        if (!u->slots[slot].path) {
+                u->free[u->nfree++] = slot;
+                goto error;
+        }
+        u->inflight++;
+        uring_open(u, slot);
+        if (uring_enter(u, 0) < 0)
+                goto error;
+        return 0;
+
+error:
+        if (!u->r->stopped) {
+                u->r->err = errno;
+                u->r->stopped = true;
+        }
+        return -1;
+}
+
+static int
+read_uring(const char *path, unsigned int flags, struct read_t *r)
+{
+        struct uring_t *u;
+        int res;
+
+        u = calloc(1, sizeof(*u));
+        if (!u)
+                return -1;
+        if (uring_setup(u) < 0) {
+                free(u);
+                return -1;
+        }
+        u->r = r;
+
+        /* One walk thread: the callback has to be on this one */
+        res = eg_dir_walk(path, flags & EG_RECURSIVE, 1, uring_add, u);
+        if (res < 0 && !r->stopped) {
+                r->err = errno;
+                r->stopped = true;
+        }
+        while (u->inflight) {
+                if (uring_enter(u, 1) < 0) {
+                        /* Can't wait for them, so can't free buffers */
+                        r->err = errno;
+                        r->stopped = true;
+                        return -2;
+                }
+                uring_reap(u);
+        }
+        uring_teardown(u);
+        free(u);
+        return 0;
+}
+
+#else /* !USE_URING */
+
+static int
+read_uring(const char *path, unsigned int flags, struct read_t *r)
+{
+        (void)path;
+        (void)flags;
+        (void)r;
+        errno = ENOSYS;
+        return -1;
+}
+
+#endif /* !USE_URING */
+
+/**
+ * eg_dir_foreach_data - Read every regular file under a directory
+ * @path: Directory to read
+ * @flags: EG_RECURSIVE to go into subdirectories, except hidden ones.
+ *      EG_NO_URING to use threads even if io_uring is available.
+ * @fn: Called with each file's path and contents, from one thread at a
+ *      time, in no particular order.  The contents are only valid
+ *      until @fn returns.  Return a negative number to stop.
+ * @priv: Argument to pass to @fn
+ *
+ * Files are opened and read many at a time: with io_uring where the
+ * kernel has it, otherwise on a pool of threads.  Anything that isn't
+ * a regular file is skipped, including symbolic links.
+ *
+ * Return: 0, or -1 if @fn stopped the walk or if a directory or file
+ *      couldn't be read, with errno set in that case.
+ */
+int
+eg_dir_foreach_data(const char *path, unsigned int flags, eg_data_fn fn,
+                    void *priv)
+{
+        struct read_t r;
+        int res = -1;
+
+        memset(&r, 0, sizeof(r));
+        r.fn = fn;
+        r.priv = priv;
+        pthread_mutex_init(&r.lock, NULL);
+
+        if (!(flags & EG_NO_URING))
+                res = read_uring(path, flags, &r);
+        if (res == -1) {
+                /* No io_uring, use threads */
+                res = eg_dir_walk(path, flags & EG_RECURSIVE, READ_THREADS,
+                                  read_one, &r);
+                if (res < 0 && !r.stopped) {
+                        r.err = errno;
+                        r.stopped = true;
+                }
+        }
+        pthread_mutex_destroy(&r.lock);
+
+        if (!r.stopped)
+                return 0;
+        if (r.err)
+                errno = r.err;
+        return -1;
+}
@@ -0,0 +1,733 @@
+/*
+ * eg_dir_walk.c - Walk a directory tree on several threads
+ *
+ * Each directory is opened with openat() relative to its parent's fd,
+ * so nothing depends on the working directory and no path is looked
+ * up more than one step at a time.  Entry types come from d_type, and
+ * fstatat() is only called on file systems that don't fill it in.
+ *
+ * Every thread has a deque of directories still to be read.  It pushes
+ * the subdirectories it finds onto the back of its own deque and pops
+ * from there too, so it goes depth first, close to what it just read.
+ * When its deque is empty, it steals from the front of another
+ * thread's, which gets it the biggest piece of work left over there.
+ *
+ * A directory's fd stays open until all its subdirectories have been
+ * opened, which is counted by walk_dir_t.refs.
+ *
+ * In ordered mode the workers don't call back.  They file each
+ * directory's entries in a tree of walk_node_t, and the calling thread
+ * goes through the tree depth first, waiting for each directory to be
+ * read as it gets to it.
+ */
+#include "config.h"
+#include "eg-devel.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+enum {
+        WALK_MAX_THREADS = 64,
+};
+
+/**
+ * struct walk_item_t - An entry in a directory, for ordered mode
+ * @name:       Its name
+ * @type:       DT_* type
+ * @child:      If it's a directory to walk, its entries
+ */
+struct walk_item_t {
+        char *name;
+        unsigned char type;
+        struct walk_node_t *child;
+};
+
+/**
+ * struct walk_node_t - A directory's entries, for ordered mode
+ * @items:      Entries, in readdir() order
+ * @nitems:     Number of @items
+ * @alloc:      Array length of @items
+ * @err:        errno, if the directory couldn't be read
+ * @ready:      True once the directory has been read.  Protected by
+ *              walk_t.lock
+ */
+struct walk_node_t {
+        struct walk_item_t *items;
+        size_t nitems;
+        size_t alloc;
+        int err;
+        bool ready;
+};
+
+/**
+ * struct walk_dir_t - A directory waiting to be read, or being read
+ * @parent:     The directory it's in, until it's been opened
+ * @fd:         Its fd once it's been opened, or -1
+ * @refs:       One for whoever reads it, plus one for each of its
+ *              subdirectories that hasn't been opened yet
+ * @path:       Its path, starting with the root passed to
+ *              eg_dir_walk()
+ * @name:       The last part of @path
+ * @node:       In ordered mode, where its entries go
+ */
+struct walk_dir_t {
+        struct walk_dir_t *parent;
+        int fd;
+        int refs;
+        char *path;
+        const char *name;
+        struct walk_node_t *node;
+};
+
+struct walk_deque_t {
+        pthread_mutex_t lock;
+        struct walk_dir_t **dirs;
+        size_t head;
+        size_t tail;
+        size_t alloc;
+};
+
+/**
+ * struct walk_t - State shared by the walk threads
+ * @flags:      Flags passed to eg_dir_walk()
+ * @fn:         Callback passed to eg_dir_walk()
+ * @priv:       Argument for @fn
+ * @nthreads:   Number of workers, and of @deques
+ * @deques:     One per worker
+ * @lock:       Lock for sleeping on @wake, and for walk_node_t.ready
+ * @wake:       Signalled when there might be work for an idle worker,
+ *              when the walk is over, and when a node is ready
+ * @nidle:      Number of workers waiting on @wake
+ * @pending:    Directories pushed that haven't been read yet
+ * @stop:       Set to stop the walk early
+ * @err:        errno to return, if @stop was set because of an error
+ */
+struct walk_t {
+        unsigned int flags;
+        eg_walk_fn fn;
+        void *priv;
+        int nthreads;
+        struct walk_deque_t *deques;
+
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        int nidle;
+        long pending;
+        int stop;
+        int err;
+};
+
+/**
+ * struct walk_worker_t - One walk thread
+ * @w:          Shared state
+ * @id:         Which of walk_t.deques is its own
+ * @buf:        For building paths of entries
+ * @bufsize:    Size of @buf
+ * @tid:        Thread ID
+ */
+struct walk_worker_t {
+        struct walk_t *w;
+        int id;
+        char *buf;
+        size_t bufsize;
+        pthread_t tid;
+};
+
+static void
+walk_stop(struct walk_t *w, int err)
+{
+        pthread_mutex_lock(&w->lock);
+        if (!w->stop) {
+                w->err = err;
+                __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_cond_broadcast(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+}
+
+static bool
+walk_stopped(struct walk_t *w)
+{
+        return __atomic_load_n(&w->stop, __ATOMIC_RELAXED);
+}
+
+static void
+dir_put(struct walk_dir_t *d)
+{
+        if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+        if (d->fd >= 0)
+                close(d->fd);
+        if (d->parent)
+                dir_put(d->parent);
+        free(d->path);
+        free(d);
+}
+
+/*
+ * Put @name after @len bytes of directory path in @*buf, growing it as
+ * needed.  Return the length of the result, or -1 if out of memory.
+ */
+static ssize_t
+path_join(char **buf, size_t *size, size_t len, const char *name)
+{
+        size_t nlen = strlen(name);
+        bool sep = len > 0 && (*buf)[len - 1] != '/';
+        size_t need = len + sep + nlen + 1;
+
+        if (need > *size) {
+                size_t nsize = *size ? *size : 256;
+                char *p;
+
+                while (nsize < need)
+                        nsize *= 2;
+                p = realloc(*buf, nsize);
+                if (!p)
+                        return -1;
+                *buf = p;
+                *size = nsize;
+        }
+        if (sep)
+                (*buf)[len++] = '/';
+        memcpy(*buf + len, name, nlen + 1);
+        return len + nlen;
+}
+
+/* A directory to read: @name in @parent, or the root if it's NULL */
+static struct walk_dir_t *
+dir_new(struct walk_dir_t *parent, const char *name)
+{
+        struct walk_dir_t *d = calloc(1, sizeof(*d));
+        size_t size = 0;
+        ssize_t len = 0;
+
+        if (!d)
+                return NULL;
+        if (parent)
+                len = path_join(&d->path, &size, 0, parent->path);
+        if (len >= 0)
+                len = path_join(&d->path, &size, len, name);
+        if (len < 0) {
+                free(d->path);
+                free(d);
+                return NULL;
+        }
+        d->name = d->path + len - strlen(name);
+        if (parent)
+                __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+        d->parent = parent;
+        d->fd = -1;
+        d->refs = 1;
+        return d;
+}
+
+static void
+push(struct walk_worker_t *wk, struct walk_dir_t *d)
+{
+        struct walk_t *w = wk->w;
+        struct walk_deque_t *q = &w->deques[wk->id];
+
+        __atomic_add_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&q->lock);
+        if (q->tail == q->alloc) {
+                size_t alloc = q->alloc ? q->alloc * 2 : 64;
+                struct walk_dir_t **dirs;
+
+                dirs = realloc(q->dirs, alloc * sizeof(*dirs));
+                if (!dirs) {
+                        pthread_mutex_unlock(&q->lock);
+                        __atomic_sub_fetch(&w->pending, 1,
+                                           __ATOMIC_SEQ_CST);
+                        if (d->node) {
+                                /* It will never be read, so say so */
+                                pthread_mutex_lock(&w->lock);
+                                d->node->err = ENOMEM;
+                                d->node->ready = true;
+                                pthread_mutex_unlock(&w->lock);
+                        }
+                        dir_put(d);
+                        walk_stop(w, ENOMEM);
+                        return;
+                }
+                q->dirs = dirs;
+                q->alloc = alloc;
+        }
+        q->dirs[q->tail++] = d;
+        pthread_mutex_unlock(&q->lock);
+
+        /* Pairs with the increment of nidle in get_work() */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&w->nidle, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&w->lock);
+                pthread_cond_broadcast(&w->wake);
+                pthread_mutex_unlock(&w->lock);
+        }
+}
+
+/* Take from the back of @q if @own, otherwise from the front */
+static struct walk_dir_t *
+take(struct walk_deque_t *q, bool own)
+{
+        struct walk_dir_t *d = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) {
+                d = own ? q->dirs[--q->tail] : q->dirs[q->head++];
+                if (q->head == q->tail)
+                        q->head = q->tail = 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return d;
+}
+
+static struct walk_dir_t *
+find_work(struct walk_worker_t *wk)
+{
+        struct walk_t *w = wk->w;
+        struct walk_dir_t *d;
+        int i;
+
+        d = take(&w->deques[wk->id], true);
+        for (i = 1; !d && i < w->nthreads; i++)
+                d = take(&w->deques[(wk->id + i) % w->nthreads], false);
+        return d;
+}
+
+/* Get a directory to read, or NULL when the walk is over */
+static struct walk_dir_t *
+get_work(struct walk_worker_t *wk)
+{
+        struct walk_t *w = wk->w;
+        struct walk_dir_t *d;
+
+        for (;;) {
+                if (walk_stopped(w))
+                        return NULL;
+                d = find_work(wk);
+                if (d)
+                        return d;
+
+                pthread_mutex_lock(&w->lock);
+                __atomic_add_fetch(&w->nidle, 1, __ATOMIC_SEQ_CST);
+                /* Look again, now that pushers will see us */
+                d = find_work(wk);
+                if (!d && !w->stop
+                    && __atomic_load_n(&w->pending, __ATOMIC_SEQ_CST)) {
+                        pthread_cond_wait(&w->wake, &w->lock);
+                }
+                __atomic_sub_fetch(&w->nidle, 1, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&w->lock);
+                if (d)
+                        return d;
+                if (!__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST))
+                        return NULL;
+        }
+}
+
+static unsigned char
+mode_to_type(mode_t mode)
+{
+        if (S_ISREG(mode))
+                return DT_REG;
+        if (S_ISDIR(mode))
+                return DT_DIR;
+        if (S_ISLNK(mode))
+                return DT_LNK;
+        if (S_ISFIFO(mode))
+                return DT_FIFO;
+        if (S_ISSOCK(mode))
+                return DT_SOCK;
+        if (S_ISCHR(mode))
+                return DT_CHR;
+        if (S_ISBLK(mode))
+                return DT_BLK;
+        return DT_UNKNOWN;
+}
+
+static int
+node_add(struct walk_node_t *node, const char *name, unsigned char type,
+         struct walk_node_t *child)
+{
+        struct walk_item_t *it;
+
+        if (node->nitems == node->alloc) {
+                size_t alloc = node->alloc ? node->alloc * 2 : 16;
+
+                it = realloc(node->items, alloc * sizeof(*it));
+                if (!it)
+                        return -1;
+                node->items = it;
+                node->alloc = alloc;
+        }
+        it = &node->items[node->nitems];
+        it->name = strdup(name);
+        if (!it->name)
+                return -1;
+        it->type = type;
+        it->child = child;
+        node->nitems++;
+        return 0;
+}
+
+static void
+node_free(struct walk_node_t *node)
+{
+        size_t i;
+
+        if (!node)
+                return;
+        for (i = 0; i < node->nitems; i++) {
+                free(node->items[i].name);
+                node_free(node->items[i].child);
+        }
+        free(node->items);
+        free(node);
+}
+
+/* Add subdirectory @name of @d to the walk, return -1 if out of memory */
+static int
+add_subdir(struct walk_worker_t *wk, struct walk_dir_t *d,
+           const char *name)
+{
+        struct walk_dir_t *sub;
+        struct walk_node_t *child = NULL;
+
+        sub = dir_new(d, name);
+        if (!sub)
+                return -1;
+        if (d->node) {
+                child = calloc(1, sizeof(*child));
+                if (!child || node_add(d->node, name, DT_DIR, child) < 0) {
+                        free(child);
+                        dir_put(sub);
+                        return -1;
+                }
+                sub->node = child;
+        }
+        push(wk, sub);
+        return 0;
+}
+
+/* Read directory @d, calling back or filing its entries */
+static void
+read_dir(struct walk_worker_t *wk, struct walk_dir_t *d)
+{
+        struct walk_t *w = wk->w;
+        bool recursive = !!(w->flags & EG_RECURSIVE);
+        struct eg_dirent_t ent;
+        struct dirent *de;
+        DIR *dir = NULL;
+        size_t len;
+        int fd, err = 0;
+
+        if (d->parent) {
+                d->fd = openat(d->parent->fd, d->name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                               | O_CLOEXEC);
+                dir_put(d->parent);
+                d->parent = NULL;
+        } else {
+                d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (d->fd < 0)
+                goto error;
+        /* closedir() closes its fd, and ours has to stay open */
+        fd = dup(d->fd);
+        if (fd < 0)
+                goto error;
+        dir = fdopendir(fd);
+        if (!dir) {
+                close(fd);
+                goto error;
+        }
+
+        len = strlen(d->path);
+        if (!d->node) {
+                /* Entry paths are built after this */
+                if (path_join(&wk->buf, &wk->bufsize, 0, d->path) < 0)
+                        goto enomem;
+                ent.dirfd = d->fd;
+        }
+        for (;;) {
+                unsigned char type;
+                struct stat st;
+
+                if (walk_stopped(w))
+                        goto out;
+                errno = 0;
+                de = readdir(dir);
+                if (!de) {
+                        if (errno)
+                                goto error;
+                        break;
+                }
+                if (de->d_name[0] == '.' && (de->d_name[1] == '\0'
+                    || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+                        continue;
+                }
+
+                type = de->d_type;
+                if (type == DT_UNKNOWN
+                    && fstatat(d->fd, de->d_name, &st,
+                               AT_SYMLINK_NOFOLLOW) == 0) {
+                        type = mode_to_type(st.st_mode);
+                }
+
+                if (type == DT_DIR) {
+                        /* Ignore hidden, like eg_sdir_foreach() */
+                        if (!recursive || de->d_name[0] == '.')
+                                continue;
+                        if (add_subdir(wk, d, de->d_name) < 0)
+                                goto enomem;
+                } else if (d->node) {
+                        if (node_add(d->node, de->d_name, type, NULL) < 0)
+                                goto enomem;
+                } else {
+                        ssize_t n = path_join(&wk->buf, &wk->bufsize, len,
+                                              de->d_name);
+                        if (n < 0)
+                                goto enomem;
+                        ent.path = wk->buf;
+                        ent.name = wk->buf + n - strlen(de->d_name);
+                        ent.type = type;
+                        if (w->fn(&ent, w->priv) < 0) {
+                                walk_stop(w, 0);
+                                goto out;
+                        }
+                }
+        }
+        goto out;
+
+enomem:
+        errno = ENOMEM;
+error:
+        err = errno;
+        if (d->node)
+                d->node->err = err;
+        else
+                walk_stop(w, err);
+out:
+        if (dir)
+                closedir(dir);
+        if (d->node) {
+                pthread_mutex_lock(&w->lock);
+                d->node->ready = true;
+                pthread_cond_broadcast(&w->wake);
+                pthread_mutex_unlock(&w->lock);
+        }
+        dir_put(d);
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&w->lock);
+                pthread_cond_broadcast(&w->wake);
+                pthread_mutex_unlock(&w->lock);
+        }
+}
+
+static void *
+worker(void *arg)
+{
+        struct walk_worker_t *wk = arg;
+        struct walk_dir_t *d;
+
+        while ((d = get_work(wk)) != NULL)
+                read_dir(wk, d);
+        return NULL;
+}
+
+/*
+ * Call back for @node's entries, and its subdirectories' in turn.
+ * @*buf holds the directory's path, @len bytes of it.
+ */
+static int
+consume(struct walk_t *w, struct walk_node_t *node, char **buf,
+        size_t *size, size_t len)
+{
+        struct eg_dirent_t ent;
+        size_t i;
+        ssize_t n;
+
+        pthread_mutex_lock(&w->lock);
+        while (!node->ready && !w->stop)
+                pthread_cond_wait(&w->wake, &w->lock);
+        if (!node->ready) {
+                /* Stopped with @node still queued, so it never will be */
+                errno = w->err ? w->err : ECANCELED;
+                pthread_mutex_unlock(&w->lock);
+                return -1;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        for (i = 0; i < node->nitems; i++) {
+                struct walk_item_t *it = &node->items[i];
+
+                n = path_join(buf, size, len, it->name);
+                if (n < 0) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                if (it->child) {
+                        if (consume(w, it->child, buf, size, n) < 0)
+                                return -1;
+                        node_free(it->child);
+                        it->child = NULL;
+                        continue;
+                }
+                ent.path = *buf;
+                ent.name = *buf + n - strlen(it->name);
+                ent.dirfd = -1;
+                ent.type = it->type;
+                if (w->fn(&ent, w->priv) < 0)
+                        return -1;
+        }
+        if (node->err) {
+                errno = node->err;
+                return -1;
+        }
+        return 0;
+}
+
+static int
+default_nthreads(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1)
+                return 1;
+        return n > WALK_MAX_THREADS ? WALK_MAX_THREADS : n;
+}
+
+/**
+ * eg_dir_walk - Call back for each entry under a directory, on threads
+ * @path: Directory to walk
+ * @flags: EG_RECURSIVE to go into subdirectories, except hidden ones.
+ *      EG_WALK_ORDERED to call back from this thread only, in the
+ *      order a single-threaded depth-first walk would.  Otherwise @fn
+ *      is called from all the threads at once, in no particular order.
+ * @nthreads: Number of threads, or zero for one per CPU
+ * @fn: Called for each entry that isn't a directory.  Symbolic links
+ *      are passed to @fn, never followed.  Return a negative number to
+ *      stop the walk.
+ * @priv: Argument to pass to @fn
+ *
+ * Unlike eg_sdir_foreach(), this never changes the working directory,
+ * so it can be used from threads.  The entry passed to @fn is only
+ * valid until @fn returns.  Its dirfd is -1 in ordered mode, and in
+ * ordered mode all the entries of directories that have been read but
+ * not called back for yet are kept in memory.
+ *
+ * Return: 0, or -1 if @fn stopped the walk or if a directory couldn't
+ *      be read, with errno set in that case.
+ */
+int
+eg_dir_walk(const char *path, unsigned int flags, int nthreads,
+            eg_walk_fn fn, void *priv)
+{
+        struct walk_worker_t *wk = NULL;
+        struct walk_node_t *root = NULL;
+        struct walk_dir_t *d;
+        struct walk_t w;
+        bool ordered = !!(flags & EG_WALK_ORDERED);
+        char *buf = NULL;
+        size_t size = 0;
+        int i, first, nstarted = 0, res = 0, err = 0;
+
+        if (nthreads <= 0)
+                nthreads = default_nthreads();
+        else if (nthreads > WALK_MAX_THREADS)
+                nthreads = WALK_MAX_THREADS;
+
+        memset(&w, 0, sizeof(w));
+        w.flags = flags;
+        w.fn = fn;
+        w.priv = priv;
+        w.nthreads = nthreads;
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.wake, NULL);
+        w.deques = calloc(nthreads, sizeof(*w.deques));
+        wk = calloc(nthreads, sizeof(*wk));
+        if (!w.deques || !wk)
+                goto enomem;
+        for (i = 0; i < nthreads; i++) {
+                pthread_mutex_init(&w.deques[i].lock, NULL);
+                wk[i].w = &w;
+                wk[i].id = i;
+        }
+
+        d = dir_new(NULL, path);
+        if (!d)
+                goto enomem;
+        if (ordered) {
+                root = calloc(1, sizeof(*root));
+                if (!root) {
+                        dir_put(d);
+                        goto enomem;
+                }
+                d->node = root;
+        }
+        push(&wk[0], d);
+
+        /* In unordered mode, worker 0 is this thread */
+        first = ordered ? 0 : 1;
+        for (i = first; i < nthreads; i++) {
+                if (pthread_create(&wk[i].tid, NULL, worker, &wk[i]))
+                        break;
+                nstarted++;
+        }
+        if (!ordered) {
+                worker(&wk[0]);
+        } else if (!nstarted) {
+                /* No threads, so walk it all, then call back */
+                worker(&wk[0]);
+        }
+        if (ordered) {
+                if (path_join(&buf, &size, 0, path) < 0) {
+                        errno = ENOMEM;
+                        res = -1;
+                } else {
+                        res = consume(&w, root, &buf, &size, strlen(buf));
+                }
+                if (res < 0) {
+                        err = errno;
+                        walk_stop(&w, err);
+                }
+        }
+        for (i = first; i < first + nstarted; i++)
+                pthread_join(wk[i].tid, NULL);
+
+        if (!ordered && w.stop) {
+                res = -1;
+                err = w.err;
+        }
+        goto out;
+
+enomem:
+        err = ENOMEM;
+        res = -1;
+out:
+        if (w.deques) {
+                for (i = 0; i < nthreads; i++) {
+                        while ((d = take(&w.deques[i], true)) != NULL)
+                                dir_put(d);
+                        free(w.deques[i].dirs);
+                        pthread_mutex_destroy(&w.deques[i].lock);
+                }
+        }
+        if (wk) {
+                for (i = 0; i < nthreads; i++)
+                        free(wk[i].buf);
+        }
+        node_free(root);
+        free(buf);
+        free(wk);
+        free(w.deques);
+        pthread_cond_destroy(&w.wake);
+        pthread_mutex_destroy(&w.lock);
+        if (err)
+                errno = err;
+        return res;
+}
@@ -1,33 +1,261 @@
+/*
+ * eg_fletcher32.c - Fletcher-32 checksum of 16-bit words
+ *
+ * For a block of n words w[0..n-1], sum1 gains the sum of the words
+ * and sum2 gains n * sum1 plus the sum of (n - i) * w[i].  So a block
+ * can be summed any way at all, as long as each word's weight comes
+ * out right at the end, the same trick as SIMD Adler-32.
+ *
+ * The vector versions keep a 32-bit sum of the words in each lane,
+ * and a sum of those sums taken after every step, and turn those into
+ * weighted sums once per block.  Blocks are as long as the lanes can
+ * go without overflowing.  Without SSE2, sums are 64 bits wide, so
+ * they only have to be reduced every million words or so.
+ */
 #include "eg-devel.h"
+#include <string.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
-uint32_t
-eg_fletcher32(uint16_t *data, size_t len)
-{
-        uint32_t sum1 = 0xffff, sum2 = 0xffff;
-
-        while (len) {
-                /*
-                 * 360 additions are the most that can be performed
-                 * before having to take into account the modulo.
-                 */
-                unsigned tlen = len > 360 ? 360 : len;
-                len -= tlen;
-                do {
-                        sum1 += *data++;
-                        sum2 += sum1;
-                } while (--tlen);
-
-                /*
-                 * The modulo 0xFFFF can be performed by adding the
-                 * carryouts from a standard (modulo 0x10000) addition
-                 * back into the lower halfword.
-                 */
-                sum1 = (sum1 & 0xffff) + (sum1 >> 16);
-                sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+#define FLETCHER_MOD 65535
+
+/*
+ * Steps per vector block: after k steps, a lane of the second sum can
+ * hold 65535 * k * (k + 1) / 2, which has to fit in 32 bits
+ */
+#define FLETCHER_VEC_BLOCK 360
+
+/* Words per scalar block, so that sum2 fits in 64 bits */
+#define FLETCHER_WIDE_BLOCK (1U << 20)
+
+static inline uint32_t
+get_word(const unsigned char *p)
+{
+        uint16_t w;
+
+        memcpy(&w, p, sizeof(w));
+        return w;
+}
+
+/* Add @n words at @p to reduced sums *@s1 and *@s2, and reduce them */
+static void
+sum_scalar(uint32_t *s1, uint32_t *s2, const unsigned char *p, size_t n)
+{
+        uint64_t a = *s1, b = *s2;
+
+        while (n) {
+                size_t k = n > FLETCHER_WIDE_BLOCK ? FLETCHER_WIDE_BLOCK : n;
+
+                n -= k;
+                for (; k >= 4; k -= 4, p += 8) {
+                        a += get_word(p);
+                        b += a;
+                        a += get_word(p + 2);
+                        b += a;
+                        a += get_word(p + 4);
+                        b += a;
+                        a += get_word(p + 6);
+                        b += a;
+                }
+                for (; k; k--, p += 2) {
+                        a += get_word(p);
+                        b += a;
+                }
+                a %= FLETCHER_MOD;
+                b %= FLETCHER_MOD;
+        }
+        *s1 = a;
+        *s2 = b;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/*
+ * Fold one vector block of @k steps into the sums.  @l1 and @l2 are
+ * the lanes' sums and sums of sums, and @pos says which word of a
+ * step each lane has.
+ */
+static void
+fold_lanes(uint64_t *a, uint64_t *b, const uint32_t *l1, const uint32_t *l2,
+           const unsigned char *pos, unsigned int nlanes, size_t k)
+{
+        unsigned int i;
+
+        /* A word in lane j of step t has weight nlanes * (k - t) - j */
+        *b += nlanes * k * *a;
+        for (i = 0; i < nlanes; i++) {
+                *a += l1[i];
+                *b += (uint64_t)nlanes * l2[i] - (uint64_t)pos[i] * l1[i];
+        }
+        *a %= FLETCHER_MOD;
+        *b %= FLETCHER_MOD;
+}
+#endif
+
+#if defined(__AVX2__)
+/* unpack{lo,hi}_epi16 work within 128-bit halves */
+static const unsigned char lane_pos[16] = {
+        0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15,
+};
+
+static void
+sum_words(uint32_t *s1, uint32_t *s2, const unsigned char *p, size_t n)
+{
+        const __m256i zero = _mm256_setzero_si256();
+        uint64_t a = *s1, b = *s2;
+        uint32_t l1[16], l2[16];
+
+        while (n >= 16) {
+                size_t t, k = n / 16;
+                __m256i lo1 = zero, hi1 = zero, lo2 = zero, hi2 = zero;
+
+                if (k > FLETCHER_VEC_BLOCK)
+                        k = FLETCHER_VEC_BLOCK;
+                for (t = 0; t < k; t++, p += 32) {
+                        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+                        lo1 = _mm256_add_epi32(lo1,
+                                               _mm256_unpacklo_epi16(v, zero));
+                        hi1 = _mm256_add_epi32(hi1,
+                                               _mm256_unpackhi_epi16(v, zero));
+                        lo2 = _mm256_add_epi32(lo2, lo1);
+                        hi2 = _mm256_add_epi32(hi2, hi1);
+                }
+                _mm256_storeu_si256((__m256i *)l1, lo1);
+                _mm256_storeu_si256((__m256i *)(l1 + 8), hi1);
+                _mm256_storeu_si256((__m256i *)l2, lo2);
+                _mm256_storeu_si256((__m256i *)(l2 + 8), hi2);
+                fold_lanes(&a, &b, l1, l2, lane_pos, 16, k);
+                n -= k * 16;
+        }
+        *s1 = a;
+        *s2 = b;
+        sum_scalar(s1, s2, p, n);
+}
+#elif defined(__SSE2__)
+static const unsigned char lane_pos[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+static void
+sum_words(uint32_t *s1, uint32_t *s2, const unsigned char *p, size_t n)
+{
+        const __m128i zero = _mm_setzero_si128();
+        uint64_t a = *s1, b = *s2;
+        uint32_t l1[8], l2[8];
+
+        while (n >= 8) {
+                size_t t, k = n / 8;
+                __m128i lo1 = zero, hi1 = zero, lo2 = zero, hi2 = zero;
+
+                if (k > FLETCHER_VEC_BLOCK)
+                        k = FLETCHER_VEC_BLOCK;
+                for (t = 0; t < k; t++, p += 16) {
+                        __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+                        lo1 = _mm_add_epi32(lo1, _mm_unpacklo_epi16(v, zero));
+                        hi1 = _mm_add_epi32(hi1, _mm_unpackhi_epi16(v, zero));
+                        lo2 = _mm_add_epi32(lo2, lo1);
+                        hi2 = _mm_add_epi32(hi2, hi1);
+                }
+                _mm_storeu_si128((__m128i *)l1, lo1);
+                _mm_storeu_si128((__m128i *)(l1 + 4), hi1);
+                _mm_storeu_si128((__m128i *)l2, lo2);
+                _mm_storeu_si128((__m128i *)(l2 + 4), hi2);
+                fold_lanes(&a, &b, l1, l2, lane_pos, 8, k);
+                n -= k * 8;
+        }
+        *s1 = a;
+        *s2 = b;
+        sum_scalar(s1, s2, p, n);
+}
+#else
+# define sum_words sum_scalar
+#endif
+
+/**
+ * eg_fletcher32_init - Start a checksum of data that comes in pieces
+ * @f: Context to set up
+ */
+void
+eg_fletcher32_init(struct eg_fletcher32_t *f)
+{
+        /* Zero is 0xffff, where eg_fletcher32() starts, modulo 65535 */
+        f->sum1 = 0;
+        f->sum2 = 0;
+        f->odd = 0;
+        f->have_odd = 0;
+}
+
+/**
+ * eg_fletcher32_update - Add more data to a checksum
+ * @f: Context from eg_fletcher32_init()
+ * @data: Next bytes of data, read as native-order 16-bit words
+ * @len: Number of bytes at @data, which can be odd
+ *
+ * An odd byte at the end is kept, to be the first half of the next
+ * word.
+ */
+void
+eg_fletcher32_update(struct eg_fletcher32_t *f, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+
+        if (!len)
+                return;
+        if (f->have_odd) {
+                unsigned char w[2] = { f->odd, p[0] };
+
+                sum_scalar(&f->sum1, &f->sum2, w, 1);
+                f->have_odd = 0;
+                p++;
+                len--;
+        }
+        sum_words(&f->sum1, &f->sum2, p, len / 2);
+        if (len & 1) {
+                f->odd = p[len - 1];
+                f->have_odd = 1;
         }
-        /* Second reduction step to reduce sums to 16 bits */
-        sum1 = (sum1 & 0xffff) + (sum1 >> 16);
-        sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+}
+
+/**
+ * eg_fletcher32_final - Finish a checksum
+ * @f: Context from eg_fletcher32_init()
+ *
+ * An odd byte left over is padded with a zero byte to make a word.
+ *
+ * Return: What eg_fletcher32() would have for the same data
+ */
+uint32_t
+eg_fletcher32_final(struct eg_fletcher32_t *f)
+{
+        uint32_t sum1, sum2;
+
+        if (f->have_odd) {
+                unsigned char w[2] = { f->odd, 0 };
 
+                sum_scalar(&f->sum1, &f->sum2, w, 1);
+                f->have_odd = 0;
+        }
+        /* Same as the end-around carry: never zero, 0xffff instead */
+        sum1 = f->sum1 ? f->sum1 : 0xffff;
+        sum2 = f->sum2 ? f->sum2 : 0xffff;
         return (sum2 << 16) | sum1;
 }
+
+/**
+ * eg_fletcher32 - Fletcher-32 checksum
+ * @data: Words to sum
+ * @len: Number of words, not bytes
+ *
+ * Both sums start at 0xffff.
+ */
+uint32_t
+eg_fletcher32(const uint16_t *data, size_t len)
+{
+        struct eg_fletcher32_t f;
+
+        eg_fletcher32_init(&f);
+        sum_words(&f.sum1, &f.sum2, (const unsigned char *)data, len);
+        return eg_fletcher32_final(&f);
+}
@@ -0,0 +1,872 @@
+/*
+ * eg_walk_cache.c - Find new files under a directory, again and again
+ *
+ * The cache is a tree of the directories under the root.  Each node
+ * has the directory's inode and mtime, and the names and inodes of its
+ * files and subdirectories, sorted by name.  Adding, removing or
+ * renaming an entry changes a directory's mtime, so a rescan only
+ * has to stat() each directory, and it only reads the ones whose
+ * mtime changed.  A file whose name (or inode, under that name) isn't
+ * in its directory's node yet is new.
+ *
+ * With EG_WALK_WATCH, each directory also has an inotify watch, and a
+ * rescan only reads directories that had events, without calling
+ * stat() on the rest.  If the event queue overflows, or a watch can't
+ * be added, the next scan goes back to checking mtimes.
+ *
+ * The tree can be saved to a file and loaded by the next process that
+ * scans the same root.
+ */
+#include "config.h"
+#include "eg-devel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#define WCACHE_MAGIC    0x48434357      /* "WCCH" */
+#define WCACHE_VERSION  2
+
+#define WCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+                       | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF \
+                       | IN_ONLYDIR)
+
+struct wcache_file_t {
+        char *name;
+        uint64_t ino;
+};
+
+/**
+ * struct wcache_dir_t - What we know about one directory
+ * @name:       Its name in its parent, or the root's path
+ * @dev:        Device and inode it had when it was last read
+ * @ino:        See @dev
+ * @dino:       Inode its parent's readdir() gave for it.  That's the
+ *              one to compare readdir() with: for a mount point, it's
+ *              the inode under the mount, not @ino.
+ * @mtime_sec:  Its mtime when it was last read, or zero to read it
+ *              again next time
+ * @mtime_nsec: See @mtime_sec
+ * @files:      Everything in it but subdirectories, sorted by name
+ * @nfiles:     Number of @files
+ * @subdirs:    Subdirectories we walk into, sorted by name
+ * @nsubdirs:   Number of @subdirs
+ * @wd:         Its inotify watch, or -1
+ * @dirty:      There were inotify events for it since it was read
+ * @fresh:      It's never been read
+ */
+struct wcache_dir_t {
+        char *name;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t dino;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        struct wcache_file_t *files;
+        size_t nfiles;
+        struct wcache_dir_t **subdirs;
+        size_t nsubdirs;
+        int wd;
+        bool dirty;
+        bool fresh;
+};
+
+/**
+ * struct eg_walk_cache_t - A cached tree, see eg_walk_cache_open()
+ * @path:       Cache file, or NULL
+ * @flags:      EG_RECURSIVE, EG_WALK_WATCH
+ * @root:       The tree
+ * @ifd:        inotify fd, or -1 if we're not watching
+ * @bywd:       Directory for each watch descriptor
+ * @nbywd:      Array length of @bywd
+ * @overflow:   Some events were lost, so check everything's mtime
+ * @since:      When the current scan started, for racy mtimes
+ * @fn:         Callback for the current scan
+ * @priv:       Argument for @fn
+ * @buf:        Path of the directory being scanned
+ * @bufsize:    Size of @buf
+ */
+struct eg_walk_cache_t {
+        char *path;
+        unsigned int flags;
+        struct wcache_dir_t *root;
+        int ifd;
+        struct wcache_dir_t **bywd;
+        int nbywd;
+        bool overflow;
+        time_t since;
+        int (*fn)(const char *, void *);
+        void *priv;
+        char *buf;
+        size_t bufsize;
+};
+
+static struct wcache_dir_t *
+dir_new(const char *name)
+{
+        struct wcache_dir_t *d = calloc(1, sizeof(*d));
+
+        if (!d)
+                return NULL;
+        d->name = strdup(name);
+        if (!d->name) {
+                free(d);
+                return NULL;
+        }
+        d->wd = -1;
+        d->fresh = true;
+        return d;
+}
+
+static void
+unwatch(struct eg_walk_cache_t *c, struct wcache_dir_t *d)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+        if (d->wd < 0)
+                return;
+        if (d->wd < c->nbywd && c->bywd[d->wd] == d) {
+                c->bywd[d->wd] = NULL;
+                if (c->ifd >= 0)
+                        inotify_rm_watch(c->ifd, d->wd);
+        }
+        d->wd = -1;
+#endif
+}
+
+static void
+files_free(struct wcache_file_t *files, size_t n)
+{
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                free(files[i].name);
+        free(files);
+}
+
+static void
+dir_free(struct eg_walk_cache_t *c, struct wcache_dir_t *d)
+{
+        size_t i;
+
+        if (!d)
+                return;
+        unwatch(c, d);
+        for (i = 0; i < d->nsubdirs; i++)
+                dir_free(c, d->subdirs[i]);
+        free(d->subdirs);
+        files_free(d->files, d->nfiles);
+        free(d->name);
+        free(d);
+}
+
+static void
+stop_watching(struct eg_walk_cache_t *c)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+        int i;
+
+        if (c->ifd < 0)
+                return;
+        for (i = 0; i < c->nbywd; i++) {
+                if (c->bywd[i])
+                        c->bywd[i]->wd = -1;
+        }
+        free(c->bywd);
+        c->bywd = NULL;
+        c->nbywd = 0;
+        close(c->ifd);
+        c->ifd = -1;
+#endif
+}
+
+/* Watch @d at @path, or give up on watching if we can't */
+static void
+watch(struct eg_walk_cache_t *c, struct wcache_dir_t *d, const char *path)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+        int wd;
+
+        if (c->ifd < 0 || d->wd >= 0)
+                return;
+        wd = inotify_add_watch(c->ifd, path, WCACHE_EVENTS);
+        if (wd < 0) {
+                /* Gone, or unreadable: read_dir() will see */
+                if (errno != ENOSPC && errno != ENOMEM)
+                        return;
+                /* Out of watches; mtimes will do */
+                stop_watching(c);
+                c->overflow = true;
+                return;
+        }
+        if (wd >= c->nbywd) {
+                int n = c->nbywd ? c->nbywd : 64;
+                struct wcache_dir_t **bywd;
+
+                while (n <= wd)
+                        n *= 2;
+                bywd = realloc(c->bywd, n * sizeof(*bywd));
+                if (!bywd) {
+                        inotify_rm_watch(c->ifd, wd);
+                        stop_watching(c);
+                        c->overflow = true;
+                        return;
+                }
+                memset(bywd + c->nbywd, 0,
+                       (n - c->nbywd) * sizeof(*bywd));
+                c->bywd = bywd;
+                c->nbywd = n;
+        }
+        c->bywd[wd] = d;
+        d->wd = wd;
+#else
+        (void)c;
+        (void)d;
+        (void)path;
+#endif
+}
+
+/* Mark the directories that have had events since the last scan */
+static void
+read_events(struct eg_walk_cache_t *c)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+        char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        ssize_t n;
+        char *p;
+
+        if (c->ifd < 0)
+                return;
+        while ((n = read(c->ifd, buf, sizeof(buf))) > 0) {
+                for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                c->overflow = true;
+                                continue;
+                        }
+                        if (ev->wd < 0 || ev->wd >= c->nbywd
+                            || !c->bywd[ev->wd]) {
+                                continue;
+                        }
+                        c->bywd[ev->wd]->dirty = true;
+                        if (ev->mask & IN_IGNORED) {
+                                /* The kernel dropped the watch */
+                                c->bywd[ev->wd]->wd = -1;
+                                c->bywd[ev->wd] = NULL;
+                        }
+                }
+        }
+#else
+        (void)c;
+#endif
+}
+
+static int
+cmp_file(const void *a, const void *b)
+{
+        return strcmp(((const struct wcache_file_t *)a)->name,
+                      ((const struct wcache_file_t *)b)->name);
+}
+
+static int
+cmp_dir(const void *a, const void *b)
+{
+        return strcmp((*(struct wcache_dir_t *const *)a)->name,
+                      (*(struct wcache_dir_t *const *)b)->name);
+}
+
+static struct wcache_file_t *
+find_file(struct wcache_dir_t *d, const char *name)
+{
+        struct wcache_file_t key;
+
+        if (!d->nfiles)
+                return NULL;
+        key.name = (char *)name;
+        return bsearch(&key, d->files, d->nfiles, sizeof(key), cmp_file);
+}
+
+static struct wcache_dir_t *
+find_subdir_in(struct wcache_dir_t **subdirs, size_t n, const char *name)
+{
+        struct wcache_dir_t key, *kp = &key, **res;
+
+        if (!n)
+                return NULL;
+        key.name = (char *)name;
+        res = bsearch(&kp, subdirs, n, sizeof(kp), cmp_dir);
+        return res ? *res : NULL;
+}
+
+static struct wcache_dir_t *
+find_subdir(struct wcache_dir_t *d, const char *name)
+{
+        return find_subdir_in(d->subdirs, d->nsubdirs, name);
+}
+
+/* Is @sub already one of @d's subdirectories? */
+static bool
+is_subdir(struct wcache_dir_t *d, struct wcache_dir_t *sub)
+{
+        return find_subdir(d, sub->name) == sub;
+}
+
+/* Put @name after @len bytes of directory path in c->buf */
+static ssize_t
+path_join(struct eg_walk_cache_t *c, size_t len, const char *name)
+{
+        size_t nlen = strlen(name);
+        bool sep = len > 0 && c->buf[len - 1] != '/';
+        size_t need = len + sep + nlen + 1;
+
+        if (need > c->bufsize) {
+                size_t size = c->bufsize ? c->bufsize : 256;
+                char *p;
+
+                while (size < need)
+                        size *= 2;
+                p = realloc(c->buf, size);
+                if (!p)
+                        return -1;
+                c->buf = p;
+                c->bufsize = size;
+        }
+        if (sep)
+                c->buf[len++] = '/';
+        memcpy(c->buf + len, name, nlen + 1);
+        return len + nlen;
+}
+
+struct wcache_list_t {
+        struct wcache_file_t *files;
+        size_t nfiles;
+        size_t files_alloc;
+        struct wcache_dir_t **subdirs;
+        size_t nsubdirs;
+        size_t subdirs_alloc;
+};
+
+static int
+list_add_file(struct wcache_list_t *l, const char *name, uint64_t ino)
+{
+        if (l->nfiles == l->files_alloc) {
+                size_t n = l->files_alloc ? l->files_alloc * 2 : 16;
+                struct wcache_file_t *p;
+
+                p = realloc(l->files, n * sizeof(*p));
+                if (!p)
+                        return -1;
+                l->files = p;
+                l->files_alloc = n;
+        }
+        l->files[l->nfiles].name = strdup(name);
+        if (!l->files[l->nfiles].name)
+                return -1;
+        l->files[l->nfiles++].ino = ino;
+        return 0;
+}
+
+static int
+list_add_subdir(struct wcache_list_t *l, struct wcache_dir_t *d)
+{
+        if (l->nsubdirs == l->subdirs_alloc) {
+                size_t n = l->subdirs_alloc ? l->subdirs_alloc * 2 : 16;
+                struct wcache_dir_t **p;
+
+                p = realloc(l->subdirs, n * sizeof(*p));
+                if (!p)
+                        return -1;
+                l->subdirs = p;
+                l->subdirs_alloc = n;
+        }
+        l->subdirs[l->nsubdirs++] = d;
+        return 0;
+}
+
+/*
+ * Read directory @d, at c->buf, and call back for files that weren't
+ * in it last time.  Return -1 on error or if the callback says to
+ * stop, or 1 if the directory has gone away.
+ */
+static int
+read_dir(struct eg_walk_cache_t *c, struct wcache_dir_t *d, size_t len)
+{
+        bool recursive = !!(c->flags & EG_RECURSIVE);
+        struct wcache_list_t l;
+        struct dirent *de;
+        struct stat st;
+        size_t i;
+        DIR *dir;
+        int ret = -1;
+
+        memset(&l, 0, sizeof(l));
+        /* Watch before reading, so nothing falls in between */
+        watch(c, d, c->buf);
+        dir = opendir(c->buf);
+        if (!dir) {
+                if (errno == ENOENT || errno == ENOTDIR)
+                        return 1;
+                return -1;
+        }
+        if (fstat(dirfd(dir), &st) < 0)
+                goto out;
+
+        for (;;) {
+                struct wcache_dir_t *sub;
+                unsigned char type;
+                struct stat est;
+
+                errno = 0;
+                de = readdir(dir);
+                if (!de) {
+                        if (errno)
+                                goto out;
+                        break;
+                }
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                type = de->d_type;
+                if (type == DT_UNKNOWN) {
+                        if (fstatat(dirfd(dir), de->d_name, &est,
+                                    AT_SYMLINK_NOFOLLOW) < 0) {
+                                continue;
+                        }
+                        type = S_ISDIR(est.st_mode) ? DT_DIR : DT_REG;
+                }
+
+                if (type != DT_DIR) {
+                        if (list_add_file(&l, de->d_name, de->d_ino) < 0)
+                                goto out;
+                        continue;
+                }
+                /* Ignore hidden, like eg_sdir_foreach() */
+                if (!recursive || de->d_name[0] == '.')
+                        continue;
+                /* Keep what we know, unless it's a different directory */
+                sub = find_subdir(d, de->d_name);
+                if (!sub || sub->dino != de->d_ino) {
+                        sub = dir_new(de->d_name);
+                        if (!sub)
+                                goto out;
+                        sub->dino = de->d_ino;
+                }
+                if (list_add_subdir(&l, sub) < 0) {
+                        if (!is_subdir(d, sub))
+                                dir_free(c, sub);
+                        goto out;
+                }
+        }
+
+        if (l.nfiles)
+                qsort(l.files, l.nfiles, sizeof(*l.files), cmp_file);
+        if (l.nsubdirs)
+                qsort(l.subdirs, l.nsubdirs, sizeof(*l.subdirs), cmp_dir);
+
+        for (i = 0; i < l.nfiles; i++) {
+                struct wcache_file_t *old = find_file(d, l.files[i].name);
+
+                if (old && old->ino == l.files[i].ino)
+                        continue;
+                if (path_join(c, len, l.files[i].name) < 0)
+                        goto out;
+                if (c->fn(c->buf, c->priv) < 0) {
+                        /* Do it all again next time */
+                        c->buf[len] = '\0';
+                        d->mtime_sec = 0;
+                        d->dirty = true;
+                        goto out;
+                }
+        }
+        c->buf[len] = '\0';
+
+        /* Drop the subdirectories that have gone */
+        for (i = 0; i < d->nsubdirs; i++) {
+                if (find_subdir_in(l.subdirs, l.nsubdirs,
+                                   d->subdirs[i]->name) != d->subdirs[i])
+                        dir_free(c, d->subdirs[i]);
+        }
+        free(d->subdirs);
+        d->subdirs = l.subdirs;
+        d->nsubdirs = l.nsubdirs;
+        l.subdirs = NULL;
+        l.nsubdirs = 0;
+        files_free(d->files, d->nfiles);
+        d->files = l.files;
+        d->nfiles = l.nfiles;
+        l.files = NULL;
+        l.nfiles = 0;
+
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->mtime_sec = st.st_mtim.tv_sec;
+        d->mtime_nsec = st.st_mtim.tv_nsec;
+        /*
+         * If it changed in the same second as this scan, it might
+         * change again without its mtime moving.  Read it next time.
+         */
+        if (st.st_mtim.tv_sec >= c->since - 1)
+                d->mtime_sec = 0;
+        d->fresh = false;
+        ret = 0;
+
+out:
+        closedir(dir);
+        files_free(l.files, l.nfiles);
+        /* Failed: free the new ones, the old ones are still in @d */
+        for (i = 0; i < l.nsubdirs; i++) {
+                if (!is_subdir(d, l.subdirs[i]))
+                        dir_free(c, l.subdirs[i]);
+        }
+        free(l.subdirs);
+        return ret;
+}
+
+/* Scan @d, at c->buf, which is @len long, and everything under it */
+static int
+scan_dir(struct eg_walk_cache_t *c, struct wcache_dir_t *d, size_t len)
+{
+        bool changed = d->fresh || d->mtime_sec == 0;
+        struct stat st;
+        size_t i;
+        ssize_t n;
+        int res;
+
+        if (!changed && (c->ifd < 0 || d->wd < 0 || c->overflow)) {
+                /* No events to go by, so look at its mtime */
+                watch(c, d, c->buf);
+                if (stat(c->buf, &st) < 0)
+                        return errno == ENOENT || errno == ENOTDIR ? 1 : -1;
+                changed = (uint64_t)st.st_dev != d->dev
+                          || (uint64_t)st.st_ino != d->ino
+                          || st.st_mtim.tv_sec != d->mtime_sec
+                          || st.st_mtim.tv_nsec != d->mtime_nsec;
+        }
+        if (changed || d->dirty) {
+                d->dirty = false;
+                res = read_dir(c, d, len);
+                if (res != 0)
+                        return res;
+        }
+
+        for (i = 0; i < d->nsubdirs; i++) {
+                n = path_join(c, len, d->subdirs[i]->name);
+                if (n < 0)
+                        return -1;
+                res = scan_dir(c, d->subdirs[i], n);
+                c->buf[len] = '\0';
+                if (res < 0)
+                        return -1;
+                if (res > 0) {
+                        /* Gone; read the parent again next time */
+                        d->mtime_sec = 0;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Saving and loading.  Native byte order: the cache belongs to the
+ * machine that made it.  Directories are written depth first, each
+ * followed by its files and then its subdirectories.
+ */
+
+static bool
+put_str(FILE *fp, const char *s)
+{
+        uint32_t len = strlen(s);
+
+        return fwrite(&len, sizeof(len), 1, fp) == 1
+               && fwrite(s, 1, len, fp) == len;
+}
+
+static char *
+get_str(FILE *fp)
+{
+        uint32_t len;
+        char *s;
+
+        if (fread(&len, sizeof(len), 1, fp) != 1 || len > 65536)
+                return NULL;
+        s = malloc(len + 1);
+        if (!s)
+                return NULL;
+        if (fread(s, 1, len, fp) != len) {
+                free(s);
+                return NULL;
+        }
+        s[len] = '\0';
+        return s;
+}
+
+struct wcache_rec_t {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t dino;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        uint64_t nfiles;
+        uint64_t nsubdirs;
+};
+
+static bool
+save_dir(FILE *fp, const struct wcache_dir_t *d)
+{
+        struct wcache_rec_t rec;
+        size_t i;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.dev = d->dev;
+        rec.ino = d->ino;
+        rec.dino = d->dino;
+        /* If it was never read properly, read it next time */
+        rec.mtime_sec = d->fresh || d->dirty ? 0 : d->mtime_sec;
+        rec.mtime_nsec = d->mtime_nsec;
+        rec.nfiles = d->nfiles;
+        rec.nsubdirs = d->nsubdirs;
+        if (!put_str(fp, d->name) || fwrite(&rec, sizeof(rec), 1, fp) != 1)
+                return false;
+        for (i = 0; i < d->nfiles; i++) {
+                if (!put_str(fp, d->files[i].name)
+                    || fwrite(&d->files[i].ino, sizeof(uint64_t), 1, fp)
+                       != 1) {
+                        return false;
+                }
+        }
+        for (i = 0; i < d->nsubdirs; i++) {
+                if (!save_dir(fp, d->subdirs[i]))
+                        return false;
+        }
+        return true;
+}
+
+static struct wcache_dir_t *
+load_dir(struct eg_walk_cache_t *c, FILE *fp, int depth)
+{
+        struct wcache_rec_t rec;
+        struct wcache_dir_t *d;
+        char *name;
+        size_t i;
+
+        if (depth > 4096)
+                return NULL;
+        name = get_str(fp);
+        if (!name)
+                return NULL;
+        d = dir_new(name);
+        free(name);
+        if (!d)
+                return NULL;
+        if (fread(&rec, sizeof(rec), 1, fp) != 1
+            || rec.nfiles > 1 << 28 || rec.nsubdirs > 1 << 28) {
+                goto error;
+        }
+        d->dev = rec.dev;
+        d->ino = rec.ino;
+        d->dino = rec.dino;
+        d->mtime_sec = rec.mtime_sec;
+        d->mtime_nsec = rec.mtime_nsec;
+        d->fresh = false;
+
+        d->files = calloc(rec.nfiles ? rec.nfiles : 1, sizeof(*d->files));
+        d->subdirs = calloc(rec.nsubdirs ? rec.nsubdirs : 1,
+                            sizeof(*d->subdirs));
+        if (!d->files || !d->subdirs)
+                goto error;
+        for (i = 0; i < rec.nfiles; i++) {
+                d->files[i].name = get_str(fp);
+                if (!d->files[i].name)
+                        goto error;
+                d->nfiles++;
+                if (fread(&d->files[i].ino, sizeof(uint64_t), 1, fp) != 1)
+                        goto error;
+        }
+        for (i = 0; i < rec.nsubdirs; i++) {
+                d->subdirs[i] = load_dir(c, fp, depth + 1);
+                if (!d->subdirs[i])
+                        goto error;
+                d->nsubdirs++;
+        }
+        /* Don't trust the file to be sorted, find_*() need it */
+        qsort(d->files, d->nfiles, sizeof(*d->files), cmp_file);
+        qsort(d->subdirs, d->nsubdirs, sizeof(*d->subdirs), cmp_dir);
+        return d;
+
+error:
+        dir_free(c, d);
+        return NULL;
+}
+
+/* Load c->path if it's a cache of @root, otherwise start afresh */
+static void
+load(struct eg_walk_cache_t *c, const char *root)
+{
+        uint32_t hdr[2];
+        struct wcache_dir_t *d = NULL;
+        FILE *fp;
+
+        fp = fopen(c->path, "rb");
+        if (!fp)
+                return;
+        if (fread(hdr, sizeof(hdr), 1, fp) == 1 && hdr[0] == WCACHE_MAGIC
+            && hdr[1] == WCACHE_VERSION) {
+                d = load_dir(c, fp, 0);
+                if (d && strcmp(d->name, root) != 0) {
+                        dir_free(c, d);
+                        d = NULL;
+                }
+        }
+        fclose(fp);
+        if (d) {
+                dir_free(c, c->root);
+                c->root = d;
+        }
+}
+
+/**
+ * eg_walk_cache_open - Start a cache of the files under a directory
+ * @root: Directory to scan
+ * @path: File to load the cache from, if it's there and it's for
+ *      @root, and to save it to.  NULL to keep it in memory only.
+ * @flags: EG_RECURSIVE to go into subdirectories, except hidden ones.
+ *      EG_WALK_WATCH to use inotify between scans, while the cache is
+ *      open.
+ *
+ * Return: The cache, or NULL if out of memory
+ */
+struct eg_walk_cache_t *
+eg_walk_cache_open(const char *root, const char *path, unsigned int flags)
+{
+        struct eg_walk_cache_t *c = calloc(1, sizeof(*c));
+
+        if (!c)
+                return NULL;
+        c->flags = flags;
+        c->ifd = -1;
+        c->root = dir_new(root);
+        if (!c->root)
+                goto enomem;
+        if (path) {
+                c->path = strdup(path);
+                if (!c->path)
+                        goto enomem;
+                load(c, root);
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        if (!!(flags & EG_WALK_WATCH))
+                c->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        return c;
+
+enomem:
+        eg_walk_cache_close(c);
+        return NULL;
+}
+
+/**
+ * eg_walk_cache_scan - Call back for each file that's new since last time
+ * @c: Cache from eg_walk_cache_open()
+ * @fn: Called with the path of each new file, and @priv.  Return a
+ *      negative number to stop.
+ * @priv: Argument to pass to @fn
+ *
+ * The first scan of a new cache calls back for every file.  After that,
+ * a file is new if its name wasn't in its directory at the last scan,
+ * or it was but with another inode.  Changes to files that were there
+ * already don't count.  If @fn stops the scan, the files it was called
+ * for in the same directory may be called for again on the next scan.
+ *
+ * Return: 0, or -1 if @fn stopped the scan or the root couldn't be
+ *      read, with errno set in that case
+ */
+int
+eg_walk_cache_scan(struct eg_walk_cache_t *c,
+                   int (*fn)(const char *, void *), void *priv)
+{
+        ssize_t len;
+        int res;
+
+        c->fn = fn;
+        c->priv = priv;
+        c->since = time(NULL);
+        read_events(c);
+        len = path_join(c, 0, c->root->name);
+        if (len < 0)
+                return -1;
+        res = scan_dir(c, c->root, len);
+        if (res > 0) {
+                /* The root itself is gone */
+                errno = ENOENT;
+                res = -1;
+        }
+        if (res == 0)
+                c->overflow = false;
+        return res;
+}
+
+/* Save @c to the file it was opened with, return -1 on error */
+int
+eg_walk_cache_save(struct eg_walk_cache_t *c)
+{
+        uint32_t hdr[2] = { WCACHE_MAGIC, WCACHE_VERSION };
+        char *tmp;
+        FILE *fp;
+        int fd, err;
+
+        if (!c->path) {
+                errno = EINVAL;
+                return -1;
+        }
+        tmp = malloc(strlen(c->path) + 8);
+        if (!tmp)
+                return -1;
+        sprintf(tmp, "%s.XXXXXX", c->path);
+        fd = mkstemp(tmp);
+        if (fd < 0)
+                goto error;
+        fp = fdopen(fd, "wb");
+        if (!fp) {
+                close(fd);
+                goto error_unlink;
+        }
+        if (fwrite(hdr, sizeof(hdr), 1, fp) != 1 || !save_dir(fp, c->root)) {
+                fclose(fp);
+                goto error_unlink;
+        }
+        if (fclose(fp) != 0)
+                goto error_unlink;
+        if (rename(tmp, c->path) < 0)
+                goto error_unlink;
+        free(tmp);
+        return 0;
+
+error_unlink:
+        err = errno;
+        unlink(tmp);
+        errno = err;
+error:
+        free(tmp);
+        return -1;
+}
+
+void
+eg_walk_cache_close(struct eg_walk_cache_t *c)
+{
+        if (!c)
+                return;
+        dir_free(c, c->root);
+        stop_watching(c);
+        free(c->path);
+        free(c->buf);
+        free(c);
+}
@@ -2,6 +2,10 @@
 #include "eg-devel.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 /* TODO: If HAVE_SYS_PARAM_H.., gets MAXPATHLEN */
 #include <sys/param.h>
 
@@ -53,3 +57,164 @@ eg_popd(void)
         free(path_stack[path_stack_ptr]);
         return res;
 }
+
+/*
+ * Directory stacks that don't touch the working directory.  Each entry
+ * is a directory fd, opened with O_PATH where there is one, and paths
+ * are looked up relative to the top with the *at() calls, so any
+ * number of threads can each have their own "current directory".
+ */
+
+#ifndef O_PATH
+# define O_PATH O_RDONLY
+#endif
+
+struct eg_dirstack_t {
+        int *fds;
+        int n;
+        int alloc;
+};
+
+struct eg_dirstack_t *
+eg_dirstack_new(void)
+{
+        return calloc(1, sizeof(struct eg_dirstack_t));
+}
+
+void
+eg_dirstack_free(struct eg_dirstack_t *ds)
+{
+        if (!ds)
+                return;
+        while (ds->n > 0)
+                close(ds->fds[--ds->n]);
+        free(ds->fds);
+        free(ds);
+}
+
+/* The directory that relative paths are looked up in */
+int
+eg_dirstack_fd(const struct eg_dirstack_t *ds)
+{
+        return ds->n ? ds->fds[ds->n - 1] : AT_FDCWD;
+}
+
+int
+eg_dirstack_push(struct eg_dirstack_t *ds, const char *dir)
+{
+        int fd;
+
+        if (ds->n == ds->alloc) {
+                int alloc = ds->alloc ? ds->alloc * 2 : 16;
+                int *fds = realloc(ds->fds, alloc * sizeof(*fds));
+                if (!fds)
+                        return -1;
+                ds->fds = fds;
+                ds->alloc = alloc;
+        }
+        fd = openat(eg_dirstack_fd(ds), dir,
+                    O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        ds->fds[ds->n++] = fd;
+        return 0;
+}
+
+int
+eg_dirstack_pop(struct eg_dirstack_t *ds)
+{
+        if (ds->n == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        return close(ds->fds[--ds->n]);
+}
+
+int
+eg_dirstack_open(const struct eg_dirstack_t *ds, const char *path,
+                 int flags, mode_t mode)
+{
+        return openat(eg_dirstack_fd(ds), path, flags | O_CLOEXEC, mode);
+}
+
+int
+eg_dirstack_stat(const struct eg_dirstack_t *ds, const char *path,
+                 struct stat *st)
+{
+        return fstatat(eg_dirstack_fd(ds), path, st, 0);
+}
+
+/* fopen() @path relative to the top of @ds, same modes as fopen() */
+FILE *
+eg_dirstack_fopen(const struct eg_dirstack_t *ds, const char *path,
+                  const char *mode)
+{
+        const char *m;
+        FILE *fp;
+        int flags, fd;
+
+        switch (mode[0]) {
+        case 'r':
+                flags = O_RDONLY;
+                break;
+        case 'w':
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+        case 'a':
+                flags = O_WRONLY | O_CREAT | O_APPEND;
+                break;
+        default:
+                errno = EINVAL;
+                return NULL;
+        }
+        for (m = mode + 1; *m != '\0'; m++) {
+                if (*m == '+')
+                        flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+                else if (*m == 'x')
+                        flags |= O_EXCL;
+        }
+
+        fd = eg_dirstack_open(ds, path, flags, 0666);
+        if (fd < 0)
+                return NULL;
+        fp = fdopen(fd, mode);
+        if (!fp)
+                close(fd);
+        return fp;
+}
+
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+static void
+self_free(void *ds)
+{
+        eg_dirstack_free(ds);
+}
+
+static void
+self_init(void)
+{
+        pthread_key_create(&self_key, self_free);
+}
+
+/*
+ * This thread's own directory stack, freed when the thread exits.
+ * Returns NULL if out of memory.
+ */
+struct eg_dirstack_t *
+eg_dirstack_self(void)
+{
+        struct eg_dirstack_t *ds;
+
+        pthread_once(&self_once, self_init);
+        ds = pthread_getspecific(self_key);
+        if (!ds) {
+                ds = eg_dirstack_new();
+                if (ds && pthread_setspecific(self_key, ds) != 0) {
+                        eg_dirstack_free(ds);
+                        ds = NULL;
+                }
+        }
+        return ds;
+}
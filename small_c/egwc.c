@@ -6,8 +6,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 typedef unsigned long count_t; /* counter type */
 
@@ -70,9 +83,253 @@ isexclusive(int c, int lastc)
                || (c == '.' && lastc == '\n');
 }
 
-/* Process file FILE */
-void
-counter(char *file)
+enum {
+        /* read() size for files that can't be mapped */
+        WC_BLOCK = 1024 * 1024,
+        /* Don't give a thread less than this much of a file */
+        WC_THREAD_MIN = 16 * 1024 * 1024,
+        WC_MAX_THREADS = 64,
+};
+
+/**
+ * struct wc_count_t - Counts for a file, or part of one
+ * @ccount:     Characters (bytes)
+ * @wcount:     Words, counting one if the part starts in the middle
+ *              of a word
+ * @lcount:     Newlines
+ * @first_word: True if the first character is part of a word
+ * @last_word:  True if the last character is part of a word
+ */
+struct wc_count_t {
+        count_t ccount;
+        count_t wcount;
+        count_t lcount;
+        bool first_word;
+        bool last_word;
+};
+
+/* Same as isspace() in the C locale */
+static inline bool
+wc_isspace(unsigned char c)
+{
+        return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Classify 64 bytes at @p: return a bitmask of which are spaces, and
+ * set @nl to a bitmask of which are newlines
+ */
+static inline uint64_t
+space_mask64(const unsigned char *p, uint64_t *nl)
+{
+#if defined(__AVX2__)
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tab_m1 = _mm256_set1_epi8('\t' - 1);
+        const __m256i cr_p1 = _mm256_set1_epi8('\r' + 1);
+        uint64_t sp = 0, n = 0;
+        int i;
+
+        for (i = 0; i < 64; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+                /* Signed compares: bytes >= 0x80 are never in range */
+                __m256i ws = _mm256_or_si256(
+                        _mm256_cmpeq_epi8(v, space),
+                        _mm256_and_si256(_mm256_cmpgt_epi8(v, tab_m1),
+                                         _mm256_cmpgt_epi8(cr_p1, v)));
+                sp |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << i;
+                n |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(v, newline)) << i;
+        }
+        *nl = n;
+        return sp;
+#elif defined(__SSE2__)
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab_m1 = _mm_set1_epi8('\t' - 1);
+        const __m128i cr_p1 = _mm_set1_epi8('\r' + 1);
+        uint64_t sp = 0, n = 0;
+        int i;
+
+        for (i = 0; i < 64; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+                __m128i ws = _mm_or_si128(
+                        _mm_cmpeq_epi8(v, space),
+                        _mm_and_si128(_mm_cmpgt_epi8(v, tab_m1),
+                                      _mm_cmplt_epi8(v, cr_p1)));
+                sp |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+                n |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(v, newline)) << i;
+        }
+        *nl = n;
+        return sp;
+#else
+        uint64_t sp = 0, n = 0;
+        int i;
+
+        for (i = 0; i < 64; i++) {
+                sp |= (uint64_t)wc_isspace(p[i]) << i;
+                n |= (uint64_t)(p[i] == '\n') << i;
+        }
+        *nl = n;
+        return sp;
+#endif
+}
+
+/*
+ * Count @n bytes at @p into @c.  @c->last_word says whether the byte
+ * before @p was part of a word, and is updated for the next call.
+ */
+static void
+count_block(const unsigned char *p, size_t n, struct wc_count_t *c)
+{
+        uint64_t carry = c->last_word;
+        count_t words = 0, lines = 0;
+        size_t i = 0;
+
+        /*
+         * A word starts at each word character whose previous
+         * character isn't one.
+         */
+        for (; i + 64 <= n; i += 64) {
+                uint64_t nl, word = ~space_mask64(p + i, &nl);
+                words += __builtin_popcountll(word & ~((word << 1) | carry));
+                lines += __builtin_popcountll(nl);
+                carry = word >> 63;
+        }
+        for (; i < n; i++) {
+                bool word = !wc_isspace(p[i]);
+                words += word && !carry;
+                lines += p[i] == '\n';
+                carry = word;
+        }
+        c->ccount += n;
+        c->wcount += words;
+        c->lcount += lines;
+        c->last_word = carry;
+}
+
+struct wc_thread_t {
+        const unsigned char *p;
+        size_t n;
+        struct wc_count_t count;
+        pthread_t tid;
+};
+
+static void *
+count_thread(void *arg)
+{
+        struct wc_thread_t *t = arg;
+
+        t->count.last_word = false;
+        t->count.first_word = t->n && !wc_isspace(t->p[0]);
+        count_block(t->p, t->n, &t->count);
+        return NULL;
+}
+
+static int
+wc_nthreads(size_t size)
+{
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t n = size / WC_THREAD_MIN;
+
+        if (ncpu < 1)
+                ncpu = 1;
+        if (ncpu > WC_MAX_THREADS)
+                ncpu = WC_MAX_THREADS;
+        if (n < 1)
+                return 1;
+        return n < (size_t)ncpu ? (int)n : (int)ncpu;
+}
+
+/*
+ * Count a mapped file, splitting it between threads if it's big.
+ * Each thread counts as if its part came after a space, and a word
+ * that straddles two parts is taken back out here.
+ */
+static void
+count_mapped(const unsigned char *p, size_t size, struct wc_count_t *c)
+{
+        struct wc_thread_t t[WC_MAX_THREADS];
+        int i, nthreads = wc_nthreads(size);
+        size_t chunk = size / nthreads;
+
+        for (i = 0; i < nthreads; i++) {
+                memset(&t[i], 0, sizeof(t[i]));
+                t[i].p = p + i * chunk;
+                t[i].n = i == nthreads - 1 ? size - i * chunk : chunk;
+        }
+        /* The first part is counted by this thread, at the end */
+        for (i = 1; i < nthreads; i++) {
+                if (pthread_create(&t[i].tid, NULL, count_thread, &t[i])) {
+                        /* No more threads, count it here */
+                        t[i].tid = pthread_self();
+                        count_thread(&t[i]);
+                }
+        }
+        count_thread(&t[0]);
+
+        for (i = 0; i < nthreads; i++) {
+                if (i > 0 && !pthread_equal(t[i].tid, pthread_self()))
+                        pthread_join(t[i].tid, NULL);
+                c->ccount += t[i].count.ccount;
+                c->wcount += t[i].count.wcount;
+                c->lcount += t[i].count.lcount;
+                if (i > 0 && t[i - 1].count.last_word
+                    && t[i].count.first_word) {
+                        c->wcount--;
+                }
+        }
+}
+
+/*
+ * Process file FILE into @c, quickly, for when -r is not set.  Return
+ * NULL, or a message for perrf() with errno set if FILE can't be read.
+ */
+static const char *
+fast_counter(char *file, struct wc_count_t *c)
+{
+        const char *err = NULL;
+        struct stat st;
+        unsigned char *buf;
+        void *map;
+        ssize_t n;
+        int fd, saved;
+
+        memset(c, 0, sizeof(*c));
+        fd = open(file, O_RDONLY);
+        if (fd < 0)
+                return "cannot open file `%s'";
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                        madvise(map, st.st_size, MADV_SEQUENTIAL);
+                        count_mapped(map, st.st_size, c);
+                        munmap(map, st.st_size);
+                        goto done;
+                }
+        }
+
+        /* Pipes, devices, /proc files and such */
+        buf = malloc(WC_BLOCK);
+        if (!buf)
+                errf("out of memory");
+        while ((n = read(fd, buf, WC_BLOCK)) > 0)
+                count_block(buf, n, c);
+        if (n < 0)
+                err = "cannot read file `%s'";
+        free(buf);
+
+done:
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return err;
+}
+
+/* Process file FILE into @c, a character at a time, for -r */
+static const char *
+counter(char *file, struct wc_count_t *cnt)
 {
         count_t ccount = 0;
         count_t wcount = 0;
@@ -82,7 +339,7 @@ counter(char *file)
         int lastc = '\n';
         FILE *fp = fopen(file, "r");
         if (!fp)
-                perrf("cannot open file `%s'", file);
+                return "cannot open file `%s'";
 
         while ((c = getc(fp)) != EOF) {
                 ++ccount;
@@ -102,36 +359,181 @@ counter(char *file)
         }
         fclose(fp);
 
-        report(file, ccount, wcount, lcount);
-        total_ccount += ccount;
-        total_wcount += wcount;
-        total_lcount += lcount;
+        memset(cnt, 0, sizeof(*cnt));
+        cnt->ccount = ccount;
+        cnt->wcount = wcount;
+        cnt->lcount = lcount;
+        return NULL;
 }
 
+static const char *
+count_file(char *file, struct wc_count_t *c)
+{
+        return roffify ? counter(file, c) : fast_counter(file, c);
+}
+
+/* Report FILE's counts and add them to the totals, or die on an error */
+static void
+finish_file(char *file, const struct wc_count_t *c, const char *err)
+{
+        if (err)
+                perrf((char *)err, file);
+        report(file, c->ccount, c->wcount, c->lcount);
+        total_ccount += c->ccount;
+        total_wcount += c->wcount;
+        total_lcount += c->lcount;
+}
+
+/**
+ * struct wc_job_t - One file, for -j
+ * @file:       Its name
+ * @count:      Its counts, once @done
+ * @err:        Error message from count_file(), once @done
+ * @errnum:     errno to go with @err
+ * @done:       True once it has been counted
+ */
+struct wc_job_t {
+        char *file;
+        struct wc_count_t count;
+        const char *err;
+        int errnum;
+        bool done;
+};
+
+/**
+ * struct wc_pool_t - State shared by the -j workers
+ * @jobs:       Every file, in argument order
+ * @njobs:      Length of @jobs
+ * @lock:       Lock for everything below
+ * @done:       Signalled when a job is done
+ * @next:       Index of the next job to hand out
+ */
+struct wc_pool_t {
+        struct wc_job_t *jobs;
+        int njobs;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        int next;
+};
+
+static void *
+count_worker(void *arg)
+{
+        struct wc_pool_t *pool = arg;
+        struct wc_count_t c;
+        const char *err;
+        int i, errnum;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                i = pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+                if (i >= pool->njobs)
+                        break;
+
+                err = count_file(pool->jobs[i].file, &c);
+                errnum = errno;
+
+                pthread_mutex_lock(&pool->lock);
+                pool->jobs[i].count = c;
+                pool->jobs[i].err = err;
+                pool->jobs[i].errnum = errnum;
+                pool->jobs[i].done = true;
+                pthread_cond_broadcast(&pool->done);
+                pthread_mutex_unlock(&pool->lock);
+        }
+        return NULL;
+}
+
+/*
+ * Count @nfiles files on @nworkers threads.  This thread only reports,
+ * so the lines come out in argument order, and it's the only one that
+ * touches the totals.
+ */
+static void
+count_parallel(char **files, int nfiles, int nworkers)
+{
+        struct wc_pool_t pool;
+        pthread_t tid[WC_MAX_THREADS];
+        int i, nstarted = 0;
+
+        memset(&pool, 0, sizeof(pool));
+        pool.jobs = calloc(nfiles, sizeof(*pool.jobs));
+        if (!pool.jobs)
+                errf("out of memory");
+        pool.njobs = nfiles;
+        for (i = 0; i < nfiles; i++)
+                pool.jobs[i].file = files[i];
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.done, NULL);
+
+        if (nworkers > nfiles)
+                nworkers = nfiles;
+        for (i = 0; i < nworkers; i++) {
+                if (pthread_create(&tid[i], NULL, count_worker, &pool))
+                        break;
+                nstarted++;
+        }
+        if (!nstarted)
+                errf("cannot create threads");
+
+        for (i = 0; i < nfiles; i++) {
+                struct wc_job_t *job = &pool.jobs[i];
+
+                pthread_mutex_lock(&pool.lock);
+                while (!job->done)
+                        pthread_cond_wait(&pool.done, &pool.lock);
+                pthread_mutex_unlock(&pool.lock);
+
+                errno = job->errnum;
+                finish_file(job->file, &job->count, job->err);
+        }
+
+        for (i = 0; i < nstarted; i++)
+                pthread_join(tid[i], NULL);
+        pthread_cond_destroy(&pool.done);
+        pthread_mutex_destroy(&pool.lock);
+        free(pool.jobs);
+}
 
 int
 main(int argc, char **argv)
 {
+        struct wc_count_t c;
+        const char *err;
+        int njobs = 1;
         int i;
         int opt;
 
-        while ((opt = getopt(argc, argv, "r")) != -1) {
+        while ((opt = getopt(argc, argv, "rj:")) != -1) {
                 switch (opt) {
                 case 'r':
                         roffify = 1;
                         break;
+                case 'j':
+                        njobs = atoi(optarg);
+                        if (njobs < 1 || njobs > WC_MAX_THREADS)
+                                errf("-j takes a number from 1 to %d",
+                                     WC_MAX_THREADS);
+                        break;
                 default:
                 case '?':
-                        errf("usage: wc [-r] FILE [FILE...]");
+                        errf("usage: wc [-r] [-j N] FILE [FILE...]");
                         break;
                 }
         }
 
         if ((argc - optind) < 1)
-                errf("usage: wc FILE [FILE...]");
+                errf("usage: wc [-r] [-j N] FILE [FILE...]");
 
-        for (i = optind; i < argc; i++)
-                counter(argv[i]);
+        if (njobs > 1 && argc - optind > 1) {
+                count_parallel(&argv[optind], argc - optind, njobs);
+        } else {
+                for (i = optind; i < argc; i++) {
+                        err = count_file(argv[i], &c);
+                        finish_file(argv[i], &c, err);
+                }
+        }
 
         if ((argc - optind) > 1)
                 report("total", total_ccount, total_wcount, total_lcount);
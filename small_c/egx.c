@@ -3,6 +3,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+enum {
+        /* read()/write() size for streaming */
+        EGX_BLOCK = 1024 * 1024,
+        /* How much of a mapped file to XOR at a time in -i mode */
+        EGX_MAP_CHUNK = 64 * 1024 * 1024,
+};
 
 static int verbose = 0;
 
@@ -55,26 +71,152 @@ calchash(const char *xs)
         return hash8;
 }
 
+/* XOR @n bytes at @p with @hash, in place */
 static void
-egx(const char *xs)
+xor_block(unsigned char *p, size_t n, uint8_t hash)
+{
+        uint64_t k64 = 0x0101010101010101ULL * hash;
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i k = _mm256_set1_epi8((char)hash);
+
+        for (; i + 64 <= n; i += 64) {
+                __m256i a = _mm256_loadu_si256((__m256i *)(p + i));
+                __m256i b = _mm256_loadu_si256((__m256i *)(p + i + 32));
+                _mm256_storeu_si256((__m256i *)(p + i),
+                                    _mm256_xor_si256(a, k));
+                _mm256_storeu_si256((__m256i *)(p + i + 32),
+                                    _mm256_xor_si256(b, k));
+        }
+#elif defined(__SSE2__)
+        const __m128i k = _mm_set1_epi8((char)hash);
+
+        for (; i + 32 <= n; i += 32) {
+                __m128i a = _mm_loadu_si128((__m128i *)(p + i));
+                __m128i b = _mm_loadu_si128((__m128i *)(p + i + 16));
+                _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(a, k));
+                _mm_storeu_si128((__m128i *)(p + i + 16),
+                                 _mm_xor_si128(b, k));
+        }
+#endif
+        for (; i + 8 <= n; i += 8) {
+                uint64_t w;
+                memcpy(&w, p + i, 8);
+                w ^= k64;
+                memcpy(p + i, &w, 8);
+        }
+        for (; i < n; i++)
+                p[i] ^= hash;
+}
+
+/* Write all @n bytes at @p to @fd, return -1 on error */
+static int
+write_all(int fd, const unsigned char *p, size_t n)
+{
+        while (n > 0) {
+                ssize_t res = write(fd, p, n);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                p += res;
+                n -= res;
+        }
+        return 0;
+}
+
+/* XOR stdin to stdout, a block at a time */
+static void
+egx_stream(uint8_t hash)
+{
+        unsigned char *buf = malloc(EGX_BLOCK);
+        ssize_t n;
+
+        if (!buf) {
+                perror("OOM!");
+                exit(EXIT_FAILURE);
+        }
+        for (;;) {
+                n = read(STDIN_FILENO, buf, EGX_BLOCK);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0) {
+                        perror("Cannot read input");
+                        exit(EXIT_FAILURE);
+                }
+                if (n == 0)
+                        break;
+                xor_block(buf, n, hash);
+                if (write_all(STDOUT_FILENO, buf, n) < 0) {
+                        perror("Cannot write output");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        free(buf);
+}
+
+/* XOR regular file @path in place, through a shared mapping */
+static void
+egx_inplace(const char *path, uint8_t hash)
+{
+        struct stat st;
+        off_t off;
+        int fd;
+
+        fd = open(path, O_RDWR);
+        if (fd < 0 || fstat(fd, &st) < 0)
+                goto err;
+        if (!S_ISREG(st.st_mode)) {
+                fprintf(stderr, "%s: not a regular file\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        /* A chunk at a time, so huge files don't need huge mappings */
+        for (off = 0; off < st.st_size; off += EGX_MAP_CHUNK) {
+                size_t n = st.st_size - off;
+                void *map;
+
+                if (n > EGX_MAP_CHUNK)
+                        n = EGX_MAP_CHUNK;
+                map = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, off);
+                if (map == MAP_FAILED)
+                        goto err;
+                madvise(map, n, MADV_SEQUENTIAL);
+                xor_block(map, n, hash);
+                munmap(map, n);
+        }
+        if (close(fd) < 0)
+                goto err;
+        return;
+
+err:
+        perror(path);
+        exit(EXIT_FAILURE);
+}
+
+static void
+egx(const char *xs, const char *inplace)
 {
-        int c;
         uint8_t hash = calchash(xs);
         if (verbose) {
                 fprintf(stderr, "hash = 0x%02X\n", (unsigned int)hash);
                 exit(EXIT_SUCCESS);
         }
 
-        while ((c = getchar()) != EOF) {
-                c ^= hash;
-                putchar(c);
-        }
+        if (inplace)
+                egx_inplace(inplace, hash);
+        else
+                egx_stream(hash);
 }
 
 static void
 help(FILE *fp)
 {
-        fprintf(fp, "Expected: egx -f XFILE, or egx XS\n");
+        fprintf(fp, "Expected: egx [-i FILE] -f XFILE, "
+                    "or egx [-i FILE] XS\n");
+        fprintf(fp, "  -i FILE  XOR FILE in place, instead of stdin to stdout\n");
 }
 
 int
@@ -82,9 +224,10 @@ main(int argc, char **argv)
 {
         int opt;
         char *xfile = NULL;
+        char *inplace = NULL;
         char *xs;
 
-        while ((opt = getopt(argc, argv, "vf:?")) != -1) {
+        while ((opt = getopt(argc, argv, "vf:i:?")) != -1) {
                 switch (opt) {
                 case '?':
                         help(stdout);
@@ -92,6 +235,9 @@ main(int argc, char **argv)
                 case 'f':
                         xfile = optarg;
                         break;
+                case 'i':
+                        inplace = optarg;
+                        break;
                 case 'v':
                         verbose = 1;
                         break;
@@ -129,7 +275,7 @@ main(int argc, char **argv)
                 }
         }
 
-        egx(xs);
+        egx(xs, inplace);
         free(xs);
         return 0;
 
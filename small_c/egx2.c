@@ -4,19 +4,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
 
 static int verbose = 0;
 static int decrypt = 0;
 
 enum {
+        /* The scramble works on blocks of this size; it's the format */
         BUFSZ = 256,
+        /* Default read()/write() size, a multiple of BUFSZ */
+        EGX2_BLOCK = 1024 * 1024,
+        EGX2_MAX_THREADS = 64,
 };
 
 static int scramble[BUFSZ];
-static char inbuf[BUFSZ];
-static char outbuf[BUFSZ];
 static int scramble_checkbuf[BUFSZ];
 
+/*
+ * out[i] = in[gather[i]] ^ hash, for whichever direction we're going.
+ * With AVX2, shuf[] has the same thing as pshufb masks: for each
+ * 16-byte output chunk j and input chunk k, a mask that picks out the
+ * bytes of j that come from k and zeroes the rest.  Masks for chunks
+ * 2j and 2j + 1 are next to each other, to fill both lanes of a
+ * register.  (One lane at a time, with SSSE3, is no faster than the
+ * plain loop.)
+ */
+static uint8_t gather[BUFSZ];
+#if defined(__AVX2__)
+static uint8_t shuf[16 * 16 * 16] __attribute__((aligned(32)));
+#define SHUF(j, k) (&shuf[(((j) >> 1) * 16 + (k)) * 32 + ((j) & 1) * 16])
+#endif
+
 static void
 init_scramble(uint32_t hashi)
 {
@@ -101,43 +124,306 @@ ioerr(void)
         exit(EXIT_FAILURE);
 }
 
+/* Turn scramble[] into gather[] and shuf[], for decrypt or not */
 static void
-egx2(const char *xs)
+init_gather(void)
 {
-        int done = 0;
-        uint8_t hash = calchash(xs);
+        int i;
 
-        do {
-                int i;
-                ssize_t count = read(STDIN_FILENO, inbuf, BUFSZ);
-                if (count < BUFSZ) {
-                        if (count == 0)
-                                break;
-                        else if (count < 0)
-                                ioerr();
-                        memset(&inbuf[count], 0, sizeof(inbuf)-count);
-                        if (verbose) {
-                                fprintf(stderr, "%d\n",
-                                        (int)(sizeof(inbuf)-count));
-                        }
-                        done = 1;
+        for (i = 0; i < BUFSZ; i++) {
+                if (decrypt)
+                        gather[i] = scramble[i];
+                else
+                        gather[scramble[i]] = i;
+        }
+#if defined(__AVX2__)
+        for (i = 0; i < BUFSZ; i++) {
+                int j, k;
+
+                for (k = 0; k < 16; k++) {
+                        j = i / 16;
+                        SHUF(j, k)[i % 16] = gather[i] / 16 == k
+                                             ? gather[i] % 16 : 0x80;
                 }
+        }
+#endif
+}
 
-                for (i = 0; i < BUFSZ; ++i) {
-                        if (decrypt)
-                                outbuf[i] = inbuf[scramble[i]] ^ hash;
-                        else
-                                outbuf[scramble[i]] = inbuf[i] ^ hash;
+/* Scramble one BUFSZ block from @in to @out */
+static void
+scramble_block(const uint8_t *in, uint8_t *out, uint8_t hash)
+{
+#if defined(__AVX2__)
+        const __m256i key = _mm256_set1_epi8((char)hash);
+        int j, k;
+
+        for (j = 0; j < 16; j += 2) {
+                __m256i acc = _mm256_setzero_si256();
+
+                for (k = 0; k < 16; k++) {
+                        __m256i v = _mm256_broadcastsi128_si256(
+                                _mm_loadu_si128((__m128i *)(in + k * 16)));
+                        __m256i m = _mm256_load_si256(
+                                (__m256i *)SHUF(j, k));
+                        acc = _mm256_or_si256(acc,
+                                              _mm256_shuffle_epi8(v, m));
                 }
-                if (write(STDOUT_FILENO, outbuf, BUFSZ) != BUFSZ)
+                _mm256_storeu_si256((__m256i *)(out + j * 16),
+                                    _mm256_xor_si256(acc, key));
+        }
+#else
+        int i;
+
+        for (i = 0; i < BUFSZ; i++)
+                out[i] = in[gather[i]] ^ hash;
+#endif
+}
+
+/* Read up to @n bytes, stopping early only at end of file */
+static size_t
+read_full(int fd, uint8_t *p, size_t n)
+{
+        size_t got = 0;
+
+        while (got < n) {
+                ssize_t res = read(fd, p + got, n - got);
+                if (res < 0 && errno == EINTR)
+                        continue;
+                if (res < 0)
                         ioerr();
-        } while (!done);
+                if (res == 0)
+                        break;
+                got += res;
+        }
+        return got;
+}
+
+static void
+write_full(int fd, const uint8_t *p, size_t n)
+{
+        while (n > 0) {
+                ssize_t res = write(fd, p, n);
+                if (res < 0 && errno == EINTR)
+                        continue;
+                if (res < 0)
+                        ioerr();
+                p += res;
+                n -= res;
+        }
+}
+
+enum {
+        SLOT_FREE,      /* waiting for the reader */
+        SLOT_READ,      /* waiting for a worker */
+        SLOT_BUSY,      /* a worker has it */
+        SLOT_DONE,      /* waiting for the writer */
+};
+
+/**
+ * struct egx2_slot_t - One block on its way through the pipeline
+ * @in:         What was read
+ * @out:        What's to be written
+ * @len:        Bytes in @in, rounded up to BUFSZ, or 0 at end of file
+ * @seq:        Which block of the file this is
+ * @state:      SLOT_*
+ */
+struct egx2_slot_t {
+        uint8_t *in;
+        uint8_t *out;
+        size_t len;
+        unsigned long seq;
+        int state;
+};
+
+/**
+ * struct egx2_pipe_t - The reader, workers and writer
+ * @slots:      Blocks, used round robin by sequence number
+ * @nslots:     Length of @slots
+ * @blocksize:  Size of each @in and @out
+ * @hash:       Key
+ * @lock:       Lock for @state of each slot, and everything below
+ * @change:     Signalled whenever a slot changes state
+ * @work:       Sequence number of the next block for a worker
+ * @last:       Sequence number of the last block, once it has been
+ *              read, or ULONG_MAX
+ */
+struct egx2_pipe_t {
+        struct egx2_slot_t *slots;
+        int nslots;
+        size_t blocksize;
+        uint8_t hash;
+
+        pthread_mutex_t lock;
+        pthread_cond_t change;
+        unsigned long work;
+        unsigned long last;
+};
+
+/* Wait for block @seq to get to @state; a free slot can be any block */
+static struct egx2_slot_t *
+wait_slot(struct egx2_pipe_t *p, unsigned long seq, int state)
+{
+        struct egx2_slot_t *slot = &p->slots[seq % p->nslots];
+
+        pthread_mutex_lock(&p->lock);
+        while (slot->state != state || (state != SLOT_FREE
+                                         && slot->seq != seq)) {
+                pthread_cond_wait(&p->change, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+        return slot;
+}
+
+static void
+set_slot(struct egx2_pipe_t *p, struct egx2_slot_t *slot, int state)
+{
+        pthread_mutex_lock(&p->lock);
+        slot->state = state;
+        if (state == SLOT_READ && slot->len < p->blocksize)
+                p->last = slot->seq;
+        pthread_cond_broadcast(&p->change);
+        pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Fill blocks from stdin.  The last one is short, maybe empty, and
+ * padded out to a multiple of BUFSZ with zeroes.
+ */
+static void *
+reader(void *arg)
+{
+        struct egx2_pipe_t *p = arg;
+        unsigned long seq;
+
+        for (seq = 0; ; seq++) {
+                struct egx2_slot_t *slot = wait_slot(p, seq, SLOT_FREE);
+                size_t n = read_full(STDIN_FILENO, slot->in, p->blocksize);
+                size_t pad = n % BUFSZ ? BUFSZ - n % BUFSZ : 0;
+
+                if (pad) {
+                        memset(slot->in + n, 0, pad);
+                        if (verbose)
+                                fprintf(stderr, "%d\n", (int)pad);
+                }
+                slot->len = n + pad;
+                slot->seq = seq;
+                set_slot(p, slot, SLOT_READ);
+                if (slot->len < p->blocksize)
+                        break;
+        }
+        return NULL;
+}
+
+/* Scramble blocks in whatever order they come, until the last one */
+static void *
+worker(void *arg)
+{
+        struct egx2_pipe_t *p = arg;
+        struct egx2_slot_t *slot;
+        size_t i;
+
+        for (;;) {
+                pthread_mutex_lock(&p->lock);
+                for (;;) {
+                        if (p->work > p->last) {
+                                pthread_mutex_unlock(&p->lock);
+                                return NULL;
+                        }
+                        slot = &p->slots[p->work % p->nslots];
+                        if (slot->state == SLOT_READ
+                            && slot->seq == p->work) {
+                                break;
+                        }
+                        pthread_cond_wait(&p->change, &p->lock);
+                }
+                p->work++;
+                slot->state = SLOT_BUSY;
+                pthread_mutex_unlock(&p->lock);
+
+                for (i = 0; i < slot->len; i += BUFSZ)
+                        scramble_block(slot->in + i, slot->out + i, p->hash);
+                set_slot(p, slot, SLOT_DONE);
+        }
+}
+
+/*
+ * XOR and scramble stdin to stdout.  One thread reads, @nworkers
+ * scramble, and this thread writes, so reading, scrambling and writing
+ * all overlap.  The output is the same as going a BUFSZ block at a
+ * time, whatever @blocksize is.
+ */
+static void
+egx2(const char *xs, size_t blocksize, int nworkers)
+{
+        struct egx2_pipe_t p;
+        pthread_t rtid, wtid[EGX2_MAX_THREADS];
+        unsigned long seq;
+        int i;
+
+        memset(&p, 0, sizeof(p));
+        p.hash = calchash(xs);
+        init_gather();
+        p.blocksize = blocksize;
+        p.last = ULONG_MAX;
+        /* Enough that the reader and writer don't wait for workers */
+        p.nslots = nworkers + 2;
+        p.slots = calloc(p.nslots, sizeof(*p.slots));
+        if (!p.slots)
+                goto enomem;
+        for (i = 0; i < p.nslots; i++) {
+                p.slots[i].in = malloc(blocksize);
+                p.slots[i].out = malloc(blocksize);
+                if (!p.slots[i].in || !p.slots[i].out)
+                        goto enomem;
+        }
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.change, NULL);
+
+        if (pthread_create(&rtid, NULL, reader, &p))
+                goto ethread;
+        for (i = 0; i < nworkers; i++) {
+                if (pthread_create(&wtid[i], NULL, worker, &p))
+                        goto ethread;
+        }
+
+        for (seq = 0; ; seq++) {
+                struct egx2_slot_t *slot = wait_slot(&p, seq, SLOT_DONE);
+                size_t len = slot->len;
+
+                write_full(STDOUT_FILENO, slot->out, len);
+                set_slot(&p, slot, SLOT_FREE);
+                if (len < blocksize)
+                        break;
+        }
+
+        pthread_join(rtid, NULL);
+        for (i = 0; i < nworkers; i++)
+                pthread_join(wtid[i], NULL);
+        pthread_cond_destroy(&p.change);
+        pthread_mutex_destroy(&p.lock);
+        for (i = 0; i < p.nslots; i++) {
+                free(p.slots[i].in);
+                free(p.slots[i].out);
+        }
+        free(p.slots);
+        return;
+
+enomem:
+        perror("OOM!");
+        exit(EXIT_FAILURE);
+ethread:
+        perror("Cannot create thread");
+        exit(EXIT_FAILURE);
 }
 
 static void
 help(FILE *fp)
 {
-        fprintf(fp, "Expected: egx2 -f XFILE, or egx XS\n");
+        fprintf(fp, "Expected: egx2 [-x] [-b BLOCK] [-j N] -f XFILE, "
+                    "or egx2 [-x] [-b BLOCK] [-j N] XS\n");
+        fprintf(fp, "  -b BLOCK  read and write BLOCK bytes at a time, "
+                    "a multiple of %d\n", BUFSZ);
+        fprintf(fp, "  -j N      scramble on N threads\n");
 }
 
 int
@@ -146,8 +432,10 @@ main(int argc, char **argv)
         int opt;
         char *xfile = NULL;
         char *xs;
+        long blocksize = EGX2_BLOCK;
+        int nworkers = 1;
 
-        while ((opt = getopt(argc, argv, "vf:x?")) != -1) {
+        while ((opt = getopt(argc, argv, "vf:xb:j:?")) != -1) {
                 switch (opt) {
                 case '?':
                         help(stdout);
@@ -161,6 +449,23 @@ main(int argc, char **argv)
                 case 'x':
                         decrypt = 1;
                         break;
+                case 'b':
+                        blocksize = atol(optarg);
+                        if (blocksize < BUFSZ || blocksize % BUFSZ) {
+                                fprintf(stderr, "-b takes a multiple of %d\n",
+                                        BUFSZ);
+                                return 1;
+                        }
+                        break;
+                case 'j':
+                        nworkers = atoi(optarg);
+                        if (nworkers < 1 || nworkers > EGX2_MAX_THREADS) {
+                                fprintf(stderr,
+                                        "-j takes a number from 1 to %d\n",
+                                        EGX2_MAX_THREADS);
+                                return 1;
+                        }
+                        break;
                 default:
                         help(stderr);
                         return 1;
@@ -195,7 +500,7 @@ main(int argc, char **argv)
                 }
         }
 
-        egx2(xs);
+        egx2(xs, blocksize, nworkers);
         free(xs);
         return 0;
 
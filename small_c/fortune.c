@@ -1,44 +1,438 @@
 /*
  * Ever-so-slightly modified fortune as stolen -ahem, taken - from
  * Version 7 Unix source.
+ *
+ * Not so slightly any more.  A fortunes file is one fortune per line,
+ * or, if it has any lines that are just "%", fortunes of any number
+ * of lines separated by those.
+ *
+ * "egfortune -b" writes FILE.idx next to the fortunes file, with the
+ * offset and length of each fortune, and "make install" does that for
+ * the installed one.  With an up-to-date index, a fortune is picked
+ * with one read of the index and one of the fortunes file.  Without
+ * one, the fortunes file is mapped and sampled in a single pass.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <math.h>
 
 #define FORTUNE_PATH DATADIR "/fortunes"
+#define FORTUNE_IDX_SUFFIX ".idx"
 
-char line[500];
-char bline[500];
-char sharefile[500];
+enum {
+        FORTUNE_IDX_MAGIC = 0x58444946, /* "FIDX" */
+        FORTUNE_IDX_VERSION = 1,
+};
 
-int main(void)
+/**
+ * struct fortune_idx_hdr_t - Start of an index file
+ * @magic:      FORTUNE_IDX_MAGIC
+ * @version:    FORTUNE_IDX_VERSION
+ * @count:      Number of struct fortune_t that follow
+ * @size:       Size of the fortunes file it was made from
+ * @mtime:      Modification time of the fortunes file it was made from
+ *
+ * The index is in native byte order; it's made where it's used.
+ */
+struct fortune_idx_hdr_t {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t count;
+        uint64_t size;
+        int64_t mtime;
+};
+
+/* Where a fortune is in the fortunes file */
+struct fortune_t {
+        uint64_t off;
+        uint64_t len;
+};
+
+static uint64_t rng_state;
+
+static void
+rng_seed(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rng_state = ((uint64_t)getpid() << 32) ^ ts.tv_sec
+                    ^ ((uint64_t)ts.tv_nsec << 16);
+}
+
+/* splitmix64 */
+static uint64_t
+rng_next(void)
+{
+        uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n), for n > 0 */
+static uint64_t
+rng_below(uint64_t n)
+{
+        /* Reject the top partial range, so there's no modulo bias */
+        uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+        uint64_t r;
+
+        do {
+                r = rng_next();
+        } while (r >= limit);
+        return r % n;
+}
+
+/*
+ * Called by scan() for each fortune.  @delim is false if it's a line
+ * and true if it's a run of lines between "%" lines.
+ */
+typedef void (*fortune_cb_t)(void *arg, bool delim, uint64_t off,
+                             uint64_t len);
+
+/*
+ * Find the fortunes in @n bytes at @p, both ways at once, since we
+ * don't know which kind of file it is until the end.  Return true if
+ * there were "%" lines.
+ */
+static bool
+scan(const char *p, size_t n, fortune_cb_t cb, void *arg)
+{
+        size_t pos = 0, rec_off = 0, rec_len = 0;
+        bool delim = false;
+
+        while (pos < n) {
+                const char *nl = memchr(p + pos, '\n', n - pos);
+                size_t end = nl ? (size_t)(nl - p) + 1 : n;
+                size_t len = end - pos;
+
+                cb(arg, false, pos, len);
+                if (p[pos] == '%' && (len == 1 || p[pos + 1] == '\n')) {
+                        if (rec_len)
+                                cb(arg, true, rec_off, rec_len);
+                        rec_len = 0;
+                        delim = true;
+                } else {
+                        if (!rec_len)
+                                rec_off = pos;
+                        rec_len = end - rec_off;
+                }
+                pos = end;
+        }
+        if (rec_len)
+                cb(arg, true, rec_off, rec_len);
+        return delim;
+}
+
+/* Reservoir sample of each kind of fortune, for scan() */
+struct fortune_pick_t {
+        struct fortune_t pick[2];
+        uint64_t count[2];
+};
+
+static void
+pick_cb(void *arg, bool delim, uint64_t off, uint64_t len)
+{
+        struct fortune_pick_t *fp = arg;
+
+        /* The k'th one replaces the pick with probability 1/k */
+        if (rng_below(++fp->count[delim]) == 0) {
+                fp->pick[delim].off = off;
+                fp->pick[delim].len = len;
+        }
+}
+
+/* Every fortune of each kind, for building an index */
+struct fortune_list_t {
+        struct fortune_t *list[2];
+        uint64_t count[2];
+        uint64_t alloc[2];
+        bool nomem;
+};
+
+static void
+list_cb(void *arg, bool delim, uint64_t off, uint64_t len)
+{
+        struct fortune_list_t *fl = arg;
+
+        if (fl->nomem)
+                return;
+        if (fl->count[delim] == fl->alloc[delim]) {
+                uint64_t alloc = fl->alloc[delim] ? fl->alloc[delim] * 2
+                                                  : 256;
+                struct fortune_t *list;
+
+                list = realloc(fl->list[delim], alloc * sizeof(*list));
+                if (!list) {
+                        fl->nomem = true;
+                        return;
+                }
+                fl->list[delim] = list;
+                fl->alloc[delim] = alloc;
+        }
+        fl->list[delim][fl->count[delim]].off = off;
+        fl->list[delim][fl->count[delim]].len = len;
+        fl->count[delim]++;
+}
+
+static char *
+idx_path(const char *path)
 {
-	double p;
-	register char *l;
-	long t;
-	FILE *f;
+        char *s = malloc(strlen(path) + sizeof(FORTUNE_IDX_SUFFIX));
 
-	f = fopen(FORTUNE_PATH, "r");
-	if (f == NULL) {
+        if (s) {
+                strcpy(s, path);
+                strcat(s, FORTUNE_IDX_SUFFIX);
+        }
+        return s;
+}
+
+/*
+ * Map @fd and fill in @st.  Return NULL on error, or if it's empty,
+ * with st_size zero.
+ */
+static char *
+map_file(int fd, struct stat *st)
+{
+        void *map;
+
+        if (fstat(fd, st) < 0)
+                return NULL;
+        if (st->st_size == 0)
+                return NULL;
+        map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        return map == MAP_FAILED ? NULL : map;
+}
+
+static bool
+write_all(int fd, const void *p, size_t n)
+{
+        while (n > 0) {
+                ssize_t res = write(fd, p, n);
+                if (res <= 0)
+                        return false;
+                p = (const char *)p + res;
+                n -= res;
+        }
+        return true;
+}
+
+/* Write the index for fortunes file @path, return -1 on error */
+static int
+build_index(const char *path)
+{
+        struct fortune_idx_hdr_t hdr;
+        struct fortune_list_t fl;
+        struct stat st;
+        char *map, *ipath, *tmp = NULL;
+        bool delim;
+        int fd = -1, ret = -1;
+
+        memset(&fl, 0, sizeof(fl));
+        ipath = idx_path(path);
+        if (!ipath)
+                goto out;
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                goto out;
+        st.st_size = -1;
+        map = map_file(fd, &st);
+        close(fd);
+        fd = -1;
+        if (map) {
+                delim = scan(map, st.st_size, list_cb, &fl);
+                munmap(map, st.st_size);
+                if (fl.nomem)
+                        goto out;
+        } else if (st.st_size == 0) {
+                delim = false;
+        } else {
+                goto out;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = FORTUNE_IDX_MAGIC;
+        hdr.version = FORTUNE_IDX_VERSION;
+        hdr.count = fl.count[delim];
+        hdr.size = st.st_size;
+        hdr.mtime = st.st_mtime;
+
+        /* Write it beside the real one and rename it into place */
+        tmp = malloc(strlen(ipath) + 8);
+        if (!tmp)
+                goto out;
+        sprintf(tmp, "%s.XXXXXX", ipath);
+        fd = mkstemp(tmp);
+        if (fd < 0)
+                goto out;
+        if (!write_all(fd, &hdr, sizeof(hdr))
+            || !write_all(fd, fl.list[delim],
+                          hdr.count * sizeof(struct fortune_t))) {
+                goto out;
+        }
+        if (fchmod(fd, 0644) < 0 || close(fd) < 0) {
+                fd = -1;
+                goto out;
+        }
+        fd = -1;
+        if (rename(tmp, ipath) < 0)
+                goto out;
+        ret = 0;
+
+out:
+        if (fd >= 0)
+                close(fd);
+        if (ret < 0 && tmp)
+                unlink(tmp);
+        free(tmp);
+        free(ipath);
+        free(fl.list[0]);
+        free(fl.list[1]);
+        return ret;
+}
+
+/*
+ * Pick a fortune from @path's index.  Return false if there's no
+ * index, or it's out of date, so the caller should scan instead.
+ */
+static bool
+pick_indexed(const char *path, int fd, struct fortune_t *f, bool *empty)
+{
+        struct fortune_idx_hdr_t hdr;
+        struct stat st, ist;
+        char *ipath = idx_path(path);
+        int ifd;
+        bool ret = false;
+
+        if (!ipath)
+                return false;
+        ifd = open(ipath, O_RDONLY);
+        free(ipath);
+        if (ifd < 0)
+                return false;
+
+        if (fstat(fd, &st) < 0 || fstat(ifd, &ist) < 0)
+                goto out;
+        if (pread(ifd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+            || hdr.magic != FORTUNE_IDX_MAGIC
+            || hdr.version != FORTUNE_IDX_VERSION
+            || hdr.size != (uint64_t)st.st_size
+            || hdr.mtime != (int64_t)st.st_mtime
+            || hdr.count != (ist.st_size - sizeof(hdr)) / sizeof(*f)) {
+                goto out;
+        }
+        if (hdr.count == 0) {
+                *empty = true;
+                ret = true;
+                goto out;
+        }
+        if (pread(ifd, f, sizeof(*f), sizeof(hdr)
+                  + rng_below(hdr.count) * sizeof(*f)) != sizeof(*f)) {
+                goto out;
+        }
+        ret = f->off <= hdr.size && f->len <= hdr.size - f->off;
+
+out:
+        close(ifd);
+        return ret;
+}
+
+static void
+usage(FILE *fp)
+{
+        fprintf(fp, "Expected: egfortune [-f FILE] [-b]\n");
+        fprintf(fp, "  -f FILE  use FILE instead of %s\n", FORTUNE_PATH);
+        fprintf(fp, "  -b       build FILE" FORTUNE_IDX_SUFFIX
+                    " instead of printing a fortune\n");
+}
+
+int
+main(int argc, char **argv)
+{
+        const char *path = FORTUNE_PATH;
+        struct fortune_t f;
+        bool build = false, empty = false;
+        char *buf;
+        int fd, opt;
+
+        while ((opt = getopt(argc, argv, "bf:h")) != -1) {
+                switch (opt) {
+                case 'b':
+                        build = true;
+                        break;
+                case 'f':
+                        path = optarg;
+                        break;
+                case 'h':
+                        usage(stdout);
+                        return 0;
+                default:
+                        usage(stderr);
+                        return 1;
+                }
+        }
+
+        if (build) {
+                if (build_index(path) < 0) {
+                        perror("Cannot build fortune index");
+                        return 1;
+                }
+                return 0;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
                 perror("Cannot open fortune file");
-		exit(1);
-	}
-	time(&t);
-	srand(getpid() + (int)((t>>16) + t));
-	p = 1.;
-	for(;;) {
-		l = fgets(line, 500, f);
-		if(l == NULL)
-			break;
-		if(fmod(rand(), 32768.) < 32768./p)
-			strcpy(bline, line);
-		p += 1.;
-	}
-	fputs(bline, stdout);
-	return(0);
+                exit(1);
+        }
+        rng_seed();
+
+        if (!pick_indexed(path, fd, &f, &empty)) {
+                struct fortune_pick_t fp;
+                struct stat st;
+                char *map;
+                bool delim;
+
+                st.st_size = -1;
+                map = map_file(fd, &st);
+                if (!map && st.st_size != 0) {
+                        perror("Cannot read fortune file");
+                        return 1;
+                }
+                if (!map)
+                        return 0;
+                memset(&fp, 0, sizeof(fp));
+                delim = scan(map, st.st_size, pick_cb, &fp);
+                f = fp.pick[delim];
+                if (fp.count[delim])
+                        fwrite(map + f.off, 1, f.len, stdout);
+                munmap(map, st.st_size);
+                return 0;
+        }
+        if (empty)
+                return 0;
+
+        buf = malloc(f.len);
+        if (!buf) {
+                perror("OOM!");
+                return 1;
+        }
+        if (pread(fd, buf, f.len, f.off) != (ssize_t)f.len) {
+                perror("Cannot read fortune file");
+                return 1;
+        }
+        fwrite(buf, 1, f.len, stdout);
+        free(buf);
+        close(fd);
+        return 0;
 }
@@ -0,0 +1,98 @@
+/*
+ * bench_fletcher32.c - Compare eg_fletcher32() with the one-word-at-a-
+ *                      time loop it replaced, from 64 bytes to 64MB
+ *
+ * Usage: bench_fletcher32
+ *
+ * Build with CFLAGS=-mavx2 (or -march=native) for the AVX2 version;
+ * otherwise x86-64 gets SSE2.
+ */
+#include <eg-devel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+        /* Repeat each size for about this long */
+        BENCH_NSEC = 300 * 1000 * 1000,
+};
+
+static long long
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The old eg_fletcher32(), to compare against */
+static uint32_t
+fletcher32_scalar(const uint16_t *data, size_t len)
+{
+        uint32_t sum1 = 0xffff, sum2 = 0xffff;
+
+        while (len) {
+                unsigned tlen = len > 360 ? 360 : len;
+                len -= tlen;
+                do {
+                        sum1 += *data++;
+                        sum2 += sum1;
+                } while (--tlen);
+                sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+                sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+        }
+        sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+        sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+
+        return (sum2 << 16) | sum1;
+}
+
+/* Sink for the checksums, so the calls aren't optimized away */
+static volatile uint32_t sink;
+
+/* Return throughput in MB/s */
+static double
+bench(uint32_t (*fn)(const uint16_t *, size_t), const uint16_t *data,
+      size_t nbytes)
+{
+        /* Enough calls between clock reads that they don't count */
+        long reps = 1 + (1 << 20) / nbytes, i;
+        long long start = now_ns(), elapsed;
+        long iter = 0;
+
+        do {
+                for (i = 0; i < reps; i++)
+                        sink = fn(data, nbytes / 2);
+                iter += reps;
+                elapsed = now_ns() - start;
+        } while (elapsed < BENCH_NSEC);
+
+        return (double)nbytes * iter / 1e6 / ((double)elapsed / 1e9);
+}
+
+int
+main(void)
+{
+        size_t max = 64 << 20, size, i;
+        uint16_t *data = malloc(max);
+
+        if (!data) {
+                perror("malloc");
+                return 1;
+        }
+        srand(1);
+        for (i = 0; i < max / 2; i++)
+                data[i] = rand();
+
+        printf("%12s %14s %14s %8s\n", "bytes", "scalar MB/s", "new MB/s",
+               "speedup");
+        for (size = 64; size <= max; size *= 4) {
+                double old = bench(fletcher32_scalar, data, size);
+                double new = bench(eg_fletcher32, data, size);
+
+                printf("%12lu %14.0f %14.0f %7.1fx\n", (unsigned long)size,
+                       old, new, new / old);
+        }
+        free(data);
+        return 0;
+}
@@ -0,0 +1,648 @@
+/*
+ * test_dir_walk.c - Walk a made-up tree with eg_dir_walk() and check
+ * it against a plain recursive readdir().  Then read it with
+ * eg_dir_foreach_data() and check what's in the files.  Last, scan it
+ * again and again with eg_walk_cache_scan() while changing it, and
+ * look around it with eg_dirstack_*().
+ */
+#include <eg-devel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+struct names_t {
+        pthread_mutex_t lock;
+        char **names;
+        size_t n;
+        size_t alloc;
+        int nlinks;
+        int stop_after;
+};
+
+static void
+add_name(struct names_t *nm, const char *path)
+{
+        if (nm->n == nm->alloc) {
+                nm->alloc = nm->alloc ? nm->alloc * 2 : 64;
+                nm->names = realloc(nm->names,
+                                    nm->alloc * sizeof(*nm->names));
+                if (!nm->names) {
+                        perror("realloc");
+                        exit(1);
+                }
+        }
+        nm->names[nm->n++] = strdup(path);
+}
+
+static void
+names_free(struct names_t *nm)
+{
+        size_t i;
+
+        for (i = 0; i < nm->n; i++)
+                free(nm->names[i]);
+        free(nm->names);
+        memset(nm, 0, sizeof(*nm));
+        pthread_mutex_init(&nm->lock, NULL);
+}
+
+static int
+collect(const struct eg_dirent_t *ent, void *priv)
+{
+        struct names_t *nm = priv;
+        struct stat st;
+        int res = 0;
+
+        /* dirfd is good for *at() calls, when it's given */
+        if (ent->dirfd >= 0
+            && fstatat(ent->dirfd, ent->name, &st,
+                       AT_SYMLINK_NOFOLLOW) < 0) {
+                perror(ent->path);
+                return -1;
+        }
+        pthread_mutex_lock(&nm->lock);
+        add_name(nm, ent->path);
+        if (ent->type == DT_LNK)
+                nm->nlinks++;
+        if (nm->stop_after && (int)nm->n >= nm->stop_after)
+                res = -1;
+        pthread_mutex_unlock(&nm->lock);
+        return res;
+}
+
+static int
+collect_path(const char *path, void *priv)
+{
+        struct names_t *nm = priv;
+
+        add_name(nm, path);
+        if (nm->stop_after && (int)nm->n >= nm->stop_after)
+                return -1;
+        return 0;
+}
+
+/* What eg_dir_walk(EG_RECURSIVE | EG_WALK_ORDERED) should do */
+static void
+reference(const char *path, struct names_t *nm)
+{
+        DIR *dir = opendir(path);
+        struct dirent *de;
+        char buf[4096];
+
+        if (!dir) {
+                perror(path);
+                exit(1);
+        }
+        while ((de = readdir(dir)) != NULL) {
+                struct stat st;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+                lstat(buf, &st);
+                if (!S_ISDIR(st.st_mode))
+                        add_name(nm, buf);
+                else if (de->d_name[0] != '.')
+                        reference(buf, nm);
+        }
+        closedir(dir);
+}
+
+static int
+cmp_names(const void *a, const void *b)
+{
+        return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int
+same(struct names_t *a, struct names_t *b, int sort)
+{
+        size_t i;
+
+        if (a->n != b->n)
+                return 0;
+        if (sort) {
+                qsort(a->names, a->n, sizeof(*a->names), cmp_names);
+                qsort(b->names, b->n, sizeof(*b->names), cmp_names);
+        }
+        for (i = 0; i < a->n; i++) {
+                if (strcmp(a->names[i], b->names[i]))
+                        return 0;
+        }
+        return 1;
+}
+
+/* Sizes of file0, file1... right around eg_dir_foreach_data()'s reads */
+static const size_t file_sizes[] = { 0, 1, 65535, 65536, 200000 };
+
+static size_t
+file_size(const char *path)
+{
+        const char *name = strrchr(path, '/') + 1;
+
+        if (!strncmp(name, "file", 4))
+                return file_sizes[atoi(name + 4)];
+        return 10;
+}
+
+static unsigned char
+file_byte(const char *path, size_t i)
+{
+        return (i + strlen(path)) % 251;
+}
+
+static void
+make_file(const char *path)
+{
+        size_t i, size = file_size(path);
+        FILE *fp = fopen(path, "w");
+
+        if (!fp) {
+                perror(path);
+                exit(1);
+        }
+        for (i = 0; i < size; i++)
+                putc(file_byte(path, i), fp);
+        fclose(fp);
+}
+
+struct data_t {
+        unsigned long nfiles;
+        unsigned long nbad;
+        int stop_after;
+};
+
+static int
+check_data(const char *path, const void *data, size_t len, void *priv)
+{
+        struct data_t *d = priv;
+        const unsigned char *p = data;
+        size_t i;
+
+        d->nfiles++;
+        if (len != file_size(path)) {
+                d->nbad++;
+        } else {
+                for (i = 0; i < len; i++) {
+                        if (p[i] != file_byte(path, i)) {
+                                d->nbad++;
+                                break;
+                        }
+                }
+        }
+        if (d->stop_after && d->nfiles >= (unsigned long)d->stop_after)
+                return -1;
+        return 0;
+}
+
+/* A few levels of directories, some files in each */
+static void
+make_tree(const char *path, int depth)
+{
+        char buf[4096];
+        int i;
+
+        if (mkdir(path, 0755) < 0) {
+                perror(path);
+                exit(1);
+        }
+        for (i = 0; i < 5; i++) {
+                snprintf(buf, sizeof(buf), "%s/file%d", path, i);
+                make_file(buf);
+        }
+        snprintf(buf, sizeof(buf), "%s/.hidden", path);
+        make_file(buf);
+        if (depth == 0)
+                return;
+        for (i = 0; i < 4; i++) {
+                snprintf(buf, sizeof(buf), "%s/dir%d", path, i);
+                make_tree(buf, depth - 1);
+        }
+}
+
+static void
+remove_tree(const char *path)
+{
+        char cmd[4200];
+
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+        if (system(cmd) != 0)
+                fprintf(stderr, "Couldn't remove %s\n", path);
+}
+
+static void
+check(int ok, const char *what)
+{
+        printf("%s: %s\n", what, ok ? "OK" : "FAILED");
+        if (!ok)
+                exit(1);
+}
+
+/* Scan @c and check it found @n new files, the first being @first */
+static void
+check_scan(struct eg_walk_cache_t *c, size_t n, const char *first,
+           const char *what)
+{
+        struct names_t got;
+        int res;
+
+        memset(&got, 0, sizeof(got));
+        res = eg_walk_cache_scan(c, collect_path, &got);
+        if (got.n)
+                qsort(got.names, got.n, sizeof(*got.names), cmp_names);
+        check(res == 0 && got.n == n
+              && (!first || (n && !strcmp(got.names[0], first))), what);
+        names_free(&got);
+}
+
+/* Add, remove and move things under @root, checking each scan */
+static void
+check_cache(const char *base, const char *root, size_t nref,
+            unsigned int flags)
+{
+        const char *how = flags & EG_WALK_WATCH ? "watching" : "mtimes";
+        char cache[4096], buf[4200], buf2[4200], what[100];
+        struct eg_walk_cache_t *c;
+        struct names_t got;
+        int res;
+
+        snprintf(cache, sizeof(cache), "%s/cache", base);
+        unlink(cache);
+        c = eg_walk_cache_open(root, cache, EG_RECURSIVE | flags);
+        check(c != NULL, "Open cache");
+
+        snprintf(what, sizeof(what), "First scan, %s", how);
+        check_scan(c, nref, NULL, what);
+        snprintf(what, sizeof(what), "Nothing new, %s", how);
+        check_scan(c, 0, NULL, what);
+
+        /* Deep down, so only its own directory changes */
+        snprintf(buf, sizeof(buf), "%s/dir1/dir2/dir3/new", root);
+        make_file(buf);
+        snprintf(what, sizeof(what), "New file, %s", how);
+        check_scan(c, 1, buf, what);
+        check_scan(c, 0, NULL, what);
+
+        /* Replaced under the same name, it's new again */
+        unlink(buf);
+        snprintf(buf2, sizeof(buf2), "%s/dir1/dir2/dir3/file0", root);
+        if (rename(buf2, buf) < 0) {
+                perror(buf);
+                exit(1);
+        }
+        snprintf(what, sizeof(what), "Moved file, %s", how);
+        check_scan(c, 1, buf, what);
+        make_file(buf2);
+        check_scan(c, 1, buf2, what);
+
+        /* A new subtree is all new, a moved one too */
+        snprintf(buf, sizeof(buf), "%s/dir2/newdir", root);
+        make_tree(buf, 1);
+        snprintf(what, sizeof(what), "New tree, %s", how);
+        check_scan(c, 30, NULL, what);
+        snprintf(buf2, sizeof(buf2), "%s/dir3/dir0/moved", root);
+        if (rename(buf, buf2) < 0) {
+                perror(buf2);
+                exit(1);
+        }
+        snprintf(what, sizeof(what), "Moved tree, %s", how);
+        check_scan(c, 30, NULL, what);
+        remove_tree(buf2);
+        snprintf(what, sizeof(what), "Removed tree, %s", how);
+        check_scan(c, 0, NULL, what);
+
+        /* Stopped, the rest come next time */
+        snprintf(buf, sizeof(buf), "%s/dir0/newdir", root);
+        make_tree(buf, 1);
+        memset(&got, 0, sizeof(got));
+        got.stop_after = 10;
+        res = eg_walk_cache_scan(c, collect_path, &got);
+        snprintf(what, sizeof(what), "Stop scan, %s", how);
+        check(res < 0 && got.n == 10, what);
+        names_free(&got);
+        res = eg_walk_cache_scan(c, collect_path, &got);
+        check(res == 0 && got.n >= 20 && got.n <= 30, what);
+        names_free(&got);
+
+        /* Another process picks up where this one left off */
+        check(eg_walk_cache_save(c) == 0, "Save cache");
+        eg_walk_cache_close(c);
+        c = eg_walk_cache_open(root, cache, EG_RECURSIVE | flags);
+        snprintf(what, sizeof(what), "Nothing new after load, %s", how);
+        check_scan(c, 0, NULL, what);
+        snprintf(buf, sizeof(buf), "%s/dir0/newdir/dir3/new", root);
+        make_file(buf);
+        snprintf(what, sizeof(what), "New file after load, %s", how);
+        check_scan(c, 1, buf, what);
+        eg_walk_cache_close(c);
+
+        /* A cache of another directory is ignored */
+        c = eg_walk_cache_open(base, cache, 0);
+        snprintf(what, sizeof(what), "Other root, %s", how);
+        check_scan(c, 1, cache, what);
+        eg_walk_cache_close(c);
+
+        unlink(buf);
+        snprintf(buf, sizeof(buf), "%s/dir0/newdir", root);
+        remove_tree(buf);
+        snprintf(buf, sizeof(buf), "%s/dir1/dir2/dir3/new", root);
+        unlink(buf);
+        unlink(cache);
+}
+
+/* Is @path, relative to the top of @ds, the same file as @full? */
+static int
+same_file(struct eg_dirstack_t *ds, const char *path, const char *full)
+{
+        struct stat st1, st2;
+
+        return eg_dirstack_stat(ds, path, &st1) == 0
+               && stat(full, &st2) == 0
+               && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+struct stack_thread_t {
+        pthread_barrier_t *barrier;
+        const char *dir;
+        struct eg_dirstack_t *ds;
+        int ok;
+};
+
+/* Push a directory on this thread's stack, then check it's still there */
+static void *
+stack_thread(void *arg)
+{
+        struct stack_thread_t *t = arg;
+        char buf[4200];
+
+        t->ds = eg_dirstack_self();
+        t->ok = t->ds != NULL && eg_dirstack_push(t->ds, t->dir) == 0;
+        /* Both threads have pushed before either looks */
+        pthread_barrier_wait(t->barrier);
+        snprintf(buf, sizeof(buf), "%s/file1", t->dir);
+        t->ok = t->ok && eg_dirstack_self() == t->ds
+                && same_file(eg_dirstack_self(), "file1", buf);
+        return NULL;
+}
+
+static void
+check_dirstack(const char *root)
+{
+        char cwd[4096], cwd2[4096], buf[4200];
+        struct stack_thread_t t[2];
+        pthread_barrier_t barrier;
+        pthread_t tid[2];
+        struct eg_dirstack_t *ds;
+        struct stat st;
+        FILE *fp;
+        int fd, i;
+
+        if (!getcwd(cwd, sizeof(cwd))) {
+                perror("getcwd");
+                exit(1);
+        }
+        ds = eg_dirstack_new();
+        check(ds != NULL && eg_dirstack_fd(ds) == AT_FDCWD, "New stack");
+
+        check(eg_dirstack_push(ds, root) == 0
+              && eg_dirstack_fd(ds) != AT_FDCWD, "Push");
+        snprintf(buf, sizeof(buf), "%s/file2", root);
+        check(same_file(ds, "file2", buf)
+              && eg_dirstack_stat(ds, "file2", &st) == 0
+              && (size_t)st.st_size == file_size(buf), "Stat on top");
+        snprintf(buf, sizeof(buf), "%s/dir0/file3", root);
+        fd = eg_dirstack_open(ds, "dir0/file3", O_RDONLY, 0);
+        check(fd >= 0 && fstat(fd, &st) == 0
+              && (size_t)st.st_size == file_size(buf), "Open on top");
+        if (fd >= 0)
+                close(fd);
+
+        /* Relative to the one below */
+        check(eg_dirstack_push(ds, "dir0") == 0, "Push relative");
+        snprintf(buf, sizeof(buf), "%s/dir0/file1", root);
+        fp = eg_dirstack_fopen(ds, "file1", "r");
+        check(fp != NULL && getc(fp) == file_byte(buf, 0), "Fopen on top");
+        if (fp)
+                fclose(fp);
+        fp = eg_dirstack_fopen(ds, "made", "w");
+        check(fp != NULL && fputs("hi\n", fp) >= 0 && fclose(fp) == 0,
+              "Fopen to write");
+        snprintf(buf, sizeof(buf), "%s/dir0/made", root);
+        check(stat(buf, &st) == 0 && st.st_size == 3, "Written on top");
+        unlink(buf);
+
+        snprintf(buf, sizeof(buf), "%s/dir0", root);
+        check(eg_dirstack_pop(ds) == 0 && eg_dirstack_fd(ds) != AT_FDCWD
+              && same_file(ds, "dir0", buf), "Pop");
+        check(eg_dirstack_pop(ds) == 0 && eg_dirstack_fd(ds) == AT_FDCWD,
+              "Pop to cwd");
+        errno = 0;
+        check(eg_dirstack_pop(ds) < 0 && errno == EINVAL, "Pop empty");
+
+        snprintf(buf, sizeof(buf), "%s/file0", root);
+        errno = 0;
+        check(eg_dirstack_push(ds, buf) < 0 && errno == ENOTDIR
+              && eg_dirstack_fd(ds) == AT_FDCWD, "Push a file");
+        snprintf(buf, sizeof(buf), "%s/nonexistent", root);
+        errno = 0;
+        check(eg_dirstack_push(ds, buf) < 0 && errno == ENOENT,
+              "Push no such dir");
+        eg_dirstack_free(ds);
+
+        /* Each thread has its own */
+        pthread_barrier_init(&barrier, NULL, 2);
+        for (i = 0; i < 2; i++) {
+                snprintf(buf, sizeof(buf), "%s/dir%d", root, i + 1);
+                t[i].barrier = &barrier;
+                t[i].dir = strdup(buf);
+        }
+        for (i = 0; i < 2; i++)
+                pthread_create(&tid[i], NULL, stack_thread, &t[i]);
+        for (i = 0; i < 2; i++)
+                pthread_join(tid[i], NULL);
+        check(t[0].ok && t[1].ok && t[0].ds != t[1].ds,
+              "Thread stacks");
+        for (i = 0; i < 2; i++)
+                free((char *)t[i].dir);
+        pthread_barrier_destroy(&barrier);
+
+        check(getcwd(cwd2, sizeof(cwd2)) != NULL && !strcmp(cwd, cwd2),
+              "Cwd unchanged");
+}
+
+/* Where check_cache_mount() mounted, to undo if a check fails */
+static char mounted[4200];
+
+static void
+unmount(void)
+{
+        if (mounted[0])
+                umount(mounted);
+        mounted[0] = '\0';
+}
+
+/*
+ * Under a mount point, readdir() and stat() give different inodes for
+ * the same directory.  Re-reading its parent mustn't make it look new.
+ * Needs root for the bind mount.
+ */
+static void
+check_cache_mount(const char *base)
+{
+        char src[4096], root[4096], buf[4300];
+        char *sub = mounted;
+        struct eg_walk_cache_t *c;
+
+        snprintf(src, sizeof(src), "%s/mntsrc", base);
+        snprintf(root, sizeof(root), "%s/mntroot", base);
+        snprintf(sub, sizeof(mounted), "%s/sub", root);
+        if (mkdir(src, 0755) < 0 || mkdir(root, 0755) < 0
+            || mkdir(sub, 0755) < 0) {
+                perror(base);
+                exit(1);
+        }
+        snprintf(buf, sizeof(buf), "%s/f1", src);
+        make_file(buf);
+        if (mount(src, sub, NULL, MS_BIND, NULL) < 0) {
+                printf("Mount point: skipped, can't bind mount\n");
+                goto out;
+        }
+        atexit(unmount);
+
+        c = eg_walk_cache_open(root, NULL, EG_RECURSIVE);
+        check(c != NULL, "Open cache");
+        snprintf(buf, sizeof(buf), "%s/f1", sub);
+        check_scan(c, 1, buf, "Mount point, first scan");
+        /* The parent changes, so it's read again */
+        snprintf(buf, sizeof(buf), "%s/new", root);
+        make_file(buf);
+        check_scan(c, 1, buf, "Mount point, parent changed");
+        check_scan(c, 0, NULL, "Mount point, nothing new");
+        eg_walk_cache_close(c);
+        unmount();
+out:
+        remove_tree(root);
+        remove_tree(src);
+}
+
+int
+main(void)
+{
+        char tmpl[] = "/tmp/test_dir_walk.XXXXXX";
+        char root[4096], buf[4200];
+        struct names_t ref, got;
+        struct data_t data;
+        unsigned int uring;
+        const char *base;
+        int res, nthreads;
+
+        base = mkdtemp(tmpl);
+        if (!base) {
+                perror("mkdtemp");
+                return 1;
+        }
+        snprintf(root, sizeof(root), "%s/root", base);
+        make_tree(root, 3);
+        snprintf(buf, sizeof(buf), "%s/.skipme", root);
+        make_tree(buf, 1);
+        /* A link to a directory is reported, not followed */
+        snprintf(buf, sizeof(buf), "%s/dir0/up", root);
+        if (symlink("..", buf) < 0) {
+                perror(buf);
+                return 1;
+        }
+
+        memset(&ref, 0, sizeof(ref));
+        memset(&got, 0, sizeof(got));
+        pthread_mutex_init(&got.lock, NULL);
+        reference(root, &ref);
+        printf("%lu entries\n", (unsigned long)ref.n);
+
+        for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+                res = eg_dir_walk(root, EG_RECURSIVE | EG_WALK_ORDERED,
+                                  nthreads, collect, &got);
+                snprintf(buf, sizeof(buf), "Ordered, %d threads",
+                         nthreads);
+                check(res == 0 && got.nlinks == 1 && same(&got, &ref, 0),
+                      buf);
+                names_free(&got);
+        }
+
+        for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+                res = eg_dir_walk(root, EG_RECURSIVE, nthreads,
+                                  collect, &got);
+                snprintf(buf, sizeof(buf), "Unordered, %d threads",
+                         nthreads);
+                check(res == 0 && same(&got, &ref, 1), buf);
+                names_free(&got);
+        }
+
+        res = eg_dir_walk(root, 0, 4, collect, &got);
+        check(res == 0 && got.n == 6, "Not recursive");
+        names_free(&got);
+
+        got.stop_after = 10;
+        res = eg_dir_walk(root, EG_RECURSIVE, 4, collect, &got);
+        check(res < 0 && got.n >= 10 && got.n < ref.n, "Stop early");
+        names_free(&got);
+
+        got.stop_after = 10;
+        res = eg_dir_walk(root, EG_RECURSIVE | EG_WALK_ORDERED, 4,
+                          collect, &got);
+        check(res < 0 && got.n == 10, "Stop early, ordered");
+        names_free(&got);
+
+        snprintf(buf, sizeof(buf), "%s/nonexistent", base);
+        errno = 0;
+        res = eg_dir_walk(buf, EG_RECURSIVE, 4, collect, &got);
+        check(res < 0 && errno == ENOENT && got.n == 0, "No such dir");
+        errno = 0;
+        res = eg_dir_walk(buf, EG_RECURSIVE | EG_WALK_ORDERED, 4,
+                          collect, &got);
+        check(res < 0 && errno == ENOENT && got.n == 0,
+              "No such dir, ordered");
+
+        for (uring = 0; uring <= EG_NO_URING; uring += EG_NO_URING) {
+                const char *how = uring ? "threads" : "io_uring";
+
+                memset(&data, 0, sizeof(data));
+                res = eg_dir_foreach_data(root, EG_RECURSIVE | uring,
+                                          check_data, &data);
+                /* Less the symlink */
+                snprintf(buf, sizeof(buf), "Read data, %s", how);
+                check(res == 0 && data.nfiles == ref.n - 1
+                      && data.nbad == 0, buf);
+
+                memset(&data, 0, sizeof(data));
+                data.stop_after = 7;
+                res = eg_dir_foreach_data(root, EG_RECURSIVE | uring,
+                                          check_data, &data);
+                snprintf(buf, sizeof(buf), "Stop reading, %s", how);
+                check(res < 0 && data.nfiles == 7, buf);
+
+                snprintf(buf, sizeof(buf), "%s/nonexistent", base);
+                memset(&data, 0, sizeof(data));
+                errno = 0;
+                res = eg_dir_foreach_data(buf, EG_RECURSIVE | uring,
+                                          check_data, &data);
+                snprintf(buf, sizeof(buf), "No dir to read, %s", how);
+                check(res < 0 && errno == ENOENT && data.nfiles == 0, buf);
+        }
+
+        check_cache(base, root, ref.n, 0);
+        check_cache(base, root, ref.n, EG_WALK_WATCH);
+        check_cache_mount(base);
+        check_dirstack(root);
+
+        names_free(&got);
+        names_free(&ref);
+        remove_tree(base);
+        return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * test_fletcher32.c - Check eg_fletcher32() and the streaming calls
+ * against the plain definition, for all sorts of lengths, alignments
+ * and ways of cutting the data up.
+ */
+#include <eg-devel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* By the book: both sums start at 0xffff, and 0 is written 0xffff */
+static uint32_t
+reference(const unsigned char *p, size_t nbytes)
+{
+        uint64_t sum1 = 0xffff, sum2 = 0xffff;
+        size_t i;
+
+        for (i = 0; i < nbytes; i += 2) {
+                uint16_t w = 0;
+
+                if (i + 1 < nbytes)
+                        memcpy(&w, p + i, 2);
+                else
+                        memcpy(&w, p + i, 1);   /* padded with zero */
+                sum1 = (sum1 + w) % 65535;
+                sum2 = (sum2 + sum1) % 65535;
+        }
+        if (!sum1)
+                sum1 = 0xffff;
+        if (!sum2)
+                sum2 = 0xffff;
+        return (uint32_t)(sum2 << 16 | sum1);
+}
+
+static uint32_t
+streamed(const unsigned char *p, size_t nbytes, unsigned int seed)
+{
+        struct eg_fletcher32_t f;
+        size_t n;
+
+        srand(seed);
+        eg_fletcher32_init(&f);
+        while (nbytes) {
+                n = rand() % 100 == 0 ? (size_t)rand() % 100000
+                                      : (size_t)rand() % 40;
+                if (n > nbytes)
+                        n = nbytes;
+                eg_fletcher32_update(&f, p, n);
+                p += n;
+                nbytes -= n;
+        }
+        return eg_fletcher32_final(&f);
+}
+
+static void
+check(int ok, const char *what)
+{
+        printf("%s: %s\n", what, ok ? "OK" : "FAILED");
+        if (!ok)
+                exit(1);
+}
+
+int
+main(void)
+{
+        size_t size = 4 << 20, len, off;
+        unsigned char *buf = malloc(size + 64);
+        uint16_t *words = malloc(size);
+        int ok;
+
+        if (!buf || !words) {
+                perror("malloc");
+                return 1;
+        }
+        srand(1);
+        for (off = 0; off < size + 64; off++)
+                buf[off] = rand();
+
+        check(eg_fletcher32(words, 0) == 0xffffffff, "Empty");
+
+        /* Every length around the vector and block sizes */
+        ok = 1;
+        for (len = 0; len < 3000 && ok; len++) {
+                memcpy(words, buf, len * 2);
+                ok = eg_fletcher32(words, len) == reference(buf, len * 2);
+        }
+        check(ok, "Short lengths");
+
+        ok = 1;
+        for (len = 5000; len < 400000 && ok; len = len * 3 / 2 + 7) {
+                memcpy(words, buf, len * 2);
+                ok = eg_fletcher32(words, len) == reference(buf, len * 2);
+        }
+        check(ok, "Long lengths");
+
+        /* The most any lane or sum ever has to hold */
+        memset(words, 0xff, size);
+        check(eg_fletcher32(words, size / 2)
+              == reference((unsigned char *)words, size), "All ones");
+        memset(words, 0xfe, size);
+        check(eg_fletcher32(words, size / 2)
+              == reference((unsigned char *)words, size), "All 0xfefe");
+        memset(words, 0, size);
+        check(eg_fletcher32(words, size / 2)
+              == reference((unsigned char *)words, size), "All zeros");
+
+        ok = 1;
+        for (off = 0; off < 64 && ok; off++) {
+                struct eg_fletcher32_t f;
+
+                eg_fletcher32_init(&f);
+                eg_fletcher32_update(&f, buf + off, 100001);
+                ok = eg_fletcher32_final(&f) == reference(buf + off, 100001);
+        }
+        check(ok, "Unaligned");
+
+        ok = 1;
+        for (len = 0; len < 200 && ok; len++)
+                ok = streamed(buf, len, len) == reference(buf, len);
+        for (len = 1000; len < size && ok; len = len * 2 + 1)
+                ok = streamed(buf, len, len) == reference(buf, len);
+        check(ok, "Streamed, odd and even pieces");
+
+        free(words);
+        free(buf);
+        return 0;
+}